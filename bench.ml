@@ -0,0 +1,168 @@
+
+(* Benchmarks the main paths through the bindings against a synthetic   *
+ * repository generated with git fast-import, reporting nanoseconds and  *
+ * words allocated per operation as JSON on stdout.  Run make bench, then *
+ * ./bench -help for the repository shape and round options.		  *)
+
+let bench_dir = ref "bench_repo"
+let commits = ref 1000
+let fanout = ref 8
+let blob_size = ref 1024
+let changes = ref 4
+let branches = ref 100
+let rounds = ref 3
+let keep = ref false ;;
+
+Arg.parse [
+	"-dir", Arg.Set_string bench_dir, "DIR  repository to generate (bench_repo)";
+	"-commits", Arg.Set_int commits, "N  commits in the history (1000)";
+	"-fanout", Arg.Set_int fanout, "F  subdirectories per level and files per leaf, F^3 files (8)";
+	"-blob-size", Arg.Set_int blob_size, "B  bytes per blob (1024)";
+	"-changes", Arg.Set_int changes, "N  files modified per commit (4)";
+	"-branches", Arg.Set_int branches, "N  extra branches for listall (100)";
+	"-rounds", Arg.Set_int rounds, "N  timed rounds per benchmark, best reported (3)";
+	"-keep", Arg.Set keep, " reuse an existing repository in DIR";
+] (fun _ -> raise (Arg.Bad "no anonymous arguments")) "bench [options]" ;;
+
+let shell cmd = match Unix.system cmd with
+	  Unix.WEXITED 0 -> ()
+	| _ -> failwith ("bench : command failed : " ^ cmd) ;;
+
+
+(* *** Repository generator *** *)
+
+let path k = let f = !fanout in
+	Printf.sprintf "d%02d/d%02d/f%02d" (k / (f*f)) (k / f mod f) (k mod f)
+
+let content k c = String.init !blob_size (fun i ->
+	if i mod 64 = 63 then '\n' else Char.chr (97 + (i*7 + k*13 + c*31) mod 26))
+
+let generate () =
+	let nfiles = !fanout * !fanout * !fanout in
+	shell ("rm -rf " ^ !bench_dir ^ " && git init -q " ^ !bench_dir);
+	let oc = Unix.open_process_out ("cd " ^ !bench_dir ^ " && git fast-import --quiet") in
+	let data s = Printf.fprintf oc "data %d\n%s\n" (String.length s) s in
+	let commit c files =
+		Printf.fprintf oc "commit refs/heads/master\nmark :%d\n" (c + 1);
+		Printf.fprintf oc "committer Bench <bench@example.com> %d +0000\n"
+			(1300000000 + c * 60);
+		data (Printf.sprintf "Commit %d" c);
+		if c > 0 then Printf.fprintf oc "from :%d\n" c;
+		List.iter (fun k -> Printf.fprintf oc "M 100644 inline %s\n" (path k);
+			data (content k c)) files in
+	commit 0 (Array.to_list (Array.init nfiles (fun k -> k)));
+	for c = 1 to !commits - 1 do
+		commit c (List.init !changes (fun j -> (c * 7919 + j * 104729) mod nfiles))
+	done;
+	for b = 0 to !branches - 1 do
+		Printf.fprintf oc "reset refs/heads/b%03d\nfrom :%d\n\n" b
+			(1 + b * !commits / (max 1 !branches))
+	done;
+	(match Unix.close_process_out oc with
+	  Unix.WEXITED 0 -> () | _ -> failwith "bench : git fast-import failed");
+	shell ("cd " ^ !bench_dir ^ " && git symbolic-ref HEAD refs/heads/master"
+		^ " && git read-tree HEAD") ;;
+
+if not (!keep && Sys.file_exists !bench_dir) then generate () ;;
+
+
+(* *** Timing *** *)
+
+let words () = let s = Gc.quick_stat () in
+	s.Gc.minor_words +. s.Gc.major_words -. s.Gc.promoted_words
+
+(* Runs f once to warm caches, then rounds times, keeping the fastest.	*
+ * f returns how many operations it performed.				*)
+let measure f =
+	ignore (f ());
+	let best = ref (infinity, 0., 0) in
+	for _round = 1 to !rounds do
+		let w = words () and t = Unix.gettimeofday () in
+		let ops = f () in
+		let t = Unix.gettimeofday () -. t and w = words () -. w in
+		let ops' = float (max 1 ops) in
+		let (ns,_,_) = !best in
+		if t *. 1e9 /. ops' < ns then best := (t *. 1e9 /. ops', w /. ops', ops)
+	done;
+	!best
+
+let results = ref []
+let bench name f =
+	prerr_string ("bench : " ^ name ^ "\n");
+	results := (name, measure f) :: !results ;;
+
+
+(* *** Benchmarks *** *)
+
+let r = Git.Repository.open1 (Filename.concat !bench_dir ".git") ;;
+let head = match Git.Reference.referent (Git.Reference.lookup r "refs/heads/master") with
+	  Git.Oid id -> id
+	| _ -> failwith "bench : refs/heads/master is not an oid" ;;
+
+let oids = let w = Git.Revwalk.create r in
+	Git.Revwalk.push w head;
+	let s = Git.Revwalk.next_packed w !commits in
+	Array.init (String.length s / Git.Oid.rawsz) (Git.Oid.of_packed s) ;;
+
+let root = Git.Commit.tree (Git.Commit.lookup r head) ;;
+let listing_oids kind l =
+	let acc = ref [] in
+	for i = l.Git.Tree.count - 1 downto 0 do
+		if (l.Git.Tree.modes.{i} land 0o170000 = 0o040000) = (kind = `Tree) then
+			acc := Git.Oid.of_packed l.Git.Tree.oids i :: !acc
+	done;
+	Array.of_list !acc ;;
+let trees = Array.append [| Git.Tree.id root |] (listing_oids `Tree (Git.Tree.walk root))
+	|> Array.map (Git.Tree.lookup r) ;;
+let blobs = listing_oids `Blob (Git.Tree.flatten root) |> Array.map (Git.Blob.lookup r) ;;
+
+let index = Git.Repository.index r ;;
+Git.Index.read index ;;
+
+bench "oid_hex_roundtrip" (fun () ->
+	Array.iter (fun o -> assert (Git.Oid.from_hex (Git.Oid.to_hex o) = o)) oids;
+	Array.length oids) ;;
+
+bench "commit_lookup" (fun () ->
+	Array.iter (fun o -> ignore (Git.Commit.lookup r o)) oids;
+	Array.length oids) ;;
+
+bench "object_lookup_many" (fun () ->
+	ignore (Git.Object.lookup_many r oids);
+	Array.length oids) ;;
+
+bench "tree_entries" (fun () ->
+	Array.iter (fun t -> ignore (Git.Tree.entries t)) trees;
+	Array.length trees) ;;
+
+bench "blob_content" (fun () ->
+	Array.iter (fun b -> ignore (Git.Blob.content b)) blobs;
+	Array.length blobs) ;;
+
+bench "index_get" (fun () ->
+	let n = Git.Index.entrycount index in
+	for i = 0 to n - 1 do ignore (Git.Index.get index i) done;
+	n) ;;
+
+bench "index_write" (fun () -> Git.Index.write index;  1) ;;
+
+bench "reference_listall" (fun () ->
+	ignore (Git.Reference.listall r 7);  1) ;;	(* GIT_REF_LISTALL *)
+
+bench "parent_chase" (fun () ->
+	let rec chase c n = if Git.Commit.parentcount c = 0 then n
+		else chase (Git.Commit.parent c 0) (n + 1) in
+	chase (Git.Commit.lookup r head) 1) ;;
+
+
+(* *** Report *** *)
+
+let () =
+	Printf.printf "{\n  \"config\": { \"commits\": %d, \"fanout\": %d, \"files\": %d, \"blob_size\": %d, \"changes\": %d, \"branches\": %d, \"rounds\": %d },\n"
+		!commits !fanout (Git.Index.entrycount index) !blob_size !changes !branches !rounds;
+	print_string "  \"results\": [";
+	List.iteri (fun i (name, (ns, w, ops)) ->
+		Printf.printf "%s\n    { \"name\": \"%s\", \"ops\": %d, \"ns_per_op\": %.1f, \"words_per_op\": %.2f }"
+			(if i = 0 then "" else ",") name ops ns w)
+		(List.rev !results);
+	print_string "\n  ]\n}\n" ;;
@@ -1,5 +1,35 @@
 
 
+(* *** Bulk Results *** *)
+
+(* Bulk operations return oids packed back to back, either in a string or *
+ * in a bigstring, and numeric columns as intarrays.  Bigarray storage	   *
+ * lives outside the OCaml heap.					   *)
+
+type bigstring =
+	(char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+type intarray = (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(* String tables pack many strings into one, with string i spanning the	 *
+ * bytes from offsets.{i} up to offsets.{i+1}.				 *)
+
+type strtab = { strings : string; offsets : intarray }
+
+module type STRTAB = sig
+  val length : strtab -> int
+  val get : strtab -> int -> string
+  val to_array : strtab -> string array
+end ;;
+
+module Strtab : STRTAB = struct
+  let length t = Bigarray.Array1.dim t.offsets - 1
+  let get t i = let o = t.offsets in
+	String.sub t.strings o.{i} (o.{i+1} - o.{i})
+  let to_array t = Array.init (length t) (get t)
+end ;;
+
+
 (* *** Git SHA Object Ids *** *)
 
 (* We implement gid_oid as anonymous type strings because ocaml strings	 *
@@ -7,10 +37,39 @@
  * shortening for now since no other objects need it. 			 *)
 
 module type OID = sig
+  val rawsz : int
   val hexsz : int
   type t   			 (* let's forget that oids are strings    *)
   val from_hex : string -> t
   val to_hex : t -> string
+  val of_packed : string -> int -> t
+  val of_bigstring : bigstring -> int -> t
+
+  type oid = t
+  module Set : sig
+    type t
+    val create : int -> t
+    val add : t -> oid -> bool
+    val mem : t -> oid -> bool
+    val cardinal : t -> int
+    val clear : t -> unit
+    val add_packed : t -> string -> int
+    val add_bigstring : t -> bigstring -> int
+    val mem_packed : t -> string -> Bytes.t
+    val to_packed : t -> string
+  end
+  module Table : sig
+    type t
+    val create : int -> t
+    val replace : t -> oid -> int -> unit
+    val find : t -> oid -> int
+    val find_opt : t -> oid -> int option
+    val mem : t -> oid -> bool
+    val length : t -> int
+    val clear : t -> unit
+    val replace_packed : t -> string -> int -> unit
+    val find_packed : t -> string -> int -> intarray
+  end
 end ;;
 
 module Oid : OID = struct
@@ -19,6 +78,49 @@ module Oid : OID = struct
   type t = string 
   external from_hex : string -> t = "ocaml_git_oid_from_hex" 
   external to_hex : t -> string = "ocaml_git_oid_to_hex" 
+  let of_packed s i = String.sub s (i * rawsz) rawsz
+  let of_bigstring b i = Bytes.unsafe_to_string
+	(Bytes.init rawsz (fun j -> Bigarray.Array1.get b (i * rawsz + j)))
+
+  (* Sets and tables live in C as open addressing hash tables over packed  *
+   * oids, costing 20 bytes per slot for sets and 24 for tables, whose	    *
+   * values must fit in 32 bits : replacing with a wider one raises	    *
+   * invalid_argument.  The create argument is a size hint, where	    *
+   * negative counts as 0 and impossibly large raises invalid_argument.    *
+   * The bulk operations take packed oids, add_packed returns how many	    *
+   * were new, mem_packed returns a bitmap read with Odb.bitmap_get, and    *
+   * replace_packed maps oid i to base + i.				    *)
+  type oid = t
+
+  module Set = struct
+    type t
+    external create : int -> t		= "ocaml_git_oidset_create"
+    external add : t -> oid -> bool		= "ocaml_git_oidtab_add"
+    external mem : t -> oid -> bool		= "ocaml_git_oidtab_mem"
+    external cardinal : t -> int		= "ocaml_git_oidtab_cardinal"
+    external clear : t -> unit			= "ocaml_git_oidtab_clear"
+    external add_packed : t -> string -> int	= "ocaml_git_oidtab_add_packed"
+    external add_bigstring : t -> bigstring -> int
+					= "ocaml_git_oidtab_add_packed"
+    external mem_packed : t -> string -> Bytes.t
+					= "ocaml_git_oidtab_mem_packed"
+    external to_packed : t -> string		= "ocaml_git_oidtab_to_packed"
+  end
+
+  module Table = struct
+    type t
+    external create : int -> t		= "ocaml_git_oidtable_create"
+    external replace : t -> oid -> int -> unit	= "ocaml_git_oidtab_replace"
+    external find : t -> oid -> int		= "ocaml_git_oidtab_find"
+    let find_opt t k = try Some (find t k) with Not_found -> None
+    external mem : t -> oid -> bool		= "ocaml_git_oidtab_mem"
+    external length : t -> int			= "ocaml_git_oidtab_cardinal"
+    external clear : t -> unit			= "ocaml_git_oidtab_clear"
+    external replace_packed : t -> string -> int -> unit
+					= "ocaml_git_oidtab_replace_packed"
+    external find_packed : t -> string -> int -> intarray
+					= "ocaml_git_oidtab_find_packed"
+  end
 end ;;
 
 
@@ -36,6 +138,21 @@ module type INDEX = sig
 	flags : int;	flags_extended : int;
 	path : string }
 
+  (* Columns are indexed by entry position, oids are packed Oid.rawsz bytes *
+   * per entry, and times are whole seconds as in entry.		     *)
+  type snapshot = {
+	count : int;
+	ctimes : intarray;	mtimes : intarray;
+	sizes : intarray;	modes : intarray;
+	inos : intarray;	entry_flags : intarray;
+	devs : intarray;	uids : intarray;
+	gids : intarray;
+	oids : string;
+	paths : strtab }
+
+  type changes = { modified : strtab; deleted : strtab; racy : strtab;
+		   rehashed : int }
+
   val open_bare : string -> t
   val clear : t -> unit
   val free : t -> unit
@@ -45,8 +162,12 @@ module type INDEX = sig
   val add : t -> string -> int -> unit
   val remove : t -> int -> unit
   val insert : t -> entry -> unit
+  val insert_many : t -> entry array -> unit
+  val add_many : t -> snapshot -> unit
   val get : t -> int -> entry
   val entrycount : t -> int
+  val snapshot : t -> snapshot
+  val status : ?threads:int -> ?index_path:string -> t -> workdir:string -> changes
 end ;;
 
 module Index : INDEX = struct
@@ -59,6 +180,19 @@ module Index : INDEX = struct
 	flags : int;	flags_extended : int;
 	path : string }
 
+  type snapshot = {
+	count : int;
+	ctimes : intarray;	mtimes : intarray;
+	sizes : intarray;	modes : intarray;
+	inos : intarray;	entry_flags : intarray;
+	devs : intarray;	uids : intarray;
+	gids : intarray;
+	oids : string;
+	paths : strtab }
+
+  type changes = { modified : strtab; deleted : strtab; racy : strtab;
+		   rehashed : int }
+
   external open_bare : string -> t	= "ocaml_git_index_open_bare"
   external clear : t -> unit		= "ocaml_git_index_clear"
   external free : t -> unit		= "ocaml_git_index_free"
@@ -69,12 +203,69 @@ module Index : INDEX = struct
   external add : t -> string -> int -> unit = "ocaml_git_index_add"
   external remove : t -> int -> unit	= "ocaml_git_index_remove"
   external insert : t -> entry -> unit	= "ocaml_git_index_insert"
+
+  (* Bulk loads merge their entries with those already present, sorting *
+   * once by path and stage and keeping only the last of any duplicates, *
+   * so new entries replace old ones.  The result is written straight to *
+   * the index file, then read back, so unlike insert, bulk loads also	 *
+   * write the index.  add_many takes the columnar layout of snapshot,	 *
+   * the first count rows of each column.				 *)
+  external insert_many : t -> entry array -> unit
+				= "ocaml_git_index_insert_many"
+  external add_many : t -> snapshot -> unit	= "ocaml_git_index_add_many"
   external get : t -> int -> entry	= "ocaml_git_index_get"
   external entrycount : t -> int	= "ocaml_git_index_entrycount"
+  external snapshot : t -> snapshot	= "ocaml_git_index_snapshot"
+
+  (* Compares the working tree against the index by stat data, from	*
+   * several threads, rehashing only files whose stat data changed but	*
+   * whose size did not.  Nothing gets written to the database.  Racy	*
+   * entries look clean but were modified no earlier than the index file *
+   * at index_path, by default workdir/.git/index, so only a rehash can	*
+   * tell, and every entry counts as racy if that file is missing.	*
+   * Untracked files are not looked for.				*)
+  external _status : t -> string -> int -> int -> changes
+				= "ocaml_git_index_status"
+  let status ?(threads=4) ?index_path ix ~workdir =
+	let p = match index_path with Some p -> p
+		| None -> Filename.concat (Filename.concat workdir ".git") "index" in
+	let mtime = try int_of_float (Unix.stat p).Unix.st_mtime
+		with Unix.Unix_error _ -> min_int in
+	_status ix workdir mtime threads
 end ;;
   (* Note that git_repository_index is identical to git_index_open_inrepo *)
 
 
+(* *** Database Object Types *** *)
+
+type object_t
+type commit_t
+type tree_t
+type blob_t
+type tag_t
+
+(* You should not rearrange these type constructors because their values  *
+ * match the libgit2 enum git_otype and the git file format specification *)
+
+type object_u = Invalid_object
+	| Ext1 of object_t
+	| Commit of commit_t
+	| Tree of tree_t
+	| Blob of blob_t
+	| Tag of tag_t
+	| Ext2 of object_t
+	| OfsDelta of object_t
+	| RefDelta of object_t ;;
+
+type object_type = 	
+  	  Ext1_e	| Commit_e	| Tree_e
+	| Blob_e	| Tag_e 	| Ext2_e
+	| OfsDelta_e	| RefDelta_e	| Invalid_e ;;
+
+type timeo = { time:float; offset:int } ;; (* ocaml prefers float for time *)
+type signature = { name:string; email:string; time:timeo } ;;
+
+
 (* *** Object Databases  *** *)
 
 (* For now, we suppress all lower level database routines aimed at custom *
@@ -84,14 +275,93 @@ end ;;
 module type ODB = sig
   type t
   val exists : t -> Oid.t -> bool
+  val exists_many : t -> Oid.t array -> Bytes.t
+  val bitmap_get : Bytes.t -> int -> bool
+
+  type objects = { count : int; oids : string; types : intarray; sizes : intarray }
+  val reachable : ?types:bool -> ?sizes:bool -> t ->
+	tips:Oid.t array -> exclude:Oid.t array -> objects
+
+  module Reader : sig
+    type reader
+    val open_read : t -> Oid.t -> reader
+    val size : reader -> int
+    val read_into : reader -> Bytes.t -> int -> int -> int
+    val close : reader -> unit
+  end
+
+  module Batch : sig
+    type batch
+    val create : ?level:int -> t -> string -> batch
+    val write : batch -> object_type -> string -> Oid.t
+    val mem : batch -> Oid.t -> bool
+    val read : batch -> Oid.t -> object_type * string
+    val count : batch -> int
+    val commit : batch -> string option
+    val abort : batch -> unit
+  end
 end ;;
 
 module Odb : ODB = struct
   type t 
   external exists : t -> Oid.t -> bool = "ocaml_git_odb_exists" 
-end ;;
 
-(* TODO : ODB streams methods? *)
+  (* Checks the whole batch in one call, probing in sorted oid order. The *
+   * result holds one bit per oid, read with bitmap_get.		  *)
+  external exists_many : t -> Oid.t array -> Bytes.t
+				= "ocaml_git_odb_exists_many"
+  let bitmap_get b i = (Char.code (Bytes.get b (i lsr 3))) land (1 lsl (i land 7)) <> 0
+
+  (* Lists every object reachable from tips but not from exclude, once	*
+   * each, as packed oids.  The walk parses commits, tags and trees in C  *
+   * and never reads blobs unless sizes are asked for.  Columns not asked  *
+   * for come back empty, types hold git_otype values as in object_type.  *)
+  type objects = { count : int; oids : string; types : intarray; sizes : intarray }
+  external _reachable : t -> Oid.t array -> Oid.t array -> int -> objects
+				= "ocaml_git_odb_reachable"
+  let reachable ?(types=false) ?(sizes=false) odb ~tips ~exclude =
+	_reachable odb tips exclude
+		((if types then 1 else 0) lor (if sizes then 2 else 0))
+
+  (* Readers copy an object's content out in chunks, into a buffer the	*
+   * caller may reuse, much like Unix.read.  read_into returns 0 at the	*
+   * end of the object.  Readers are closed by the GC if not before.	*
+   * Loose objects are inflated from their file a chunk at a time, but	*
+   * packed objects are not streamed : they are read whole into C memory *
+   * first and only handed out in chunks.				*)
+  module Reader = struct
+    type reader
+    external open_read : t -> Oid.t -> reader	= "ocaml_git_odb_reader_open"
+    external size : reader -> int		= "ocaml_git_odb_reader_size"
+    external read_into : reader -> Bytes.t -> int -> int -> int
+					= "ocaml_git_odb_reader_read_into"
+    external close : reader -> unit		= "ocaml_git_odb_reader_close"
+  end
+
+  (* Batches collect new objects in memory, deflated and deduplicated by  *
+   * oid, and commit them to the pack directory given to create, usually  *
+   * .git/objects/pack, as one pack and index, without deltas.  Until the *
+   * commit, the database serves them to lookups from memory, as does	  *
+   * read, which raises Not_found for oids outside the batch.  After it,  *
+   * they come from the pack once libgit2 rescans the pack directory.	  *
+   * Level is zlib's, -1 for its default.  Committing an empty batch	  *
+   * writes nothing.							  *)
+  module Batch = struct
+    type batch
+    external _create : t -> string -> int -> batch
+					= "ocaml_git_odb_batch_create"
+    let create ?(level = -1) odb dir = _create odb dir level
+    external write : batch -> object_type -> string -> Oid.t
+					= "ocaml_git_odb_batch_write"
+    external mem : batch -> Oid.t -> bool	= "ocaml_git_odb_batch_mem"
+    external read : batch -> Oid.t -> object_type * string
+					= "ocaml_git_odb_batch_read"
+    external count : batch -> int		= "ocaml_git_odb_batch_count"
+    external _commit : batch -> string	= "ocaml_git_odb_batch_commit"
+    let commit b = if count b = 0 then None else Some (_commit b)
+    external abort : batch -> unit		= "ocaml_git_odb_batch_abort"
+  end
+end ;;
 
 
 (* *** Repositories *** *)
@@ -121,36 +391,6 @@ module Repository : REPOSITORY = struct
 end ;;
 
 
-(* *** Database Object Types *** *)
-
-type object_t
-type commit_t
-type tree_t
-type blob_t
-type tag_t
-
-(* You should not rearrange these type constructors because their values  *
- * match the libgit2 enum git_otype and the git file format specification *)
-
-type object_u = Invalid_object
-	| Ext1 of object_t
-	| Commit of commit_t
-	| Tree of tree_t
-	| Blob of blob_t
-	| Tag of tag_t
-	| Ext2 of object_t
-	| OfsDelta of object_t
-	| RefDelta of object_t ;;
-
-type object_type = 	
-  	  Ext1_e	| Commit_e	| Tree_e
-	| Blob_e	| Tag_e 	| Ext2_e
-	| OfsDelta_e	| RefDelta_e	| Invalid_e ;;
-
-type timeo = { time:float; offset:int } ;; (* ocaml prefers float for time *)
-type signature = { name:string; email:string; time:timeo } ;;
-
-
 (* *** Unspecified Database Objects *** *)
 
 (* All the methods implemented for general objects must be reimplemented   *
@@ -162,6 +402,7 @@ module type OBJECT = sig
   val id : t -> Oid.t
   val owner : t -> Repository.t
   val lookup : Oid.t -> object_u
+  val lookup_many : Repository.t -> Oid.t array -> object_u array
 end ;;
 
 module Object : OBJECT = struct
@@ -170,6 +411,9 @@ module Object : OBJECT = struct
   external owner : t -> Repository.t	= "ocaml_git_object_owner" 
   external lookup : Oid.t -> object_u
 	= "ocaml_git_object_lookup" ;;
+  external lookup_many : Repository.t -> Oid.t array -> object_u array
+	= "ocaml_git_object_lookup_many" ;;
+	(* Missing oids come back as Invalid_object *)
 end ;;
 
 
@@ -196,6 +440,8 @@ end ;;
 
 module type TREE = sig
   type t = tree_t
+  type order = Preorder | Postorder
+  type listing = { count : int; paths : strtab; modes : intarray; oids : string }
   val lookup : Repository.t -> Oid.t -> t
   val id : t -> Oid.t
   val owner : t -> Repository.t
@@ -203,10 +449,25 @@ module type TREE = sig
   val entry_byindex : t -> int -> TreeEntry.t
   val entry_byname : t -> string -> TreeEntry.t
   val entries : t -> TreeEntry.t array
+  val walk : ?order:order -> t -> listing
+  val flatten : ?prefix:string -> ?max_depth:int -> t -> listing
+
+  type status = Added | Deleted | Modified
+  type change = { status : status; path : string;
+		old_mode : int; new_mode : int; old_id : Oid.t; new_id : Oid.t }
+  val diff : ?prefix:string -> Repository.t -> t -> t -> change array
+
+  type pattern = Fixed of string
+  type matches = { count : int; files : strtab; file : intarray;
+		lines : intarray; offsets : intarray }
+  val grep : ?prefix:string -> ?workers:int -> ?path:string ->
+	Repository.t -> t -> pattern -> matches
 end ;;
 
 module Tree : TREE = struct
   type t = tree_t
+  type order = Preorder | Postorder
+  type listing = { count : int; paths : strtab; modes : intarray; oids : string }
   external lookup : Repository.t -> Oid.t -> t
 	= "ocaml_git_tree_lookup"
   external id : t -> Oid.t		= "ocaml_git_object_id" 
@@ -218,6 +479,68 @@ module Tree : TREE = struct
   external entry_byname : t -> string -> TreeEntry.t
 	= "ocaml_git_tree_entry_byname" 
   let entries tree = Array.init (entrycount tree) (fun i -> entry_byindex tree i)
+
+  (* Both walk the whole tree inside C and return full paths.  The walk   *
+   * lists subtrees too, ahead of or after their contents, while flatten  *
+   * lists only the non-tree entries under prefix, plus any subtree that  *
+   * lies deeper than max_depth directories below the root.		  *)
+  external _walk : t -> string -> int -> int -> listing = "ocaml_git_tree_walk"
+  let walk ?(order=Preorder) tree =
+	_walk tree "" (-1) (match order with Preorder -> 2 | Postorder -> 3)
+  let flatten ?(prefix="") ?(max_depth=(-1)) tree = _walk tree prefix max_depth 0
+
+  (* Lists the files that differ between two trees, in path order, like *
+   * git diff-tree -r.  Subtrees with equal oids are skipped unread.	  *
+   * Added files have old_mode 0 and a zero old_id, deleted files the	  *
+   * same on the new side.  A path turning from a file into a directory  *
+   * shows up as a deletion plus additions.				  *)
+  type status = Added | Deleted | Modified
+  type change = { status : status; path : string;
+		old_mode : int; new_mode : int; old_id : Oid.t; new_id : Oid.t }
+  external _diff : Repository.t -> string -> t -> t -> change array
+				= "ocaml_git_tree_diff"
+  let diff ?(prefix="") repo a b = _diff repo prefix a b
+
+  (* Searches the files under prefix for a fixed string, scanning blobs  *
+   * in place in C and skipping binary ones, as git grep does.  Each	 *
+   * match gives the index in files of its path, its line, counted from *
+   * 1, and its byte offset in the file.  Matches come in path order and *
+   * never overlap.  Given the repository's path, workers threads, 4 by *
+   * default, scan in parallel, each through a repository of its own.	 *
+   * Without it the calling thread scans alone, and asking for more	 *
+   * workers is invalid_argument.					 *)
+  type pattern = Fixed of string
+  type matches = { count : int; files : strtab; file : intarray;
+		lines : intarray; offsets : intarray }
+  external _grep : Repository.t -> t -> string -> string -> (string * int) option
+		-> matches = "ocaml_git_tree_grep"
+  let grep ?(prefix="") ?workers ?path repo tree (Fixed s) =
+	_grep repo tree prefix s (match path, workers with
+		  Some p, Some k -> Some (p, k)
+		| Some p, None -> Some (p, 4)
+		| None, (None | Some 1) -> None
+		| None, Some _ -> invalid_arg "Git.Tree.grep : workers need a path")
+end ;;
+
+
+(* *** Tree Builders *** *)
+
+(* Builds trees for Commit.create without staging through an index.	  *
+ * Each edit is a path, a mode, and an oid.  The mode is one of		  *
+ * 0o40000, 0o100644, 0o100755, 0o120000 or 0o160000, or 0 to remove	  *
+ * the path, and any other is invalid_argument.  Edits need not be	  *
+ * sorted, and the last edit to a path wins.  Only directories along	  *
+ * edited paths get rewritten, bottom up, and directories left empty	  *
+ * disappear.  Returns the new root tree.				  *)
+
+module type TREEBUILDER = sig
+  val of_paths : Repository.t -> base:Tree.t option ->
+	(string * int * Oid.t) array -> Oid.t
+end ;;
+
+module TreeBuilder : TREEBUILDER = struct
+  external of_paths : Repository.t -> base:Tree.t option ->
+	(string * int * Oid.t) array -> Oid.t = "ocaml_git_treebuilder_of_paths"
 end ;;
 
 
@@ -234,9 +557,25 @@ module type COMMIT = sig
   val committer : t -> signature
   val author : t -> signature
   val tree : t -> Tree.t
+  val tree_id : t -> Oid.t
   val parentcount : t -> int
   val parent : t -> int -> t
+  val parent_id : t -> int -> Oid.t
+  val parent_ids : t -> Oid.t array
   val parents : t -> t lazy_t array
+
+  type info = { tree_id : Oid.t; parent_ids : Oid.t array;
+		author : signature; committer : signature;
+		time : timeo; message_short : string }
+  val info : t -> info
+
+  type columns = {
+	count : int;
+	times : intarray;	offsets : intarray;
+	parents : string;	parent_offsets : intarray;
+	authors : intarray;	committers : intarray;
+	names : strtab;		emails : strtab }
+  val log_columns : Repository.t -> Oid.t array -> columns
   val create : Repository.t -> string -> signature -> signature -> string -> Oid.t -> Oid.t array -> Oid.t
   val create_o : Repository.t -> string -> signature -> signature -> string -> Tree.t -> t array -> Oid.t
 end ;;
@@ -253,11 +592,35 @@ module Commit : COMMIT = struct
   external committer : t -> signature	= "ocaml_git_commit_committer" 
   external author : t -> signature	= "ocaml_git_commit_author" 
   external tree : t -> Tree.t		= "ocaml_git_commit_tree" 
+  external tree_id : t -> Oid.t		= "ocaml_git_commit_tree_id"
 
   external parentcount : t -> int	= "ocaml_git_commit_parentcount"
   external parent : t -> int -> t	= "ocaml_git_commit_parent"
+  external parent_id : t -> int -> Oid.t	= "ocaml_git_commit_parent_id"
+  (* All of them from one read, where parent_id reads the commit per call. *)
+  external parent_ids : t -> Oid.t array	= "ocaml_git_commit_parent_ids"
   let parents c = Array.init (parentcount c) (fun i -> lazy (parent c i))
 
+  (* Everything above but the full message, in one crossing into C. *)
+  type info = { tree_id : Oid.t; parent_ids : Oid.t array;
+		author : signature; committer : signature;
+		time : timeo; message_short : string }
+  external info : t -> info		= "ocaml_git_commit_info"
+
+  (* Columns are indexed by position in the oid array.  Times are whole    *
+   * seconds and offsets minutes, as in Commit.time.  Commit i has the	    *
+   * packed parents parent_offsets.{i} up to parent_offsets.{i+1}, and its  *
+   * author and committer index the interned names and emails, which	    *
+   * always pair up.  Raises if any oid is not a commit.		    *)
+  type columns = {
+	count : int;
+	times : intarray;	offsets : intarray;
+	parents : string;	parent_offsets : intarray;
+	authors : intarray;	committers : intarray;
+	names : strtab;		emails : strtab }
+  external log_columns : Repository.t -> Oid.t array -> columns
+				= "ocaml_git_commit_log_columns"
+
   external create : Repository.t -> string -> signature -> signature -> string -> Oid.t -> Oid.t array -> Oid.t
 	= "ocaml_git_commit_create_bytecode" "ocaml_git_commit_create"
   external create_o : Repository.t -> string -> signature -> signature -> string -> Tree.t -> t array -> Oid.t
@@ -274,8 +637,27 @@ module type BLOB = sig
   val lookup : Repository.t -> Oid.t -> t
   val size : t -> int
   val content : t -> string
+  type view
+  val content_view : t -> view
+  module View : sig
+    val length : view -> int
+    val get : view -> int -> char
+    val blit : view -> int -> Bytes.t -> int -> int -> unit
+    val sub : view -> int -> int -> string
+    val unsafe_bigstring : view -> bigstring
+  end
   val create_fromfile : Repository.t -> string -> Oid.t
   val create_frombuffer : Repository.t -> string -> Oid.t
+  val create_fromfd : Repository.t -> Unix.file_descr -> int -> Oid.t
+
+  module Writer : sig
+    type t
+    val create : Repository.t -> int -> t
+    val write : t -> Bytes.t -> int -> int -> unit
+    val write_bigstring : t -> bigstring -> int -> int -> unit
+    val write_fd : t -> Unix.file_descr -> int
+    val finish : t -> Oid.t
+  end
 end ;;
 
 module Blob : BLOB = struct
@@ -286,10 +668,51 @@ module Blob : BLOB = struct
        = "ocaml_git_blob_lookup" 
   external size : t -> int		= "ocaml_git_blob_rawsize" 
   external content : t -> string	= "ocaml_git_blob_rawcontent" 
+
+  (* A view reads libgit2's buffer in place, which libgit2 shares with   *
+   * every handle on the blob, so View only ever reads it.  The owner	 *
+   * keeps the blob alive as long as the view.  unsafe_bigstring hands	 *
+   * out the buffer itself for APIs taking bigstrings : it must not be	 *
+   * written, nor used once the view is unreachable.			 *)
+  type view_owner
+  type view = { data : bigstring; owner : view_owner }
+  external content_view : t -> view = "ocaml_git_blob_content_view"
+  module View = struct
+    let length v = Bigarray.Array1.dim v.data
+    let get v i = Bigarray.Array1.get v.data i
+    external blit : view -> int -> Bytes.t -> int -> int -> unit
+				= "ocaml_git_blob_view_blit"
+    let sub v off len =
+	let b = Bytes.create len in  blit v off b 0 len;  Bytes.unsafe_to_string b
+    let unsafe_bigstring v = v.data
+  end
   external create_fromfile : Repository.t -> string -> Oid.t
 	= "ocaml_git_blob_create_fromfile"
   external create_frombuffer : Repository.t -> string -> Oid.t
-	= "git_blob_create_frombuffer"
+	= "ocaml_git_blob_create_frombuffer"
+
+  (* Writers stream a blob of known size into the database, hashing as  *
+   * they go, so memory stays bounded by the chunk size.  Writing more   *
+   * or finishing with less than the declared size is invalid_argument, *
+   * as is a negative size.  Errors reading the descriptor in write_fd   *
+   * raise Unix.Unix_error.                                            *)
+  module Writer = struct
+    type t
+    external create : Repository.t -> int -> t
+				= "ocaml_git_blob_writer_create"
+    external write : t -> Bytes.t -> int -> int -> unit
+				= "ocaml_git_blob_writer_write"
+    external write_bigstring : t -> bigstring -> int -> int -> unit
+				= "ocaml_git_blob_writer_write_bigstring"
+    external write_fd : t -> Unix.file_descr -> int
+				= "ocaml_git_blob_writer_write_fd"
+    external finish : t -> Oid.t = "ocaml_git_blob_writer_finish"
+  end
+
+  let create_fromfd repo fd size =
+	let w = Writer.create repo size in
+	ignore (Writer.write_fd w fd);
+	Writer.finish w
 end ;;
 
 
@@ -334,6 +757,104 @@ module Tag : TAG = struct
 end ;;
 
 
+(* *** Object Cache *** *)
+
+(* A cache keeps recently used database objects of one repository, keyed *
+ * by oid, handing back the same handle on a hit instead of a new custom  *
+ * block.  It evicts the least recently used objects once their estimated *
+ * footprint in libgit2's heap exceeds the byte budget.  Handles remain   *
+ * valid after eviction, they merely stop being shared.			  *)
+
+module type CACHE = sig
+  type t
+  type stats = { hits : int; misses : int; evictions : int;
+		 entries : int; bytes : int; budget : int }
+  val create : ?budget:int -> Repository.t -> t
+  val set_budget : t -> int -> unit
+  val lookup : t -> Oid.t -> object_u
+  val commit : t -> Oid.t -> Commit.t
+  val tree : t -> Oid.t -> Tree.t
+  val blob : t -> Oid.t -> Blob.t
+  val commit_tree : t -> Commit.t -> Tree.t
+  val parent : t -> Commit.t -> int -> Commit.t
+  val parents : t -> Commit.t -> Commit.t array
+  val stats : t -> stats
+  val clear : t -> unit
+end ;;
+
+module Cache : CACHE = struct
+  type node = { key : Oid.t; obj : object_u; size : int;
+		mutable prev : node option; mutable next : node option }
+
+  type t = {
+	repo : Repository.t;
+	table : (Oid.t, node) Hashtbl.t;
+	mutable budget : int;		mutable bytes : int;
+	mutable head : node option;	(* most recently used *)
+	mutable tail : node option;	(* next in line for eviction *)
+	mutable hits : int;		mutable misses : int;
+	mutable evictions : int }
+
+  type stats = { hits : int; misses : int; evictions : int;
+		 entries : int; bytes : int; budget : int }
+
+  external _lookup : Repository.t -> Oid.t -> object_u
+				= "ocaml_git_object_lookup"
+  external _footprint : object_u -> int = "ocaml_git_object_footprint"
+
+  let create ?(budget=64*1024*1024) repo = {
+	repo = repo;  table = Hashtbl.create 1024;
+	budget = budget;  bytes = 0;  head = None;  tail = None;
+	hits = 0;  misses = 0;  evictions = 0 }
+
+  let unlink (c:t) n =
+	(match n.prev with Some p -> p.next <- n.next | None -> c.head <- n.next);
+	(match n.next with Some x -> x.prev <- n.prev | None -> c.tail <- n.prev);
+	n.prev <- None;  n.next <- None
+
+  let push_front (c:t) n =
+	n.next <- c.head;
+	(match c.head with Some h -> h.prev <- Some n | None -> c.tail <- Some n);
+	c.head <- Some n
+
+  let rec evict (c:t) = if c.bytes > c.budget then match c.tail with
+	  Some n -> unlink c n;  Hashtbl.remove c.table n.key;
+		c.bytes <- c.bytes - n.size;
+		c.evictions <- c.evictions + 1;  evict c
+	| None -> ()
+
+  let set_budget (c:t) b = c.budget <- b;  evict c
+
+  let find (c:t) id fetch = try
+	let n = Hashtbl.find c.table id in
+	c.hits <- c.hits + 1;  unlink c n;  push_front c n;  n.obj
+    with Not_found ->
+	c.misses <- c.misses + 1;
+	let o = fetch () in
+	let n = { key = id; obj = o; size = _footprint o; prev = None; next = None } in
+	Hashtbl.replace c.table id n;  push_front c n;
+	c.bytes <- c.bytes + n.size;  evict c;  o
+
+  let lookup (c:t) id = find c id (fun () -> _lookup c.repo id)
+  let commit (c:t) id = match find c id (fun () -> Commit (Commit.lookup c.repo id)) with
+	  Commit x -> x | _ -> invalid_arg "Git.Cache.commit : not a commit"
+  let tree (c:t) id = match find c id (fun () -> Tree (Tree.lookup c.repo id)) with
+	  Tree x -> x | _ -> invalid_arg "Git.Cache.tree : not a tree"
+  let blob (c:t) id = match find c id (fun () -> Blob (Blob.lookup c.repo id)) with
+	  Blob x -> x | _ -> invalid_arg "Git.Cache.blob : not a blob"
+
+  let commit_tree c x = tree c (Commit.tree_id x)
+  let parent c x i = commit c (Commit.parent_id x i)
+  let parents c x = Array.map (commit c) (Commit.parent_ids x)
+
+  let stats (c:t) = { hits = c.hits; misses = c.misses; evictions = c.evictions;
+	entries = Hashtbl.length c.table; bytes = c.bytes; budget = c.budget }
+
+  let clear (c:t) = Hashtbl.clear c.table;
+	c.head <- None;  c.tail <- None;  c.bytes <- 0
+end ;;
+
+
 (* *** References *** *)
 
 (* References are used to track the heads of each branch *)
@@ -350,6 +871,10 @@ module type REFERENCE = sig
   val referent : t -> referent_t
   val resolution : t -> object_u
   val listall : Repository.t -> int -> string array
+
+  type snapshot = { count : int; names : strtab; targets : string;
+		    symbolic : strtab; peeled : string }
+  val snapshot : ?prefix:string -> Repository.t -> snapshot
 end ;;
 
 module Reference : REFERENCE = struct
@@ -372,7 +897,376 @@ module Reference : REFERENCE = struct
 	| Invalid_referent -> Invalid_object
   external listall : Repository.t -> int -> string array
 				= "ocaml_git_reference_listall" 
+
+  (* Lists every reference whose name starts with prefix, sorted by name,  *
+   * in one call.  Direct references have their packed oid in targets and  *
+   * an empty symbolic target, while symbolic references have the zero oid *
+   * in targets.  The packed peeled oids follow annotated tags down to the *
+   * object they name, after resolving symbolic references, and are zero   *
+   * for dangling references.						    *)
+  type snapshot = { count : int; names : strtab; targets : string;
+		    symbolic : strtab; peeled : string }
+  external _snapshot : Repository.t -> string -> snapshot
+				= "ocaml_git_reference_snapshot"
+  let snapshot ?(prefix="") repo = _snapshot repo prefix
 end ;;
 
 
+(* *** Revision Walking *** *)
+
+(* A revision walker streams the oids of commits reachable from the pushed  *
+ * commits but not from the hidden ones.  Use next_batch or next_packed for  *
+ * long histories, since they cross into C once per batch, not per commit. *)
+
+module type REVWALK = sig
+  type t
+  type sorting = Topological | Time | Reverse
+  val create : Repository.t -> t
+  val reset : t -> unit
+  val push : t -> Oid.t -> unit
+  val hide : t -> Oid.t -> unit
+  val sorting : t -> sorting list -> unit
+  val next : t -> Oid.t option
+  val next_batch : t -> bigstring -> int -> int
+  val next_packed : t -> int -> string
+end ;;
+
+module Revwalk : REVWALK = struct
+  type t
+  type sorting = Topological | Time | Reverse
+  external create : Repository.t -> t	= "ocaml_git_revwalk_new"
+  external reset : t -> unit		= "ocaml_git_revwalk_reset"
+  external push : t -> Oid.t -> unit	= "ocaml_git_revwalk_push"
+  external hide : t -> Oid.t -> unit	= "ocaml_git_revwalk_hide"
+
+  external _sorting : t -> int -> unit	= "ocaml_git_revwalk_sorting"
+  let sorting w l = _sorting w (List.fold_left (fun m -> function
+	  Topological -> m lor 1 | Time -> m lor 2 | Reverse -> m lor 4) 0 l)
+	(* See the GIT_SORT_* flags in git2/revwalk.h *)
+
+  external next_batch : t -> bigstring -> int -> int
+				= "ocaml_git_revwalk_next_batch"
+  external next_packed : t -> int -> string
+				= "ocaml_git_revwalk_next_packed"
+  let next w = match next_packed w 1 with
+	  "" -> None
+	| s -> Some (Oid.of_packed s 0)
+end ;;
+
 
+(* *** Commit Graphs *** *)
+
+(* A commit graph file lists every commit reachable from some heads with  *
+ * its parents, time and generation number, the length of its longest	   *
+ * parent chain.  Loaded graphs are memory mapped, and ancestry queries	   *
+ * run in C over the mapping, cutting off at generations too low to	   *
+ * matter.  write with a base graph only parses commits the base lacks,	   *
+ * and update writes and reloads the same file.  Queries involving a	   *
+ * commit missing from the graph fall back to walking commits in OCaml,	   *
+ * newest first by commit time, using the graph wherever it can.	   *
+ * merge_base returns every best common ancestor, count_between a b counts *
+ * the commits reachable from b but not from a, like git rev-list --count.*)
+
+module type COMMITGRAPH = sig
+  type t
+  val write : ?base:t -> Repository.t -> string -> Oid.t array -> unit
+  val load : Repository.t -> string -> t
+  val update : t -> Oid.t array -> t
+  val count : t -> int
+  val mem : t -> Oid.t -> bool
+  val generation : t -> Oid.t -> int
+  val is_ancestor : t -> Oid.t -> Oid.t -> bool
+  val merge_base : t -> Oid.t -> Oid.t -> Oid.t list
+  val count_between : t -> Oid.t -> Oid.t -> int
+end ;;
+
+module CommitGraph : COMMITGRAPH = struct
+  type graph
+  type t = { repo : Repository.t; path : string; graph : graph }
+
+  external _write : Repository.t -> string -> Oid.t array -> graph option -> unit
+				= "ocaml_git_commit_graph_write"
+  external _load : string -> graph	= "ocaml_git_commit_graph_load"
+  external _count : graph -> int	= "ocaml_git_commit_graph_count"
+  external _find : graph -> Oid.t -> int = "ocaml_git_commit_graph_find"
+  external _generation : graph -> int -> int
+				= "ocaml_git_commit_graph_generation"
+  external _time : graph -> int -> int	= "ocaml_git_commit_graph_time"
+  external _parents : graph -> int -> Oid.t array
+				= "ocaml_git_commit_graph_parents"
+  external _is_ancestor : graph -> int -> int -> bool
+				= "ocaml_git_commit_graph_is_ancestor"
+  external _merge_base : graph -> int -> int -> string
+				= "ocaml_git_commit_graph_merge_base"
+  external _count_between : graph -> int -> int -> int
+				= "ocaml_git_commit_graph_count_between"
+
+  let write ?base repo path heads =
+	_write repo path heads (match base with Some g -> Some g.graph | None -> None)
+  let load repo path = { repo = repo; path = path; graph = _load path }
+  let update g heads = write ~base:g g.repo g.path heads;  load g.repo g.path
+
+  let count g = _count g.graph
+  let mem g id = _find g.graph id >= 0
+  let generation g id = match _find g.graph id with
+	  -1 -> raise Not_found
+	| i -> _generation g.graph i
+
+  let parents g id = match _find g.graph id with
+	  -1 -> Commit.parent_ids (Commit.lookup g.repo id)
+	| i -> _parents g.graph i
+  let time g id = match _find g.graph id with
+	  -1 -> int_of_float (Commit.time (Commit.lookup g.repo id)).time
+	| i -> _time g.graph i
+
+  (* The fallback paints commits with flags, as the C queries do, stopping *
+   * once every queued commit is stale.					   *)
+  module Pending = Set.Make (struct type t = int * Oid.t let compare = compare end)
+  let one = 1 and two = 2 and stale = 4 and popped = 8
+
+  let paint g starts visit =
+	let flags = Hashtbl.create 64 and q = ref Pending.empty and live = ref 0 in
+	let mark id f = match Hashtbl.find_opt flags id with
+		  None -> Hashtbl.replace flags id f;
+			q := Pending.add (- (time g id), id) !q;
+			if f land stale = 0 then incr live
+		| Some old when old land popped = 0 ->
+			Hashtbl.replace flags id (old lor f);
+			if old land stale = 0 && f land stale <> 0 then decr live
+		| Some _ -> () in
+	List.iter (fun (id, f) -> mark id f) starts;
+	while !live > 0 do
+		let (_, id) as e = Pending.min_elt !q in
+		q := Pending.remove e !q;
+		let f = Hashtbl.find flags id in
+		Hashtbl.replace flags id (f lor popped);
+		if f land stale = 0 then decr live;
+		let f = visit id f in
+		Array.iter (fun p -> mark p f) (parents g id)
+	done
+
+  let count_slow g a b =
+	let n = ref 0 in
+	paint g [ (b, one); (a, stale) ] (fun _ f ->
+		if f land stale = 0 then incr n;  f);
+	!n
+
+  let is_ancestor g a b = match _find g.graph a, _find g.graph b with
+	  -1, _ | _, -1 -> count_slow g b a = 0
+	| i, j -> _is_ancestor g.graph i j
+
+  let merge_base g a b = match _find g.graph a, _find g.graph b with
+	  -1, _ | _, -1 -> let l = ref [] in
+		paint g [ (a, one); (b, two) ] (fun id f ->
+			if f land (one lor two) = one lor two && f land stale = 0
+			then (l := id :: !l;  f lor stale) else f);
+		List.rev !l
+	| i, j -> let s = _merge_base g.graph i j in
+		List.init (String.length s / Oid.rawsz) (Oid.of_packed s)
+
+  let count_between g a b = match _find g.graph a, _find g.graph b with
+	  -1, _ | _, -1 -> count_slow g a b
+	| i, j -> _count_between g.graph i j
+end ;;
+
+
+(* *** Parallel Scans *** *)
+
+(* A pool opens one repository per worker thread from the same path, since *
+ * a repository must never be used from two threads at once.  A fold splits *
+ * the oids into one range per worker.  Workers take chunks from the front  *
+ * of their own range and, once it runs dry, steal the back half of the    *
+ * largest range left.  Each worker folds over its items from its own init *
+ * and the results are merged in worker order.  OCaml code runs on one	   *
+ * core at a time, so the gain comes from libgit2 calls releasing the	   *
+ * runtime lock, as fold_objects does with one Object.lookup_many per	   *
+ * chunk.  This also requires a libgit2 built with thread support.	   *
+ * fold_objects closes each chunk's objects on its worker's thread once f  *
+ * has seen them : f may keep them, but they raise invalid_argument once   *
+ * used.  Objects f looks up itself must not outlive the pool.  Like	   *
+ * repositories, pools are never freed by the GC, so call close, which	   *
+ * frees the repositories after a full collection has finalized whatever  *
+ * objects were left unreachable.					   *)
+
+module type PARALLEL = sig
+  type t
+  val create : ?workers:int -> string -> t
+  val workers : t -> int
+  val close : t -> unit
+  val fold : t -> ?chunk:int -> init:(unit -> 'a) ->
+	f:(Repository.t -> Oid.t -> 'a -> 'a) -> merge:('a -> 'a -> 'a) ->
+	Oid.t array -> 'a
+  val fold_objects : t -> ?chunk:int -> init:(unit -> 'a) ->
+	f:(Repository.t -> Oid.t -> object_u -> 'a -> 'a) -> merge:('a -> 'a -> 'a) ->
+	Oid.t array -> 'a
+end ;;
+
+module Parallel : PARALLEL = struct
+  type t = { repos : Repository.t array; busy : Mutex.t; mutable closed : bool }
+
+  external _close_object : object_u -> unit = "ocaml_git_object_close"
+
+  let close p =
+	Mutex.lock p.busy;
+	if not p.closed then begin
+		p.closed <- true;
+		Gc.full_major ();
+		Array.iter Repository.free p.repos
+	end;
+	Mutex.unlock p.busy
+
+  let create ?(workers=4) path =
+	{ repos = Array.init (max 1 workers) (fun _ -> Repository.open1 path);
+		busy = Mutex.create (); closed = false }
+  let workers p = Array.length p.repos
+
+  type range = { mutable lo : int; mutable hi : int }
+
+  (* Hands worker w its next chunk [lo,hi), or None once all work is taken *)
+  let take lock ranges chunk w =
+	Mutex.lock lock;
+	let r = ranges.(w) in
+	if r.lo >= r.hi then begin
+		let v = ref w in
+		Array.iteri (fun i x ->
+			if x.hi - x.lo > ranges.(!v).hi - ranges.(!v).lo then v := i) ranges;
+		let x = ranges.(!v) in
+		let mid = x.lo + (x.hi - x.lo) / 2 in
+		r.lo <- mid;  r.hi <- x.hi;  x.hi <- mid
+	end;
+	let got = if r.lo >= r.hi then None else begin
+		let lo = r.lo in
+		r.lo <- min r.hi (lo + chunk);  Some (lo, r.lo) end in
+	Mutex.unlock lock;
+	got
+
+  let run p chunk n ~init ~work ~merge =
+	let k = workers p and lock = Mutex.create () in
+	let ranges = Array.init k (fun w -> { lo = w * n / k; hi = (w + 1) * n / k }) in
+	let results = Array.make k None in
+	let worker w =
+		let rec loop acc = match take lock ranges (max 1 chunk) w with
+			  Some (lo, hi) -> loop (work p.repos.(w) lo hi acc)
+			| None -> acc in
+		results.(w) <- Some (try Ok (loop (init ())) with e -> Error e) in
+	Mutex.lock p.busy;
+	if p.closed then begin
+		Mutex.unlock p.busy;  invalid_arg "Git.Parallel : pool closed" end;
+	let threads = Array.init k (Thread.create worker) in
+	Array.iter Thread.join threads;
+	Mutex.unlock p.busy;
+	let get = function
+		  Some (Ok x) -> x
+		| Some (Error e) -> raise e
+		| None -> failwith "Git.Parallel : worker died" in
+	let acc = ref (get results.(0)) in
+	for w = 1 to k - 1 do acc := merge !acc (get results.(w)) done;
+	!acc
+
+  let fold p ?(chunk=64) ~init ~f ~merge oids =
+	run p chunk (Array.length oids) ~init ~merge ~work:(fun repo lo hi acc ->
+		let acc = ref acc in
+		for i = lo to hi - 1 do acc := f repo oids.(i) !acc done;
+		!acc)
+
+  let fold_objects p ?(chunk=64) ~init ~f ~merge oids =
+	run p chunk (Array.length oids) ~init ~merge ~work:(fun repo lo hi acc ->
+		let objs = Object.lookup_many repo (Array.sub oids lo (hi - lo)) in
+		let acc = ref acc in
+		(try Array.iteri (fun i o -> acc := f repo oids.(lo + i) o !acc) objs
+		 with e -> Array.iter _close_object objs;  raise e);
+		Array.iter _close_object objs;
+		!acc)
+end ;;
+
+
+(* *** Asynchronous Requests *** *)
+
+(* An async pool serves event loops, such as Lwt or Eio, that must never  *
+ * block in libgit2.  Its C threads each own a repository opened from the *
+ * given path.  Submit queues a job and returns its ticket at once, and   *
+ * the loop waits for fd to become readable, then harvests every result  *
+ * finished so far, in no particular order.  Results hold copies of the  *
+ * data, not database objects, read into bigstrings the GC frees.  Close *
+ * lets running jobs finish and drops the rest.  The GC does the same for *
+ * pools never closed, without waiting for running jobs.		  *)
+
+module type ASYNC = sig
+  type t
+  type job = Read of Oid.t | Write of object_type * string | Resolve of string
+  type result = Object of object_type * bigstring | Written of Oid.t
+	| Resolved of Oid.t | Failed of string
+  val create : ?workers:int -> string -> t
+  val fd : t -> Unix.file_descr
+  val submit : t -> job -> int
+  val harvest : t -> (int * result) array
+  val pending : t -> int
+  val close : t -> unit
+end ;;
+
+module Async : ASYNC = struct
+  type t
+  type job = Read of Oid.t | Write of object_type * string | Resolve of string
+  type result = Object of object_type * bigstring | Written of Oid.t
+	| Resolved of Oid.t | Failed of string
+  external _create : string -> int -> t	= "ocaml_git_async_create"
+  let create ?(workers=4) path = _create path workers
+  external fd : t -> Unix.file_descr	= "ocaml_git_async_fd"
+  external submit : t -> job -> int	= "ocaml_git_async_submit"
+  external harvest : t -> (int * result) array = "ocaml_git_async_harvest"
+  external pending : t -> int		= "ocaml_git_async_pending"
+	(* jobs submitted but not yet harvested *)
+  external close : t -> unit		= "ocaml_git_async_close"
+end ;;
+
+
+(* *** Statistics *** *)
+
+(* Counts the live handles the garbage collector must finalize, by kind,  *
+ * along with an estimate of the memory each kind pins outside the OCaml   *
+ * heap.  The GC already speeds up with this memory, but services with a   *
+ * memory bound may call collect to release unreachable handles at once.   *
+ * The bytes are those charged to the GC.  Handles sharing one cached	   *
+ * object, such as a blob and its views, each count it in full, so bytes  *
+ * overestimate the memory pinned when objects are looked up repeatedly.  *)
+
+module type STATS = sig
+  type entry = { kind : string; live : int; bytes : int }
+  val get : unit -> entry array
+  val live_bytes : unit -> int
+  val collect : unit -> unit
+end ;;
+
+module Stats : STATS = struct
+  type entry = { kind : string; live : int; bytes : int }
+  external get : unit -> entry array	= "ocaml_git_stats"
+  let live_bytes () = Array.fold_left (fun n e -> n + e.bytes) 0 (get ())
+  let collect () = Gc.full_major ()
+end ;;
+
+
+(* *** Profiling *** *)
+
+(* In builds made with PROFILE=1, each generated stub records its calls,  *
+ * total time and a latency histogram, in which bucket i counts the calls *
+ * taking under 2^i nanoseconds but at least 2^(i-1).  Only stubs called  *
+ * since the last reset appear, heaviest first.  Otherwise enabled is	  *
+ * false and dump returns nothing.					  *)
+
+module type PROFILE = sig
+  type entry = { name : string; calls : int; total_ns : int; histogram : int array }
+  val enabled : bool
+  val dump : unit -> entry array
+  val reset : unit -> unit
+end ;;
+
+module Profile : PROFILE = struct
+  type entry = { name : string; calls : int; total_ns : int; histogram : int array }
+  external _enabled : unit -> bool	= "ocaml_git_profile_enabled"
+  let enabled = _enabled ()
+  external _dump : unit -> entry array	= "ocaml_git_profile_dump"
+  let dump () =
+	let a = List.filter (fun e -> e.calls > 0) (Array.to_list (_dump ())) in
+	Array.of_list (List.sort (fun a b -> compare b.total_ns a.total_ns) a)
+  external reset : unit -> unit		= "ocaml_git_profile_reset"
+end ;;
@@ -4,9 +4,25 @@
 #include <caml/memory.h>
 #include <caml/fail.h>
 #include <caml/custom.h>
+#include <caml/bigarray.h>
+#include <caml/signals.h>
+#include <caml/unixsupport.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
+#include <openssl/evp.h>
 
 #include <git2.h>
 
@@ -126,6 +142,89 @@ int custom_ptr_compare( value a, value b ) {
         *(void **)Data_custom_val(a) == *(void **)Data_custom_val(b) ));
 }
 
+// Every gced handle is counted, along with the memory it pins outside the
+// OCaml heap, by kind.  Git.Stats reports these counts.  Database objects
+// are counted under their git_otype, which doubles as their index here.
+// The bytes of each handle are exactly those it charges the collector.
+// libgit2 caches objects, so handles on the same object, such as a blob
+// and its views, each count and charge the one copy they share.  Handles
+// may be created while the runtime lock is released, hence the atomic
+// updates.
+
+#define GIT_STAT_object		0	// otypes other than the four below
+#define GIT_STAT_commit		1
+#define GIT_STAT_tree		2
+#define GIT_STAT_blob		3
+#define GIT_STAT_tag		4
+#define GIT_STAT_revwalk	5
+#define GIT_STAT_blob_view	6
+#define GIT_STAT_blob_writer	7
+#define GIT_STAT_odb_reader	8
+#define GIT_STAT_oidtab		9
+#define GIT_STAT_odb_batch	10
+#define GIT_STAT_COUNT		11
+
+struct git_stat { const char *kind; intnat live, bytes; };
+
+static struct git_stat git_stats[GIT_STAT_COUNT] = {
+	{ "object" }, { "commit" }, { "tree" }, { "blob" }, { "tag" },
+	{ "revwalk" }, { "blob_view" }, { "blob_writer" }, { "odb_reader" },
+	{ "oidtab" }, { "odb_batch" } };
+
+void git_stat_add( int kind, intnat live, intnat bytes ) {
+	__sync_fetch_and_add( &git_stats[kind].live, live );
+	__sync_fetch_and_add( &git_stats[kind].bytes, bytes );
+}
+
+int git_stat_of_otype( git_otype t )
+	{ return (t >= GIT_OBJ_COMMIT && t <= GIT_OBJ_TAG) ? t : GIT_STAT_object; }
+
+CAMLprim value
+ocaml_git_stats( value unit ) {
+	CAMLparam1(unit);
+	CAMLlocal2(r,e);
+	int i;
+	r = caml_alloc(GIT_STAT_COUNT, 0);
+	for (i=0; i < GIT_STAT_COUNT; i++) {
+		e = caml_alloc(3,0);
+		Store_field(e, 0, caml_copy_string(git_stats[i].kind));
+		Store_field(e, 1, Val_long(git_stats[i].live));
+		Store_field(e, 2, Val_long(git_stats[i].bytes));
+		Store_field(r, i, e);
+	}
+	CAMLreturn(r);
+}
+
+// We configure the ocaml garbage collector to close out git structs during
+// finilazation here.  Each custom block reports the memory it pins in
+// libgit2's heap as used, so the collector speeds up as that memory grows,
+// completing a full major cycle for every CAMLGC_max_git bytes of handles
+// allocated.  Manual handles are never finalized, so they report nothing.
+// see : http://caml.inria.fr/pub/docs/manual-ocaml/manual032.html
+
+#define CAMLGC_max_git			(64 * 1024 * 1024)
+#define CAMLGC_used_git_index		0
+#define CAMLGC_used_git_repository	0
+#define CAMLGC_used_git_odb		0
+#define CAMLGC_used_git_reference	0
+#define CAMLGC_used_git_tree_entry	0
+#define CAMLGC_used_git_revwalk		4096	// a guess, growing with the walk
+
+// Handles come into being through caml_wrap_git_ptr, which each define_...
+// macro below implements for its type.  Database objects get their own.
+// Stubs take pointers back out through Git_ptr_val, which raises on a
+// handle closed ahead of the collector, whose pointer is NULL, rather
+// than pass NULL to libgit2.
+
+void *git_ptr_check( void *p ) {
+	if (p == NULL)  caml_invalid_argument("Git : closed handle");
+	return p;
+}
+
+#define Git_ptr_val(TYPE,V)  ((TYPE *)git_ptr_check( *(void **)Data_custom_val(V) ))
+
+#define caml_wrap_git_ptr(GITTYPE,P)  caml_wrap_##GITTYPE(P)
+
 #define define_git_ptr_type_manual(N) \
 static struct custom_operations git_##N##_custom_ops = { \
     identifier:  "Git " #N " manual pointer handling", \
@@ -134,11 +233,20 @@ static struct custom_operations git_##N##_custom_ops = { \
     hash:        custom_hash_default, \
     serialize:   custom_serialize_default, \
     deserialize: custom_deserialize_default \
-};
+}; \
+value caml_wrap_git_##N( git_##N *p ) { \
+	value v = caml_alloc_custom( &git_##N##_custom_ops, \
+		sizeof(git_##N *), CAMLGC_used_git_##N, CAMLGC_max_git ); \
+	*(git_##N **)Data_custom_val(v) = p; \
+	return v; \
+}
 
 #define define_git_ptr_type_gced(N,CLOSE) \
+static void git_##N##_deferred_##CLOSE( void *p ) { git_##N##_##CLOSE(p); } \
 void custom_git_##N##_ptr_finalize (value v) { \
-	git_##N##_##CLOSE( *(git_##N **)Data_custom_val(v) ); \
+	git_##N *p = *(git_##N **)Data_custom_val(v); \
+	git_stat_add( GIT_STAT_##N, -1, -CAMLGC_used_git_##N ); \
+	repo_defer( git_##N##_repo_key(p), &git_##N##_deferred_##CLOSE, p ); \
 } \
 static struct custom_operations git_##N##_custom_ops = { \
     identifier:  "Git " #N "GCed pointer handling", \
@@ -147,164 +255,2428 @@ static struct custom_operations git_##N##_custom_ops = { \
     hash:        custom_hash_default, \
     serialize:   custom_serialize_default, \
     deserialize: custom_deserialize_default \
+}; \
+value caml_wrap_git_##N( git_##N *p ) { \
+	value v = caml_alloc_custom( &git_##N##_custom_ops, \
+		sizeof(git_##N *), CAMLGC_used_git_##N, CAMLGC_max_git ); \
+	*(git_##N **)Data_custom_val(v) = p; \
+	git_stat_add( GIT_STAT_##N, 1, CAMLGC_used_git_##N ); \
+	return v; \
+}
+
+// Arguments handed to the wrap_*_blocking macros must be copied out of the
+// OCaml heap, since the garbage collector may run and move them while we
+// wait on libgit2.  Calls into a repository also take its lock, see
+// enter_repo_section below.
+
+char *String_copy( value v ) {
+	size_t len = caml_string_length(v);
+	char *c = malloc(len + 1);
+	if (c == NULL)  caml_raise_out_of_memory();
+	memcpy(c, String_val(v), len);
+	c[len] = 0;
+	return c;
+}
+
+git_oid *Oid_copy( value v ) {
+	git_oid *o = malloc(sizeof(git_oid));
+	if (o == NULL)  caml_raise_out_of_memory();
+	memcpy(o, String_val(v), GIT_OID_RAWSZ);
+	return o;
+}
+
+#define Release_none(x)
+
+// Building with make PROFILE=1 defines GIT_PROFILE, under which every
+// wrap_* stub counts its calls and times its libgit2 call on the monotonic
+// clock into a histogram of power of two nanosecond buckets.  Each stub
+// owns a static slot, linked into a global list on its first call, which
+// Git.Profile.dump reads.  Slots are updated atomically, since blocking
+// stubs run concurrently.  Without GIT_PROFILE the hooks expand to nothing.
+
+#define PROFILE_BUCKETS	32	// bucket i counts calls under 2^i ns, the last all others
+
+struct profile_slot {
+	const char *name;
+	int linked;
+	intnat calls, total_ns, buckets[PROFILE_BUCKETS];
+	struct profile_slot *next;
 };
 
+static struct profile_slot *profile_slots = NULL;
 
-#define caml_alloc_git_ptr(GITTYPE) \
-	caml_alloc_custom( & GITTYPE##_custom_ops, \
-		sizeof(GITTYPE *), CAMLGC_used_##GITTYPE, CAMLGC_max_git )
+#ifdef GIT_PROFILE
 
-// We configure the ocaml garbage collector to close out git structs during
-// finilazation here.  Of course, the value used = 0 tells the garbage
-// colelctor that only the caml heap size matters.
-// see : http://caml.inria.fr/pub/docs/manual-ocaml/manual032.html
+static void
+profile_start( struct profile_slot *s, struct timespec *t0 ) {
+	if (!s->linked && __sync_bool_compare_and_swap(&s->linked, 0, 1))
+		do  s->next = profile_slots;
+		while (!__sync_bool_compare_and_swap(&profile_slots, s->next, s));
+	clock_gettime( CLOCK_MONOTONIC, t0 );
+}
 
-#define CAMLGC_max_git			1000000
-#define CAMLGC_used_git_index		0
-#define CAMLGC_used_git_repository	0
-#define CAMLGC_used_git_odb		0
-#define CAMLGC_used_git_object		0
-#define CAMLGC_used_git_tree		0
-#define CAMLGC_used_git_commit		0
-#define CAMLGC_used_git_blob		0
-#define CAMLGC_used_git_tag		0
-#define CAMLGC_used_git_reference	0
-#define CAMLGC_used_git_tree_entry	0
+static void
+profile_stop( struct profile_slot *s, const struct timespec *t0 ) {
+	struct timespec t1;
+	intnat ns;
+	int b = 0;
+	clock_gettime( CLOCK_MONOTONIC, &t1 );
+	ns = (t1.tv_sec - t0->tv_sec) * 1000000000L + (t1.tv_nsec - t0->tv_nsec);
+	while (b < PROFILE_BUCKETS - 1 && ns >> b)  b++;
+	__sync_fetch_and_add( &s->calls, 1 );
+	__sync_fetch_and_add( &s->total_ns, ns );
+	__sync_fetch_and_add( &s->buckets[b], 1 );
+}
+
+#define PROFILE_BEGIN(F) \
+	static struct profile_slot profile_##F = { #F }; \
+	struct timespec profile_t0; \
+	profile_start( &profile_##F, &profile_t0 )
+#define PROFILE_END(F)  profile_stop( &profile_##F, &profile_t0 )
+
+#else
+
+#define PROFILE_BEGIN(F)
+#define PROFILE_END(F)
+
+#endif
+
+CAMLprim value
+ocaml_git_profile_enabled( value unit ) {
+#ifdef GIT_PROFILE
+	return Val_true;
+#else
+	return Val_false;
+#endif
+}
+
+CAMLprim value
+ocaml_git_profile_dump( value unit ) {
+	CAMLparam1(unit);
+	CAMLlocal3(r,e,h);
+	struct profile_slot *head = profile_slots, *s;
+	size_t i, n = 0;
+	for (s = head; s; s = s->next)  n++;
+	r = caml_alloc(n, 0);
+	for (s = head, n = 0; s; s = s->next, n++) {
+		h = caml_alloc(PROFILE_BUCKETS, 0);
+		for (i=0; i < PROFILE_BUCKETS; i++)
+			Store_field(h, i, Val_long(s->buckets[i]));
+		e = caml_alloc(4,0);
+		Store_field(e, 0, caml_copy_string(s->name));
+		Store_field(e, 1, Val_long(s->calls));
+		Store_field(e, 2, Val_long(s->total_ns));
+		Store_field(e, 3, h);
+		Store_field(r, n, e);
+	}
+	CAMLreturn(r);
+}  // the fields follow the Profile.entry record in git.ml, slots linked
+   // meanwhile go ahead of head and get left out
+
+CAMLprim value
+ocaml_git_profile_reset( value unit ) {
+	struct profile_slot *s;
+	for (s = profile_slots; s; s = s->next) {
+		s->calls = s->total_ns = 0;
+		memset( s->buckets, 0, sizeof(s->buckets) );
+	}
+	return Val_unit;
+}  // slots stay linked, reporting zero calls
 
 #include "wrappers.h"
 
 
+/* *** Bulk result helpers *** */
+
+// Bulk operations return their numeric columns as bigarrays of OCaml ints,
+// type intarray in git.ml, whose storage lives outside the OCaml heap.
+// CAML_BA_CAML_INT elements are stored untagged as intnat, so we fill them
+// with plain intnat copies.
+
+value caml_alloc_intarray( intnat n ) {
+	return caml_ba_alloc_dims( CAML_BA_CAML_INT | CAML_BA_C_LAYOUT, 1, NULL, n );
+}
+
+// Growable buffers collect bulk results in C, often while the runtime lock
+// is released, so they report GIT_ENOMEM rather than raising.  We copy them
+// out into the OCaml heap or a bigarray in one go at the end.
+
+struct packbuf { char *data; size_t len, cap; };
+
+int packbuf_grow( struct packbuf *b, size_t n ) {
+	size_t cap = b->cap ? b->cap : 256;
+	char *d;
+	if (b->len + n <= b->cap)  return GIT_SUCCESS;
+	while (cap < b->len + n)  cap *= 2;
+	if ((d = realloc(b->data, cap)) == NULL)  return GIT_ENOMEM;
+	b->data = d;  b->cap = cap;
+	return GIT_SUCCESS;
+}
+
+int packbuf_put( struct packbuf *b, const void *p, size_t n ) {
+	if (packbuf_grow(b,n) != GIT_SUCCESS)  return GIT_ENOMEM;
+	memcpy( b->data + b->len, p, n );
+	b->len += n;
+	return GIT_SUCCESS;
+}
+
+int packbuf_put_int( struct packbuf *b, intnat i )
+	{ return packbuf_put(b, &i, sizeof(intnat)); }
+
+void packbuf_free( struct packbuf *b ) {
+	free(b->data);
+	b->data = NULL;  b->len = b->cap = 0;
+}
+
+value caml_copy_packbuf( struct packbuf *b ) {
+	value s = caml_alloc_string(b->len);
+	memcpy( String_val(s), b->data, b->len );
+	return s;
+}
+
+value caml_copy_packbuf_ints( struct packbuf *b ) {
+	value a = caml_alloc_intarray( b->len / sizeof(intnat) );
+	memcpy( Caml_ba_data_val(a), b->data, b->len );
+	return a;
+}
+
+// Finalizers run on whichever thread triggers the collection, possibly
+// while another thread is inside libgit2 with the runtime lock released,
+// and libgit2 is not thread safe.  So every repository gets a mutex, keyed
+// by its object database, which stubs hold around any call into it made
+// between enter_repo_section and leave_repo_section in place of the bare
+// blocking section.  Finalizers hand their close to repo_defer, which
+// runs it at once if the mutex is free, and otherwise queues it for the
+// holder to run before letting go.  Calls made with the runtime lock held
+// skip the mutex, so two threads should still not share a repository; the
+// point is that the collector never races a call.  The worker threads of
+// Parallel, Tree.grep and Async open repositories of their own.
+
+struct repo_lock {
+	const git_odb *key;
+	pthread_mutex_t mutex;
+	struct packbuf deferred;	// struct repo_deferred, guarded by repo_locks_mutex
+	struct repo_lock *next;
+};
+
+struct repo_deferred { void (*close)(void *); void *p; };
+
+static struct repo_lock *repo_locks = NULL;
+static pthread_mutex_t repo_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct repo_lock repo_lock_fallback = { NULL, PTHREAD_MUTEX_INITIALIZER };
+
+// The caller holds repo_locks_mutex.  Should we run out of memory, all
+// such repositories share the fallback lock, which is still correct.
+
+static struct repo_lock *
+repo_lock_find( const git_odb *key ) {
+	struct repo_lock *l;
+	for (l = repo_locks; l; l = l->next)
+		if (l->key == key)  return l;
+	if ((l = calloc( 1, sizeof(struct repo_lock) )) == NULL)
+		return &repo_lock_fallback;
+	l->key = key;
+	pthread_mutex_init( &l->mutex, NULL );
+	l->next = repo_locks;  repo_locks = l;
+	return l;
+}
+
+// Runs the closes queued while we held the lock, then lets go.  The
+// mutex gets unlocked under repo_locks_mutex, so a finalizer either finds
+// it still held and queues its close before our last look, or takes it.
+
+static void
+repo_unlock( struct repo_lock *l ) {
+	struct packbuf d;
+	size_t i;
+	for (;;) {
+		pthread_mutex_lock(&repo_locks_mutex);
+		d = l->deferred;
+		memset( &l->deferred, 0, sizeof(d) );
+		if (d.len == 0) {
+			pthread_mutex_unlock(&l->mutex);
+			pthread_mutex_unlock(&repo_locks_mutex);
+			return;
+		}
+		pthread_mutex_unlock(&repo_locks_mutex);
+		for (i=0; i < d.len; i += sizeof(struct repo_deferred))
+			((struct repo_deferred *)(d.data + i))->close(
+				((struct repo_deferred *)(d.data + i))->p );
+		packbuf_free(&d);
+	}
+}
+
+// A NULL key means the call touches no repository, as with bare indexes,
+// and gets a NULL lock.  repo_enter returns the lock it took for the
+// caller to hand back to repo_leave, since looking the key up again could
+// land on the fallback lock where the first lookup allocated, or the
+// other way around.
+
+struct repo_lock *repo_enter( const git_odb *key ) {
+	struct repo_lock *l;
+	if (key == NULL)  return NULL;
+	pthread_mutex_lock(&repo_locks_mutex);
+	l = repo_lock_find(key);
+	pthread_mutex_unlock(&repo_locks_mutex);
+	pthread_mutex_lock(&l->mutex);
+	return l;
+}
+
+void repo_leave( struct repo_lock *l ) {
+	if (l)  repo_unlock(l);
+}
+
+#define enter_repo_section(LK,KEY) \
+	do { caml_enter_blocking_section();  LK = repo_enter(KEY); } while (0)
+#define leave_repo_section(LK) \
+	do { repo_leave(LK);  caml_leave_blocking_section(); } while (0)
+
+#define Repo_key(R)		git_repository_database(R)
+#define Object_repo_key(O)	Repo_key( git_object_owner((git_object *)(O)) )
+
+// The keys of the handles the wrap_*_blocking macros take first.
+
+#define git_index_repo_key(I)		NULL	// no finalizer touches an index
+#define git_odb_repo_key(D)		(D)
+#define git_repository_repo_key(R)	Repo_key(R)
+#define git_commit_repo_key(C)		Object_repo_key(C)
+#define git_reference_repo_key(F)	Repo_key( git_reference_owner(F) )
+#define git_revwalk_repo_key(W)		Repo_key( git_revwalk_repository(W) )
+
+// Called from finalizers, with the runtime lock held.  Should the queue
+// fail to grow, we leak p rather than race.
+
+void repo_defer( const git_odb *key, void (*close)(void *), void *p ) {
+	struct repo_deferred d = { close, p };
+	struct repo_lock *l;
+	pthread_mutex_lock(&repo_locks_mutex);
+	l = repo_lock_find(key);
+	if (pthread_mutex_trylock(&l->mutex) == 0) {
+		pthread_mutex_unlock(&repo_locks_mutex);
+		close(p);
+		repo_unlock(l);
+	} else {
+		packbuf_put( &l->deferred, &d, sizeof(d) );
+		pthread_mutex_unlock(&repo_locks_mutex);
+	}
+}
+
+// Freeing a repository runs its queued closes first and forgets its lock.
+
+void repo_forget( const git_odb *key ) {
+	struct repo_lock *l, **pl;
+	pthread_mutex_lock(&repo_locks_mutex);
+	for (pl = &repo_locks; *pl && (*pl)->key != key; pl = &(*pl)->next)
+		;
+	l = *pl;
+	if (l)  *pl = l->next;
+	pthread_mutex_unlock(&repo_locks_mutex);
+	if (l == NULL)  return;
+	pthread_mutex_lock(&l->mutex);
+	repo_unlock(l);
+	pthread_mutex_destroy(&l->mutex);
+	free(l);
+}
+
+// A string table under construction keeps the end offset of each string,
+// the leading zero offset being added upon copying.
+
+struct strtab_buf { struct packbuf strings, ends; };
+
+int strtab_add( struct strtab_buf *t, const char *s, size_t len ) {
+	if (packbuf_put(&t->strings, s, len) != GIT_SUCCESS)  return GIT_ENOMEM;
+	return packbuf_put_int(&t->ends, t->strings.len);
+}
+
+void strtab_free( struct strtab_buf *t ) {
+	packbuf_free(&t->strings);
+	packbuf_free(&t->ends);
+}
+
+CAMLprim value caml_copy_strtab( struct strtab_buf *t ) {
+	CAMLparam0();
+	CAMLlocal3(r,s,o);
+	size_t n = t->ends.len / sizeof(intnat);
+	s = caml_copy_packbuf(&t->strings);
+	o = caml_alloc_intarray(n + 1);
+	((intnat *)Caml_ba_data_val(o))[0] = 0;
+	memcpy( (intnat *)Caml_ba_data_val(o) + 1, t->ends.data, t->ends.len );
+	r = caml_alloc(2,0);
+	Store_field(r, 0, s);
+	Store_field(r, 1, o);
+	CAMLreturn(r);
+}
+
+// Paths are matched against a directory prefix component wise, so "src"
+// selects "src" and "src/main.c" but not "srcfoo".  We distinguish paths
+// inside the prefix from directories we must still descend to reach it.
+
+#define PREFIX_OUTSIDE	0
+#define PREFIX_INSIDE	1
+#define PREFIX_ABOVE	2
+
+int path_prefix_match( const char *path, size_t len,
+		const char *prefix, size_t plen ) {
+	if (plen == 0)  return PREFIX_INSIDE;
+	if ( len >= plen && memcmp(path,prefix,plen) == 0
+			&& (len == plen || path[plen] == '/') )
+		return PREFIX_INSIDE;
+	if ( len < plen && memcmp(path,prefix,len) == 0 && prefix[len] == '/' )
+		return PREFIX_ABOVE;
+	return PREFIX_OUTSIDE;
+}
+
+size_t prefix_length( const char *prefix ) {
+	size_t plen = strlen(prefix);
+	while (plen > 0 && prefix[plen-1] == '/')  plen--;
+	return plen;
+}  // ignores trailing slashes
+
+// Tree entry modes, as git stores them.
+
+#define GIT_MODE_TYPE_MASK	0170000
+#define GIT_MODE_TREE		0040000
+#define GIT_MODE_GITLINK	0160000
+#define git_mode_is_tree(m)	(((m) & GIT_MODE_TYPE_MASK) == GIT_MODE_TREE)
+
+// Batched queries copy their oids out of an Oid.t array and sort them, so
+// that pack indexes and loose object directories get probed in ascending
+// order instead of at random.  libgit2 does not expose pack offsets, but
+// .idx files are themselves sorted by oid, making this the nearest order
+// to pack locality available to us.  Each slot remembers its position in
+// the caller's array.
+
+struct oid_slot { git_oid oid; size_t pos; };
+
+int oid_slot_cmp( const void *a, const void *b ) {
+	return memcmp( a, b, GIT_OID_RAWSZ );
+}
+
+struct oid_slot *sorted_oid_slots( value oids, size_t n ) {
+	struct oid_slot *slots = malloc( sizeof(struct oid_slot) * (n ? n : 1) );
+	size_t i;
+	if (slots == NULL)  caml_raise_out_of_memory();
+	for (i=0; i < n; i++) {
+		memcpy( &slots[i].oid, String_val(Field(oids,i)), GIT_OID_RAWSZ );
+		slots[i].pos = i;
+	}
+	qsort( slots, n, sizeof(struct oid_slot), &oid_slot_cmp );
+	return slots;
+}
+
+
+// Pack, pack index and index files get written to a temporary file, hashing
+// all they write for the trailing checksum, then synced before the rename.
+
+struct pack_out { FILE *f; EVP_MD_CTX *sha; int err; };
+
+static int
+pack_out_open( struct pack_out *p, char *tmpl, mode_t mode ) {
+	int fd;
+	p->err = GIT_SUCCESS;
+	if ((p->sha = EVP_MD_CTX_new()) == NULL)  return GIT_ENOMEM;
+	if (EVP_DigestInit_ex( p->sha, EVP_sha1(), NULL ) != 1) {
+		EVP_MD_CTX_free(p->sha);
+		return GIT_ERROR;
+	}
+	if ((fd = mkstemp(tmpl)) < 0) {
+		EVP_MD_CTX_free(p->sha);
+		return GIT_EOSERR;
+	}
+	fchmod( fd, mode );
+	if ((p->f = fdopen(fd, "wb")) == NULL) {
+		close(fd);
+		unlink(tmpl);
+		EVP_MD_CTX_free(p->sha);
+		return GIT_EOSERR;
+	}
+	return GIT_SUCCESS;
+}
+
+static void
+pack_out_put( struct pack_out *p, const void *d, size_t n ) {
+	if (p->err == GIT_SUCCESS && EVP_DigestUpdate( p->sha, d, n ) != 1)
+		p->err = GIT_ERROR;
+	if (p->err == GIT_SUCCESS && fwrite(d, 1, n, p->f) != n)
+		p->err = GIT_EOSERR;
+}
+
+static void
+pack_out_be32( struct pack_out *p, uint32_t x ) {
+	unsigned char b[4] = { x >> 24, x >> 16, x >> 8, x };
+	pack_out_put( p, b, 4 );
+}
+
+static int
+pack_out_close( struct pack_out *p, unsigned char *sum ) {
+	if (p->err == GIT_SUCCESS && EVP_DigestFinal_ex( p->sha, sum, NULL ) != 1)
+		p->err = GIT_ERROR;
+	EVP_MD_CTX_free(p->sha);
+	if ( p->err == GIT_SUCCESS && ( fwrite(sum, 1, GIT_OID_RAWSZ, p->f) != GIT_OID_RAWSZ
+			|| fflush(p->f) != 0 || fsync(fileno(p->f)) != 0 ) )
+		p->err = GIT_EOSERR;
+	if (fclose(p->f) != 0)  p->err = GIT_EOSERR;
+	return p->err;
+}  // appends the checksum, which it also returns in sum
+
+
+/* *** Oid sets and tables *** */
+
+// An oidtab is an open addressing hash table over packed 20 byte keys,
+// each followed by slot_size - 20 bytes of payload.  A set uses bare 20
+// byte slots, while a table carries a 32 bit value for 24 byte slots.
+// SHA-1 output is already uniformly distributed, so the first bytes of the
+// key serve directly as the hash.  An all zero slot marks an empty slot,
+// so the all zero oid, should anyone insert it, lives in a slot of its own.
+
+#define OIDTAB_SET_SLOT		GIT_OID_RAWSZ
+#define OIDTAB_TABLE_SLOT	(GIT_OID_RAWSZ + 4)
+
+struct oidtab {
+	unsigned char *slots;
+	size_t slot_size, mask, count, limit;
+	int has_zero;
+	unsigned char zero_slot[OIDTAB_TABLE_SLOT];
+};
+
+static const unsigned char zero_key[GIT_OID_RAWSZ];
+
+#define oidtab_is_zero(k)  (memcmp((k), zero_key, GIT_OID_RAWSZ) == 0)
+
+size_t oidtab_hash( const unsigned char *k ) {
+	uint64_t h;
+	memcpy( &h, k, sizeof(h) );
+	return (size_t)h;
+}
+
+int oidtab_init( struct oidtab *t, size_t slot_size, size_t hint ) {
+	size_t cap = 16;
+	while (cap * 4 < hint * 5)  cap *= 2;
+	memset( t, 0, sizeof(struct oidtab) );
+	if ((t->slots = calloc(cap, slot_size)) == NULL)  return GIT_ENOMEM;
+	t->slot_size = slot_size;
+	t->mask = cap - 1;
+	t->limit = cap / 5 * 4;
+	git_stat_add( GIT_STAT_oidtab, 1, cap * slot_size );
+	return GIT_SUCCESS;
+}  // keeps the load factor under 4/5
+
+void oidtab_free( struct oidtab *t ) {
+	if (t->slots == NULL)  return;
+	git_stat_add( GIT_STAT_oidtab, -1, -(intnat)((t->mask + 1) * t->slot_size) );
+	free(t->slots);
+	t->slots = NULL;
+}
+
+void oidtab_clear( struct oidtab *t ) {
+	memset( t->slots, 0, (t->mask + 1) * t->slot_size );
+	t->count = 0;
+	t->has_zero = 0;
+}
+
+size_t oidtab_bytes( struct oidtab *t )
+	{ return (t->mask + 1) * t->slot_size; }
+
+unsigned char *oidtab_find( struct oidtab *t, const unsigned char *k ) {
+	size_t i;
+	unsigned char *s;
+	if (oidtab_is_zero(k))
+		return t->has_zero ? t->zero_slot : NULL;
+	for (i = oidtab_hash(k) & t->mask; ; i = (i+1) & t->mask) {
+		s = t->slots + i * t->slot_size;
+		if (memcmp(s, k, GIT_OID_RAWSZ) == 0)  return s;
+		if (oidtab_is_zero(s))  return NULL;
+	}
+}
+
+static unsigned char *
+oidtab_probe( unsigned char *slots, size_t mask, size_t slot_size,
+		const unsigned char *k ) {
+	size_t i;
+	unsigned char *s;
+	for (i = oidtab_hash(k) & mask; ; i = (i+1) & mask) {
+		s = slots + i * slot_size;
+		if (oidtab_is_zero(s) || memcmp(s, k, GIT_OID_RAWSZ) == 0)  return s;
+	}
+}  // finds either the key's slot or the empty slot where it belongs
+
+static int
+oidtab_grow( struct oidtab *t ) {
+	size_t i, cap = (t->mask + 1) * 2;
+	unsigned char *slots = calloc(cap, t->slot_size), *s;
+	if (slots == NULL)  return GIT_ENOMEM;
+	for (i=0; i <= t->mask; i++) {
+		s = t->slots + i * t->slot_size;
+		if (!oidtab_is_zero(s))
+			memcpy( oidtab_probe(slots, cap - 1, t->slot_size, s),
+				s, t->slot_size );
+	}
+	git_stat_add( GIT_STAT_oidtab, 0, (cap / 2) * t->slot_size );
+	free(t->slots);
+	t->slots = slots;
+	t->mask = cap - 1;
+	t->limit = cap / 5 * 4;
+	return GIT_SUCCESS;
+}
+
+int oidtab_insert( struct oidtab *t, const unsigned char *k, unsigned char **slot ) {
+	unsigned char *s;
+	if (oidtab_is_zero(k)) {
+		*slot = t->zero_slot;
+		if (t->has_zero)  return 0;
+		t->has_zero = 1;  t->count++;
+		return 1;
+	}
+	if (t->count >= t->limit && oidtab_grow(t) != GIT_SUCCESS)
+		return GIT_ENOMEM;
+	s = oidtab_probe( t->slots, t->mask, t->slot_size, k );
+	*slot = s;
+	if (!oidtab_is_zero(s))  return 0;
+	memcpy( s, k, GIT_OID_RAWSZ );
+	t->count++;
+	return 1;
+}  // returns 1 if the key was added, 0 if already present, or GIT_ENOMEM
+
+void custom_oidtab_finalize (value v) {
+	struct oidtab *t = *(struct oidtab **)Data_custom_val(v);
+	oidtab_free(t);
+	free(t);
+}
+
+static struct custom_operations oidtab_custom_ops = {
+    identifier:  "Git oid table",
+    finalize:    &custom_oidtab_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+#define Oidtab_val(v)  (*(struct oidtab **)Data_custom_val(v))
+
+// Bulk operations accept packed oids either as a string or as a bigstring.
+
+void packed_oids_val( value v, const unsigned char **p, size_t *n ) {
+	if (Tag_val(v) == String_tag) {
+		*p = (const unsigned char *)String_val(v);
+		*n = caml_string_length(v) / GIT_OID_RAWSZ;
+	} else {
+		*p = (const unsigned char *)Caml_ba_data_val(v);
+		*n = Caml_ba_array_val(v)->dim[0] / GIT_OID_RAWSZ;
+	}
+}
+
+// Hints beyond OIDTAB_MAX_HINT could never be allocated, and would overflow
+// the capacity computation in oidtab_init.
+
+#define OIDTAB_MAX_HINT		(SIZE_MAX / 8 / OIDTAB_TABLE_SLOT)
+
+static value
+oidtab_alloc( size_t slot_size, value hint, char *fn ) {
+	CAMLparam1(hint);
+	CAMLlocal1(r);
+	intnat h = Long_val(hint) < 0 ? 0 : Long_val(hint);
+	struct oidtab *t;
+	if ((uintnat)h > OIDTAB_MAX_HINT)
+		caml_invalid_argument(fn);
+	t = malloc(sizeof(struct oidtab));
+	if ( t == NULL || oidtab_init( t, slot_size, h ) ) {
+		free(t);
+		caml_raise_out_of_memory();
+	}
+	r = caml_alloc_custom( &oidtab_custom_ops,
+		sizeof(struct oidtab *), oidtab_bytes(t), CAMLGC_max_git );
+	Oidtab_val(r) = t;
+	CAMLreturn(r);
+}
+
+CAMLprim value ocaml_git_oidset_create( value hint )
+	{ return oidtab_alloc( OIDTAB_SET_SLOT, hint, "Git.Oid.Set.create" ); }
+
+CAMLprim value ocaml_git_oidtable_create( value hint )
+	{ return oidtab_alloc( OIDTAB_TABLE_SLOT, hint, "Git.Oid.Table.create" ); }
+
+// Table values are stored as int32, anything wider is rejected up front.
+
+static int32_t
+oidtab_value( intnat v, char *fn ) {
+	if (v < INT32_MIN || v > INT32_MAX)  caml_invalid_argument(fn);
+	return (int32_t)v;
+}
+
+static unsigned char *
+oidtab_insert_exn( struct oidtab *t, const unsigned char *k, int *added ) {
+	unsigned char *slot;
+	size_t before = oidtab_bytes(t);
+	int r = oidtab_insert(t, k, &slot);
+	if (r < 0)  caml_raise_out_of_memory();
+	if (oidtab_bytes(t) > before)
+		caml_adjust_gc_speed( oidtab_bytes(t) - before, CAMLGC_max_git );
+	if (added)  *added = r;
+	return slot;
+}
+
+CAMLprim value ocaml_git_oidtab_add( value tab, value oid ) {
+	int added;
+	oidtab_insert_exn( Oidtab_val(tab), (unsigned char *)String_val(oid), &added );
+	return Val_bool(added);
+}
+
+CAMLprim value ocaml_git_oidtab_mem( value tab, value oid ) {
+	return Val_bool( oidtab_find( Oidtab_val(tab),
+			(unsigned char *)String_val(oid) ) != NULL );
+}
+
+CAMLprim value ocaml_git_oidtab_cardinal( value tab )
+	{ return Val_long( Oidtab_val(tab)->count ); }
+
+CAMLprim value ocaml_git_oidtab_clear( value tab ) {
+	oidtab_clear( Oidtab_val(tab) );
+	return Val_unit;
+}
+
+CAMLprim value ocaml_git_oidtab_replace( value tab, value oid, value v ) {
+	int32_t x = oidtab_value( Long_val(v), "Git.Oid.Table.replace" );
+	memcpy( oidtab_insert_exn( Oidtab_val(tab), (unsigned char *)String_val(oid), NULL )
+		+ GIT_OID_RAWSZ, &x, sizeof(x) );
+	return Val_unit;
+}
+
+CAMLprim value ocaml_git_oidtab_find( value tab, value oid ) {
+	unsigned char *s = oidtab_find( Oidtab_val(tab), (unsigned char *)String_val(oid) );
+	int32_t x;
+	if (s == NULL)  caml_raise_not_found();
+	memcpy( &x, s + GIT_OID_RAWSZ, sizeof(x) );
+	return Val_long(x);
+}
+
+CAMLprim value ocaml_git_oidtab_add_packed( value tab, value packed ) {
+	struct oidtab *t = Oidtab_val(tab);
+	const unsigned char *p;
+	size_t i, n, added = 0;
+	int a;
+	packed_oids_val(packed, &p, &n);
+	for (i=0; i < n; i++) {
+		oidtab_insert_exn( t, p + i * GIT_OID_RAWSZ, &a );
+		added += a;
+	}
+	return Val_long(added);
+}  // returns the number of oids that were not yet present
+
+CAMLprim value ocaml_git_oidtab_replace_packed( value tab, value packed, value base ) {
+	struct oidtab *t = Oidtab_val(tab);
+	const unsigned char *p;
+	size_t i, n;
+	int32_t x;
+	packed_oids_val(packed, &p, &n);
+	if (n > 0) {
+		oidtab_value( Long_val(base), "Git.Oid.Table.replace_packed" );
+		oidtab_value( Long_val(base) + (intnat)(n - 1), "Git.Oid.Table.replace_packed" );
+	}
+	for (i=0; i < n; i++) {
+		x = Long_val(base) + i;
+		memcpy( oidtab_insert_exn( t, p + i * GIT_OID_RAWSZ, NULL ) + GIT_OID_RAWSZ,
+			&x, sizeof(x) );
+	}
+	return Val_unit;
+}  // maps oid i to base + i
+
+CAMLprim value
+ocaml_git_oidtab_mem_packed( value tab, value packed ) {
+	CAMLparam2(tab,packed);
+	CAMLlocal1(r);
+	struct oidtab *t = Oidtab_val(tab);
+	const unsigned char *p;
+	size_t i, n;
+	packed_oids_val(packed, &p, &n);
+	r = caml_alloc_string( (n + 7) / 8 );
+	memset( String_val(r), 0, (n + 7) / 8 );
+	packed_oids_val(packed, &p, &n);  // in case the allocation moved a string
+	for (i=0; i < n; i++)
+		if ( oidtab_find(t, p + i * GIT_OID_RAWSZ) )
+			((unsigned char *)String_val(r))[i >> 3] |= 1 << (i & 7);
+	CAMLreturn(r);
+}  // same bitmap layout as Odb.exists_many
+
+CAMLprim value
+ocaml_git_oidtab_find_packed( value tab, value packed, value dflt ) {
+	CAMLparam3(tab,packed,dflt);
+	CAMLlocal1(r);
+	struct oidtab *t = Oidtab_val(tab);
+	const unsigned char *p, *s;
+	size_t i, n;
+	intnat *out;
+	int32_t x;
+	packed_oids_val(packed, &p, &n);
+	r = caml_alloc_intarray(n);
+	out = (intnat *)Caml_ba_data_val(r);
+	packed_oids_val(packed, &p, &n);
+	for (i=0; i < n; i++) {
+		s = oidtab_find(t, p + i * GIT_OID_RAWSZ);
+		if (s)  memcpy( &x, s + GIT_OID_RAWSZ, sizeof(x) );
+		out[i] = s ? x : Long_val(dflt);
+	}
+	CAMLreturn(r);
+}
+
+CAMLprim value
+ocaml_git_oidtab_to_packed( value tab ) {
+	CAMLparam1(tab);
+	CAMLlocal1(r);
+	struct oidtab *t = Oidtab_val(tab);
+	unsigned char *out, *s;
+	size_t i;
+	r = caml_alloc_string( t->count * GIT_OID_RAWSZ );
+	out = (unsigned char *)String_val(r);
+	if (t->has_zero) {
+		memset( out, 0, GIT_OID_RAWSZ );
+		out += GIT_OID_RAWSZ;
+	}
+	for (i=0; i <= t->mask; i++) {
+		s = t->slots + i * t->slot_size;
+		if (!oidtab_is_zero(s)) {
+			memcpy( out, s, GIT_OID_RAWSZ );
+			out += GIT_OID_RAWSZ;
+		}
+	}
+	CAMLreturn(r);
+}  // in no particular order
+
+
 /* *** Index operations *** */
 
-define_git_ptr_type_manual(index);
+// Index handles are manual, but also remember the file the index reads and
+// writes, which libgit2 does not expose and bulk loads write directly.  The
+// pointer comes first, so the generated wrappers unwrap these handles like
+// any other.  Only the path gets finalized.
+
+struct git_index_block { git_index *ix; char *path; };
+
+#define Index_path_val(v)  (((struct git_index_block *)Data_custom_val(v))->path)
+
+void custom_git_index_finalize (value v)
+	{ free( Index_path_val(v) ); }
 
-wrap_setptr_val1(git_index_open_bare,git_index,
-	"Git.Index.open_bare",FAILURE_EXN,
-	String_val);
+static struct custom_operations git_index_custom_ops = {
+    identifier:  "Git index manual pointer handling",
+    finalize:    &custom_git_index_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+static value
+caml_wrap_git_index_path( git_index *p, char *path ) {
+	value v = caml_alloc_custom( &git_index_custom_ops,
+		sizeof(struct git_index_block), CAMLGC_used_git_index, CAMLGC_max_git );
+	struct git_index_block *b = Data_custom_val(v);
+	b->ix = p;  b->path = path;
+	return v;
+}  // takes ownership of path
+
+CAMLprim value
+ocaml_git_index_open_bare( value path ) {
+	CAMLparam1(path);
+	git_index *ix = NULL;
+	char *file = String_copy(path);
+	int err;
+	caml_enter_blocking_section();
+	err = git_index_open_bare( &ix, file );
+	caml_leave_blocking_section();
+	if (err != GIT_SUCCESS)  free(file);
+	pass_git_exceptions(err,"Git.Index.open_bare",FAILURE_EXN);
+	CAMLreturn( caml_wrap_git_index_path(ix, file) );
+}
 
 wrap_retunit_ptr1(git_index_clear,
 	git_index);
 wrap_retunit_ptr1(git_index_free,
 	git_index);
-wrap_retunit_exn_ptr1(git_index_read,
+wrap_retunit_exn_blocking_ptr1(git_index_read,
 	"Git.Index.read",INVALID_EXN,
 	git_index);
-wrap_retunit_exn_ptr1(git_index_write,
+wrap_retunit_exn_blocking_ptr1(git_index_write,
 	"Git.Index.write",INVALID_EXN,
 	git_index);
 wrap_retval_ptr1_val1(git_index_find,Val_int, // -1 should throw an exception
 	git_index,String_val);
-wrap_retunit_exn_ptr1_val2(git_index_add,
+wrap_retunit_exn_blocking_ptr1_val2(git_index_add,
 	"Git.Index.add",INVALID_EXN,
-	git_index,String_val,Int_val);
+	git_index,char *,String_copy,free,int,Int_val,Release_none);
 wrap_retunit_exn_ptr1_val1(git_index_remove,
 	"Git.Index.remove",INVALID_EXN,
 	git_index,Int_val);
 wrap_retval_ptr1(git_index_entrycount,Val_int,
 	git_index);
 
-// We're ignoring the nanoseconds since libgit2 doesn't handle them either.
+// We're ignoring the nanoseconds since libgit2 doesn't handle them either.
+// The path still points into the ocaml record, as git_index_insert copies it.
+
+void ocaml_index_entry_to_git_index_entry_dirty( git_index_entry *entry, value v ) {
+	memset( entry, 0, sizeof(git_index_entry) );
+	entry->ctime.seconds = (git_time_t)Double_val(Field(v,0));
+	entry->mtime.seconds = (git_time_t)Double_val(Field(v,1));
+	entry->dev = Int_val(Field(v,2));
+	entry->ino = Int_val(Field(v,3));
+	entry->mode = Int_val(Field(v,4));
+	entry->uid = Int_val(Field(v,5));
+	entry->gid = Int_val(Field(v,6));
+	entry->file_size = Int_val(Field(v,7));
+	memcpy( &entry->oid, String_val(Field(v,8)), GIT_OID_RAWSZ );
+	entry->flags = Int_val(Field(v,9));
+	entry->flags_extended = Int_val(Field(v,10));
+	entry->path = (char *)String_val(Field(v,11));
+}
+
+CAMLextern value
+ocaml_git_index_insert( value index, value v ) {
+	CAMLparam2(index,v);
+	git_index_entry entry;
+	ocaml_index_entry_to_git_index_entry_dirty( &entry, v );
+	int err = git_index_insert( *(git_index **)Data_custom_val(index), &entry );
+	pass_git_exceptions(err,"Git.Index.insert",INVALID_EXN);
+	CAMLreturn(Val_unit);
+}
+
+// Bulk loads copy their entries out of the OCaml heap, then merge them with
+// the entries already present, sorting once by path and stage and keeping
+// only the last of any duplicates, so new entries replace old ones.  libgit2
+// has no call to load a sorted vector, and each git_index_insert re-sorts
+// its entries, so we write the merged entries as the index file, version 2
+// or 3 as git_index_write would, and have git_index_read parse it once.
+// git_index_read skips files it deems unchanged or never written, which
+// the git_index_write ahead and git_index_clear rule out.
+
+#define index_entry_stage(e)	(((e)->flags >> 12) & 3)
+
+#define INDEX_FLAG_VALID	0x8000
+#define INDEX_FLAG_EXTENDED	0x4000
+#define INDEX_FLAG_STAGE	0x3000
+#define INDEX_NAME_MASK		0x0fff
+
+struct index_load { git_index_entry e; size_t seq; };
+
+static int
+index_load_key_cmp( const struct index_load *x, const struct index_load *y ) {
+	int c = strcmp( x->e.path, y->e.path );
+	return c ? c : index_entry_stage(&x->e) - index_entry_stage(&y->e);
+}
+
+static int
+index_load_cmp( const void *a, const void *b ) {
+	const struct index_load *x = a, *y = b;
+	int c = index_load_key_cmp(x,y);
+	return c ? c : (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void
+index_out_be16( struct pack_out *p, uint16_t x ) {
+	unsigned char b[2] = { x >> 8, x };
+	pack_out_put( p, b, 2 );
+}
+
+static void
+index_out_entry( struct pack_out *p, const git_index_entry *e ) {
+	static const char pad[8];
+	size_t len = strlen(e->path), n = (e->flags_extended ? 64 : 62) + len;
+	pack_out_be32( p, e->ctime.seconds );  pack_out_be32( p, e->ctime.nanoseconds );
+	pack_out_be32( p, e->mtime.seconds );  pack_out_be32( p, e->mtime.nanoseconds );
+	pack_out_be32( p, e->dev );  pack_out_be32( p, e->ino );
+	pack_out_be32( p, e->mode );
+	pack_out_be32( p, e->uid );  pack_out_be32( p, e->gid );
+	pack_out_be32( p, (uint32_t)e->file_size );
+	pack_out_put( p, e->oid.id, GIT_OID_RAWSZ );
+	index_out_be16( p, (e->flags & (INDEX_FLAG_VALID | INDEX_FLAG_STAGE))
+		| (e->flags_extended ? INDEX_FLAG_EXTENDED : 0)
+		| (len < INDEX_NAME_MASK ? len : INDEX_NAME_MASK) );
+	if (e->flags_extended)  index_out_be16( p, e->flags_extended );
+	pack_out_put( p, e->path, len );
+	pack_out_put( p, pad, 8 - n % 8 );
+}  // only extended entries carry the second flags word, which needs version 3
+
+static int
+index_load_write( const char *path, struct index_load *l, size_t n ) {
+	struct pack_out p;
+	unsigned char sum[GIT_OID_RAWSZ];
+	size_t i, count = 0;
+	char *tmp = malloc( strlen(path) + 8 );
+	int version = 2, err;
+	if (tmp == NULL)  return GIT_ENOMEM;
+	for (i=0; i < n; i++)
+		if ( i+1 == n || index_load_key_cmp(&l[i], &l[i+1]) != 0 ) {
+			count++;
+			if (l[i].e.flags_extended)  version = 3;
+		}
+	sprintf( tmp, "%s.XXXXXX", path );
+	if ((err = pack_out_open(&p, tmp, 0644)) != GIT_SUCCESS) {
+		free(tmp);
+		return err;
+	}
+	pack_out_put( &p, "DIRC", 4 );
+	pack_out_be32( &p, version );
+	pack_out_be32( &p, count );
+	for (i=0; i < n; i++)
+		if ( i+1 == n || index_load_key_cmp(&l[i], &l[i+1]) != 0 )
+			index_out_entry( &p, &l[i].e );
+	err = pack_out_close( &p, sum );
+	if (err == GIT_SUCCESS && rename(tmp, path) != 0)  err = GIT_EOSERR;
+	if (err != GIT_SUCCESS)  unlink(tmp);
+	free(tmp);
+	return err;
+}  // writes the last of each run of equal keys
+
+static int
+index_load_insert( git_index *ix, const char *path, struct index_load *l, size_t n ) {
+	struct index_load *all;
+	size_t m, i;
+	int err;
+	if (path == NULL)  return GIT_ERROR;
+	if ((err = git_index_write(ix)) != GIT_SUCCESS)  return err;
+	m = git_index_entrycount(ix);
+	if ((all = malloc( sizeof(struct index_load) * (m + n ? m + n : 1) )) == NULL)
+		return GIT_ENOMEM;
+	for (i=0; i < m; i++) {
+		all[i].e = *git_index_get( ix, i );
+		all[i].seq = i;
+	}
+	for (i=0; i < n; i++) {
+		all[m+i].e = l[i].e;
+		all[m+i].seq = m + l[i].seq;
+	}
+	qsort( all, m + n, sizeof(struct index_load), &index_load_cmp );
+	err = index_load_write( path, all, m + n );
+	free(all);
+	if (err != GIT_SUCCESS)  return err;
+	git_index_clear(ix);
+	return git_index_read(ix);
+}  // entries already present come first, so new ones replace them
+
+static void
+index_load_run( value index, struct index_load *l, size_t n, char *paths,
+		char *name ) {
+	git_index *ix = *(git_index **)Data_custom_val(index);
+	const char *path = Index_path_val(index);
+	int err;
+	caml_enter_blocking_section();
+	err = index_load_insert( ix, path, l, n );
+	caml_leave_blocking_section();
+	free(l);
+	free(paths);
+	pass_git_exceptions(err,name,INVALID_EXN);
+}
+
+CAMLprim value
+ocaml_git_index_insert_many( value index, value entries ) {
+	CAMLparam2(index,entries);
+	size_t i, n = Wosize_val(entries), total = 0, len;
+	struct index_load *l;
+	char *paths, *p;
+	value v;
+	for (i=0; i < n; i++)
+		total += caml_string_length(Field(Field(entries,i),11)) + 1;
+	l = malloc( sizeof(struct index_load) * (n ? n : 1) );
+	paths = malloc( total ? total : 1 );
+	if (l == NULL || paths == NULL) {
+		free(l);  free(paths);
+		caml_raise_out_of_memory();
+	}
+	for (i=0, p=paths; i < n; i++) {
+		v = Field(entries,i);
+		ocaml_index_entry_to_git_index_entry_dirty( &l[i].e, v );
+		len = caml_string_length(Field(v,11));
+		memcpy( p, String_val(Field(v,11)), len );
+		p[len] = 0;
+		l[i].e.path = p;
+		l[i].seq = i;
+		p += len + 1;
+	}
+	index_load_run( index, l, n, paths, "Git.Index.insert_many" );
+	CAMLreturn(Val_unit);
+}
+
+// Takes the columnar Index.snapshot layout.
+
+#define INDEX_COLUMNS	9	// numeric columns, fields 1 to 9 of Index.snapshot
+
+CAMLprim value
+ocaml_git_index_add_many( value index, value snap ) {
+	CAMLparam2(index,snap);
+	size_t i, j, n = Long_val(Field(snap,0)), len;
+	intnat *col[INDEX_COLUMNS], *off;
+	struct index_load *l;
+	char *paths, *p;
+	value oids = Field(snap,INDEX_COLUMNS+1), tab = Field(snap,INDEX_COLUMNS+2);
+	value strings = Field(tab,0), offsets = Field(tab,1);
+	for (j=0; j < INDEX_COLUMNS; j++)
+		if (Caml_ba_array_val(Field(snap,j+1))->dim[0] < (intnat)n)
+			caml_invalid_argument("Git.Index.add_many : short column");
+	if ( caml_string_length(oids) < n * GIT_OID_RAWSZ
+	  || Caml_ba_array_val(offsets)->dim[0] < (intnat)n + 1 )
+		caml_invalid_argument("Git.Index.add_many : short column");
+	for (j=0; j < INDEX_COLUMNS; j++)
+		col[j] = (intnat *)Caml_ba_data_val(Field(snap,j+1));
+	off = (intnat *)Caml_ba_data_val(offsets);
+	for (i=0; i < n; i++)
+		if ( off[i] < 0 || off[i] > off[i+1]
+		  || off[i+1] > (intnat)caml_string_length(strings) )
+			caml_invalid_argument("Git.Index.add_many : corrupt path table");
+	l = malloc( sizeof(struct index_load) * (n ? n : 1) );
+	paths = malloc( off[n] - off[0] + n + 1 );
+	if (l == NULL || paths == NULL) {
+		free(l);  free(paths);
+		caml_raise_out_of_memory();
+	}
+	for (i=0, p=paths; i < n; i++) {
+		memset( &l[i].e, 0, sizeof(git_index_entry) );
+		l[i].e.ctime.seconds = col[0][i];
+		l[i].e.mtime.seconds = col[1][i];
+		l[i].e.file_size = col[2][i];
+		l[i].e.mode = col[3][i];
+		l[i].e.ino = col[4][i];
+		l[i].e.flags = col[5][i];
+		l[i].e.dev = col[6][i];
+		l[i].e.uid = col[7][i];
+		l[i].e.gid = col[8][i];
+		memcpy( &l[i].e.oid, String_val(oids) + i * GIT_OID_RAWSZ,
+			GIT_OID_RAWSZ );
+		len = off[i+1] - off[i];
+		memcpy( p, String_val(strings) + off[i], len );
+		p[len] = 0;
+		l[i].e.path = p;
+		l[i].seq = i;
+		p += len + 1;
+	}
+	index_load_run( index, l, n, paths, "Git.Index.add_many" );
+	CAMLreturn(Val_unit);
+}
+
+CAMLextern value
+git_index_entry_to_ocaml_index_entry(git_index_entry *entry) {
+	CAMLparam0();
+	CAMLlocal2(r,oid);
+	oid = caml_alloc_string( GIT_OID_RAWSZ );
+	memcpy( String_val(oid), &entry->oid, GIT_OID_RAWSZ );
+	r = caml_alloc(12,0);
+	Store_field(r, 0, caml_copy_double((double)entry->ctime.seconds));
+	Store_field(r, 1, caml_copy_double((double)entry->mtime.seconds));
+	Store_field(r, 2, Val_int(entry->dev));
+	Store_field(r, 3, Val_int(entry->ino));
+	Store_field(r, 4, Val_int(entry->mode));
+	Store_field(r, 5, Val_int(entry->uid));
+	Store_field(r, 6, Val_int(entry->gid));
+	Store_field(r, 7, Val_int(entry->file_size));
+	Store_field(r, 8, oid);
+	Store_field(r, 9, Val_int(entry->flags));
+	Store_field(r, 10, Val_int(entry->flags_extended));
+	Store_field(r, 11, caml_copy_string(entry->path));
+	CAMLreturn(r);
+}
+
+wrap_retval_ptr1_val1(git_index_get,git_index_entry_to_ocaml_index_entry,
+	git_index, Int_val);
+
+// A snapshot exports the whole index column by column : one bigarray per
+// numeric field, all oids packed into one string, and all paths packed into
+// one string table.  Bulk readers thus avoid allocating a record, two boxed
+// floats, an oid and a path per entry.
+
+CAMLprim value
+ocaml_git_index_snapshot( value index ) {
+	CAMLparam1(index);
+	CAMLlocal5(r,oids,strings,offsets,tab);
+	git_index *ix = *(git_index **)Data_custom_val(index);
+	unsigned int n = git_index_entrycount(ix), i, j;
+	intnat *col[INDEX_COLUMNS], *off;
+	size_t total = 0, len;
+	git_index_entry *e;
+	for (i=0; i < n; i++)
+		total += strlen( git_index_get(ix,i)->path );
+	r = caml_alloc(INDEX_COLUMNS+3,0);
+	Store_field(r, 0, Val_int(n));
+	for (j=0; j < INDEX_COLUMNS; j++)
+		Store_field(r, j+1, caml_alloc_intarray(n));
+	oids = caml_alloc_string( n * GIT_OID_RAWSZ );
+	strings = caml_alloc_string( total );
+	offsets = caml_alloc_intarray( n+1 );
+	for (j=0; j < INDEX_COLUMNS; j++)
+		col[j] = (intnat *)Caml_ba_data_val(Field(r, j+1));
+	off = (intnat *)Caml_ba_data_val(offsets);
+	off[0] = 0;
+	for (i=0; i < n; i++) {
+		e = git_index_get(ix,i);
+		col[0][i] = e->ctime.seconds;
+		col[1][i] = e->mtime.seconds;
+		col[2][i] = e->file_size;
+		col[3][i] = e->mode;
+		col[4][i] = e->ino;
+		col[5][i] = e->flags;
+		col[6][i] = e->dev;
+		col[7][i] = e->uid;
+		col[8][i] = e->gid;
+		memcpy( String_val(oids) + i * GIT_OID_RAWSZ, &e->oid, GIT_OID_RAWSZ );
+		len = strlen(e->path);
+		memcpy( String_val(strings) + off[i], e->path, len );
+		off[i+1] = off[i] + len;
+	}
+	tab = caml_alloc(2,0);
+	Store_field(tab, 0, strings);
+	Store_field(tab, 1, offsets);
+	Store_field(r, INDEX_COLUMNS+1, oids);
+	Store_field(r, INDEX_COLUMNS+2, tab);
+	CAMLreturn(r);
+}
+
+// Index.status lstats every indexed path in the working tree from a few
+// pthreads, with the runtime lock released.  Files whose stat data differ
+// from the index entry but whose size and mode agree get rehashed with
+// git_odb_hash, which writes nothing.  Entries that look clean but were
+// modified in the same second the index was written are racy, since a
+// later write in that second would leave their stat data unchanged.  We
+// only report racy entries, leaving the rehash to the caller.  Content
+// filters like autocrlf are not applied.
+
+#define STATUS_CLEAN	0
+#define STATUS_MODIFIED	1
+#define STATUS_DELETED	2
+#define STATUS_RACY	3
+
+#define STATUS_CHUNK	256
+
+struct status_scan {
+	const char *workdir;
+	git_index_entry **entries;
+	unsigned char *status;
+	unsigned int n, next;		// next is claimed atomically
+	intnat index_mtime;
+	intnat rehashed;
+};
+
+static unsigned int
+status_mode( const struct stat *st ) {
+	if (S_ISLNK(st->st_mode))  return 0120000;
+	return (st->st_mode & 0100) ? 0100755 : 0100644;
+}
+
+static int
+status_rehash( const char *path, const struct stat *st, const git_oid *oid ) {
+	size_t len = st->st_size, got = 0;
+	char *buf = malloc( len ? len : 1 );
+	ssize_t k = 0;
+	git_oid h;
+	int fd, r = STATUS_MODIFIED;
+	if (buf == NULL)  return STATUS_MODIFIED;
+	if (S_ISLNK(st->st_mode)) {
+		k = readlink( path, buf, len );
+		got = k < 0 ? 0 : k;
+	} else if ((fd = open(path, O_RDONLY)) >= 0) {
+		while ( got < len && ((k = read(fd, buf + got, len - got)) > 0
+				|| (k < 0 && errno == EINTR)) )
+			if (k > 0)  got += k;
+		close(fd);
+	}
+	if ( got == len && k >= 0
+	  && git_odb_hash( &h, buf, len, GIT_OBJ_BLOB ) == GIT_SUCCESS
+	  && git_oid_cmp( &h, oid ) == 0 )
+		r = STATUS_CLEAN;
+	free(buf);
+	return r;
+}  // anything we cannot read counts as modified
+
+static int
+status_check( struct status_scan *s, const git_index_entry *e, const char *path ) {
+	struct stat st;
+	if (lstat(path, &st) != 0)
+		return (errno == ENOENT || errno == ENOTDIR)
+			? STATUS_DELETED : STATUS_MODIFIED;
+	if ((e->mode & 0170000) == 0160000)	// submodule
+		return S_ISDIR(st.st_mode) ? STATUS_CLEAN : STATUS_MODIFIED;
+	if (S_ISDIR(st.st_mode))
+		return STATUS_DELETED;
+	if ( status_mode(&st) != e->mode || (git_off_t)st.st_size != e->file_size )
+		return STATUS_MODIFIED;
+	if ( st.st_mtime == e->mtime.seconds && st.st_ctime == e->ctime.seconds
+	  && (unsigned int)st.st_ino == e->ino
+	  && st.st_uid == e->uid && st.st_gid == e->gid )
+		return (intnat)st.st_mtime >= s->index_mtime
+			? STATUS_RACY : STATUS_CLEAN;
+	__sync_fetch_and_add( &s->rehashed, 1 );
+	return status_rehash( path, &st, &e->oid );
+}
+
+static void *
+status_worker( void *arg ) {
+	struct status_scan *s = arg;
+	struct packbuf path = { NULL, 0, 0 };
+	size_t wlen = strlen(s->workdir);
+	unsigned int i, lo, hi;
+	const char *p;
+	while ((lo = __sync_fetch_and_add( &s->next, STATUS_CHUNK )) < s->n) {
+		hi = lo + STATUS_CHUNK < s->n ? lo + STATUS_CHUNK : s->n;
+		for (i=lo; i < hi; i++) {
+			p = s->entries[i]->path;
+			path.len = 0;
+			if ( packbuf_put(&path, s->workdir, wlen) != GIT_SUCCESS
+			  || packbuf_put(&path, "/", 1) != GIT_SUCCESS
+			  || packbuf_put(&path, p, strlen(p) + 1) != GIT_SUCCESS )
+				s->status[i] = STATUS_MODIFIED;
+			else
+				s->status[i] = status_check( s, s->entries[i], path.data );
+		}
+	}
+	packbuf_free(&path);
+	return NULL;
+}
+
+CAMLprim value
+ocaml_git_index_status( value index, value workdir, value index_mtime, value threads ) {
+	CAMLparam4(index,workdir,index_mtime,threads);
+	CAMLlocal1(r);
+	git_index *ix = *(git_index **)Data_custom_val(index);
+	struct status_scan s;
+	struct strtab_buf out[3];
+	pthread_t *tids;
+	int i, k = Int_val(threads), started = 0, err = GIT_SUCCESS;
+	unsigned int j;
+	memset( &s, 0, sizeof(s) );
+	memset( out, 0, sizeof(out) );
+	if (k < 1)  k = 1;
+	s.n = git_index_entrycount(ix);
+	s.index_mtime = Long_val(index_mtime);
+	s.workdir = String_copy(workdir);
+	s.entries = malloc( sizeof(git_index_entry *) * (s.n ? s.n : 1) );
+	s.status = malloc( s.n ? s.n : 1 );
+	tids = malloc( sizeof(pthread_t) * k );
+	if (s.entries == NULL || s.status == NULL || tids == NULL) {
+		free(s.entries);  free(s.status);  free(tids);
+		free( (char *)s.workdir );
+		caml_raise_out_of_memory();
+	}
+	for (j=0; j < s.n; j++)
+		s.entries[j] = git_index_get(ix,j);
+	caml_enter_blocking_section();
+	for (i=1; i < k; i++)
+		if (pthread_create( &tids[started], NULL, &status_worker, &s ) == 0)
+			started++;
+	status_worker(&s);
+	for (i=0; i < started; i++)
+		pthread_join( tids[i], NULL );
+	for (j=0; j < s.n && err == GIT_SUCCESS; j++)
+		if (s.status[j] != STATUS_CLEAN)
+			err = strtab_add( &out[s.status[j]-1], s.entries[j]->path,
+					strlen(s.entries[j]->path) );
+	caml_leave_blocking_section();
+	free(s.entries);  free(s.status);  free(tids);
+	free( (char *)s.workdir );
+	if (err != GIT_SUCCESS)
+		for (i=0; i < 3; i++)  strtab_free(&out[i]);
+	pass_git_exceptions(err,"Git.Index.status",INVALID_EXN);
+	r = caml_alloc(4,0);
+	for (i=0; i < 3; i++) {
+		Store_field(r, i, caml_copy_strtab(&out[i]));
+		strtab_free(&out[i]);
+	}
+	Store_field(r, 3, Val_long(s.rehashed));
+	CAMLreturn(r);
+}  // the fields follow the Index.changes record in git.ml
+
+
+/* *** Object database operations *** */
+
+// Database handles are manual, and like index handles remember a path
+// libgit2 does not expose, the objects directory, where Odb.Reader finds
+// loose objects.  Only the path gets finalized.
+
+struct git_odb_block { git_odb *db; char *objects; };
+
+#define Odb_objects_val(v)  (((struct git_odb_block *)Data_custom_val(v))->objects)
+
+void custom_git_odb_finalize (value v)
+	{ free( Odb_objects_val(v) ); }
+
+static struct custom_operations git_odb_custom_ops = {
+    identifier:  "Git odb manual pointer handling",
+    finalize:    &custom_git_odb_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+wrap_retunit_ptr1(git_odb_close,git_odb);
+
+wrap_retval_blocking_ptr1_val1(git_odb_exists,int,Val_bool,
+	git_odb,git_oid *,Oid_copy,free);
+
+CAMLprim value
+ocaml_git_odb_exists_many( value odb, value oids ) {
+	CAMLparam2(odb,oids);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	git_odb *db = *(git_odb **)Data_custom_val(odb);
+	size_t i, n = Wosize_val(oids), nbytes = (n + 7) / 8;
+	struct oid_slot *slots = sorted_oid_slots(oids,n);
+	unsigned char *bits = calloc( nbytes ? nbytes : 1, 1 );
+	if (bits == NULL) {
+		free(slots);
+		caml_raise_out_of_memory();
+	}
+	enter_repo_section(lk, db);
+	for (i=0; i < n; i++)
+		if ( git_odb_exists(db, &slots[i].oid) )
+			bits[slots[i].pos >> 3] |= 1 << (slots[i].pos & 7);
+	leave_repo_section(lk);
+	r = caml_alloc_string(nbytes);
+	memcpy( String_val(r), bits, nbytes );
+	free(bits);
+	free(slots);
+	CAMLreturn(r);
+}  // bit i, counting from the low bit of byte 0, is set if oid i exists
+
+// Odb.reachable parses commits, tags and trees straight from their raw
+// content, without building libgit2 objects, and visits each oid once, so
+// subtrees shared between commits get read once.  Everything reachable
+// from the excluded tips gets walked first and left out.  Blobs are read
+// only for their headers, and only when sizes are asked for.  Submodule
+// commits are skipped.
+
+#define REACH_TYPES	1
+#define REACH_SIZES	2
+
+struct reach_item { git_oid oid; int type; };	// GIT_OBJ_ANY if unknown
+
+struct reach_walk {
+	git_odb *odb;
+	int flags, report;
+	struct oidtab seen;
+	struct packbuf pending;		// struct reach_item
+	struct packbuf oids, types, sizes;
+};
+
+static int
+reach_push( struct reach_walk *w, const git_oid *oid, int type ) {
+	struct reach_item it;
+	unsigned char *slot;
+	int r = oidtab_insert( &w->seen, (const unsigned char *)oid, &slot );
+	if (r <= 0)  return r;  // seen before, or GIT_ENOMEM
+	git_oid_cpy( &it.oid, oid );
+	it.type = type;
+	return packbuf_put( &w->pending, &it, sizeof(it) );
+}
+
+// Parses a "field <hex>\n" header line of a raw commit or tag.
+
+static int
+header_oid( const char **p, const char *end, const char *field, git_oid *oid ) {
+	size_t len = strlen(field);
+	if ( (size_t)(end - *p) < len + GIT_OID_HEXSZ + 1
+	  || memcmp(*p, field, len) != 0 || (*p)[len + GIT_OID_HEXSZ] != '\n' )
+		return GIT_ENOTFOUND;
+	if (git_oid_mkstr( oid, *p + len ) != GIT_SUCCESS)
+		return GIT_EOBJCORRUPTED;
+	*p += len + GIT_OID_HEXSZ + 1;
+	return GIT_SUCCESS;
+}  // GIT_ENOTFOUND if the next line is not this field
+
+static int
+reach_hex( struct reach_walk *w, const char **p, const char *end,
+		const char *field, int type ) {
+	git_oid oid;
+	int err = header_oid( p, end, field, &oid );
+	return err == GIT_SUCCESS ? reach_push( w, &oid, type ) : err;
+}
+
+static int
+reach_parse( struct reach_walk *w, git_otype type, const char *p, const char *end ) {
+	unsigned int mode;
+	int err;
+	switch (type) {
+	case GIT_OBJ_COMMIT:
+		if ((err = reach_hex( w, &p, end, "tree ", GIT_OBJ_TREE )) != GIT_SUCCESS)
+			return err == GIT_ENOTFOUND ? GIT_EOBJCORRUPTED : err;
+		while ((err = reach_hex( w, &p, end, "parent ", GIT_OBJ_COMMIT )) == GIT_SUCCESS)
+			;
+		return err == GIT_ENOTFOUND ? GIT_SUCCESS : err;
+	case GIT_OBJ_TAG:
+		err = reach_hex( w, &p, end, "object ", GIT_OBJ_ANY );
+		return err == GIT_ENOTFOUND ? GIT_EOBJCORRUPTED : err;
+	case GIT_OBJ_TREE:
+		while (p < end) {
+			for (mode = 0; p < end && *p >= '0' && *p <= '7'; p++)
+				mode = mode * 8 + (*p - '0');
+			while (p < end && *p++ != 0)
+				;
+			if (end - p < GIT_OID_RAWSZ)
+				return GIT_EOBJCORRUPTED;
+			if (git_mode_is_tree(mode))
+				err = reach_push( w, (const git_oid *)p, GIT_OBJ_TREE );
+			else if ((mode & GIT_MODE_TYPE_MASK) != GIT_MODE_GITLINK)
+				err = reach_push( w, (const git_oid *)p, GIT_OBJ_BLOB );
+			else
+				err = GIT_SUCCESS;
+			if (err != GIT_SUCCESS)  return err;
+			p += GIT_OID_RAWSZ;
+		}
+		return GIT_SUCCESS;
+	default:
+		return GIT_SUCCESS;
+	}
+}
+
+static int
+reach_run( struct reach_walk *w ) {
+	struct reach_item it;
+	git_odb_object *obj;
+	git_otype type;
+	size_t size;
+	int err;
+	while (w->pending.len) {
+		w->pending.len -= sizeof(it);
+		memcpy( &it, w->pending.data + w->pending.len, sizeof(it) );
+		size = 0;  type = it.type;
+		if (it.type == GIT_OBJ_BLOB) {
+			if ( (w->flags & REACH_SIZES) && (err =
+			     git_odb_read_header( &size, &type, w->odb, &it.oid )) != GIT_SUCCESS )
+				return err;
+		} else {
+			if ((err = git_odb_read( &obj, w->odb, &it.oid )) != GIT_SUCCESS)
+				return err;
+			type = git_odb_object_type(obj);
+			size = git_odb_object_size(obj);
+			err = reach_parse( w, type, git_odb_object_data(obj),
+				(const char *)git_odb_object_data(obj) + size );
+			git_odb_object_close(obj);
+			if (err != GIT_SUCCESS)  return err;
+		}
+		if ( w->report && ( packbuf_put(&w->oids, &it.oid, GIT_OID_RAWSZ)
+		  || ((w->flags & REACH_TYPES) && packbuf_put_int(&w->types, type))
+		  || ((w->flags & REACH_SIZES) && packbuf_put_int(&w->sizes, size)) ) )
+			return GIT_ENOMEM;
+	}
+	return GIT_SUCCESS;
+}
+
+static void
+reach_free( struct reach_walk *w ) {
+	oidtab_free(&w->seen);
+	packbuf_free(&w->pending);
+	packbuf_free(&w->oids);
+	packbuf_free(&w->types);
+	packbuf_free(&w->sizes);
+}
+
+CAMLprim value
+ocaml_git_odb_reachable( value odb, value tips, value exclude, value flags ) {
+	CAMLparam4(odb,tips,exclude,flags);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	struct reach_walk w;
+	size_t i, n = Wosize_val(tips), m = Wosize_val(exclude);
+	git_oid *ids = malloc( sizeof(git_oid) * (n ? n : 1) );
+	int err = GIT_SUCCESS;
+	memset( &w, 0, sizeof(w) );
+	w.odb = *(git_odb **)Data_custom_val(odb);
+	w.flags = Int_val(flags);
+	if ( ids == NULL
+	  || oidtab_init( &w.seen, OIDTAB_SET_SLOT, 1024 ) != GIT_SUCCESS ) {
+		free(ids);
+		caml_raise_out_of_memory();
+	}
+	for (i=0; i < n; i++)
+		memcpy( &ids[i], String_val(Field(tips,i)), GIT_OID_RAWSZ );
+	for (i=0; i < m && err == GIT_SUCCESS; i++)
+		err = reach_push( &w, (const git_oid *)String_val(Field(exclude,i)),
+				GIT_OBJ_ANY );
+	enter_repo_section(lk, w.odb);
+	if (err == GIT_SUCCESS)  err = reach_run(&w);
+	w.report = 1;
+	for (i=0; i < n && err == GIT_SUCCESS; i++)
+		err = reach_push( &w, &ids[i], GIT_OBJ_ANY );
+	if (err == GIT_SUCCESS)  err = reach_run(&w);
+	leave_repo_section(lk);
+	free(ids);
+	if (err != GIT_SUCCESS)  reach_free(&w);
+	pass_git_exceptions(err,"Git.Odb.reachable",INVALID_EXN);
+	r = caml_alloc(4,0);
+	Store_field(r, 0, Val_long(w.oids.len / GIT_OID_RAWSZ));
+	Store_field(r, 1, caml_copy_packbuf(&w.oids));
+	Store_field(r, 2, caml_copy_packbuf_ints(&w.types));
+	Store_field(r, 3, caml_copy_packbuf_ints(&w.sizes));
+	reach_free(&w);
+	CAMLreturn(r);
+}  // the fields follow the Odb.objects record in git.ml
+
+// Readers hand out an object's content in chunks, copied into a caller
+// supplied buffer that may be reused between reads.  A loose object gets
+// inflated from its file under the database's objects directory a buffer
+// at a time.  Otherwise we try a backend read stream, but the pack backend
+// shipped with libgit2 does not implement read streams yet, so packed
+// objects are read whole into libgit2's memory and served in chunks from
+// there.  That keeps the OCaml heap footprint constant, but for packed
+// objects not the C heap's.
+
+#define ODB_LOOSE_BUF	16384
+
+struct odb_loose {
+	int fd, done;
+	z_stream z;
+	unsigned char in[ODB_LOOSE_BUF];
+};
+
+struct odb_reader {
+	git_odb *db;
+	git_odb_stream *stream;
+	git_odb_object *obj;
+	struct odb_loose *loose;
+	size_t size, pos;
+	char *scratch;  size_t scratch_len;
+	size_t footprint;
+};
+
+static void
+odb_loose_close( struct odb_loose *l ) {
+	inflateEnd(&l->z);
+	close(l->fd);
+	free(l);
+}
+
+// Inflates up to len bytes, reading the file as needed.  Returns the
+// number of bytes inflated, zero at the end of the stream, or an error.
+
+static int
+odb_loose_inflate( struct odb_loose *l, char *out, size_t len ) {
+	ssize_t n;
+	int zerr;
+	if (len == 0 || l->done)  return 0;
+	l->z.next_out = (Bytef *)out;
+	l->z.avail_out = len;
+	while (l->z.avail_out == len) {
+		if (l->z.avail_in == 0) {
+			do n = read( l->fd, l->in, sizeof(l->in) );
+			while (n < 0 && errno == EINTR);
+			if (n < 0)  return GIT_EOSERR;
+			if (n == 0)  return GIT_EOBJCORRUPTED;  // truncated
+			l->z.next_in = l->in;
+			l->z.avail_in = n;
+		}
+		zerr = inflate( &l->z, Z_NO_FLUSH );
+		if (zerr == Z_STREAM_END) {
+			l->done = 1;
+			break;
+		}
+		if (zerr == Z_MEM_ERROR)  return GIT_ENOMEM;
+		if (zerr != Z_OK && zerr != Z_BUF_ERROR)  return GIT_EOBJCORRUPTED;
+	}
+	return len - l->z.avail_out;
+}
+
+// Opens the loose file for oid under dir and inflates its "type size"
+// header, leaving the stream at the start of the content.  Returns
+// GIT_ENOTFOUND if the object is not loose.
+
+static int
+odb_loose_open( struct odb_loose **out, const char *dir, const git_oid *oid,
+		size_t size ) {
+	struct odb_loose *l;
+	size_t dlen = strlen(dir);
+	char *path, hex[GIT_OID_HEXSZ], hdr[64];
+	int i, err;
+	if ((path = malloc( dlen + GIT_OID_HEXSZ + 3 )) == NULL)  return GIT_ENOMEM;
+	if ((l = calloc( 1, sizeof(struct odb_loose) )) == NULL) {
+		free(path);
+		return GIT_ENOMEM;
+	}
+	git_oid_fmt( hex, oid );
+	sprintf( path, "%s/%.2s/%.*s", dir, hex, GIT_OID_HEXSZ - 2, hex + 2 );
+	l->fd = open( path, O_RDONLY );
+	free(path);
+	if (l->fd < 0) {
+		err = errno;
+		free(l);
+		return err == ENOENT ? GIT_ENOTFOUND : GIT_EOSERR;
+	}
+	if (inflateInit(&l->z) != Z_OK) {
+		close(l->fd);
+		free(l);
+		return GIT_ENOMEM;
+	}
+	for (i=0; i < (int)sizeof(hdr); i++) {  // a byte at a time up to the NUL
+		if ((err = odb_loose_inflate( l, hdr + i, 1 )) != 1) {
+			odb_loose_close(l);
+			return err < 0 ? err : GIT_EOBJCORRUPTED;
+		}
+		if (hdr[i] == 0)  break;
+	}
+	if ( i == (int)sizeof(hdr) || strchr(hdr, ' ') == NULL
+	  || (size_t)strtoul( strchr(hdr, ' ') + 1, NULL, 10 ) != size ) {
+		odb_loose_close(l);
+		return GIT_EOBJCORRUPTED;
+	}
+	*out = l;
+	return GIT_SUCCESS;
+}
+
+static void odb_stream_deferred_free( void *p )
+	{ ((git_odb_stream *)p)->free(p); }
+static void odb_object_deferred_close( void *p ) { git_odb_object_close(p); }
+
+void odb_reader_close( struct odb_reader *rd ) {
+	if (rd->stream)  repo_defer( rd->db, &odb_stream_deferred_free, rd->stream );
+	if (rd->obj)  repo_defer( rd->db, &odb_object_deferred_close, rd->obj );
+	if (rd->loose)  odb_loose_close(rd->loose);
+	free(rd->scratch);
+	rd->stream = NULL;  rd->obj = NULL;  rd->loose = NULL;  rd->scratch = NULL;
+	rd->scratch_len = 0;
+}
+
+void custom_odb_reader_finalize (value v) {
+	struct odb_reader *rd = *(struct odb_reader **)Data_custom_val(v);
+	git_stat_add( GIT_STAT_odb_reader, -1, -(intnat)rd->footprint );
+	odb_reader_close(rd);
+	free(rd);
+}
+
+static struct custom_operations odb_reader_custom_ops = {
+    identifier:  "Git odb reader",
+    finalize:    &custom_odb_reader_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+#define Odb_reader_val(v)  (*(struct odb_reader **)Data_custom_val(v))
+
+CAMLprim value
+ocaml_git_odb_reader_open( value odb, value id ) {
+	CAMLparam2(odb,id);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	git_odb *db = *(git_odb **)Data_custom_val(odb);
+	struct odb_reader *rd = calloc( 1, sizeof(struct odb_reader) );
+	char *dir = Odb_objects_val(odb);
+	git_otype type;
+	git_oid oid;
+	int err;
+	if (rd == NULL)  caml_raise_out_of_memory();
+	rd->db = db;
+	memcpy( &oid, String_val(id), GIT_OID_RAWSZ );
+	enter_repo_section(lk, db);
+	err = git_odb_read_header( &rd->size, &type, db, &oid );
+	if (err == GIT_SUCCESS && dir != NULL)
+		err = odb_loose_open( &rd->loose, dir, &oid, rd->size );
+	if (err == GIT_ENOTFOUND || (err == GIT_SUCCESS && rd->loose == NULL)) {
+		if (git_odb_open_rstream( &rd->stream, db, &oid ) == GIT_SUCCESS)
+			err = GIT_SUCCESS;
+		else {
+			rd->stream = NULL;
+			err = git_odb_read( &rd->obj, db, &oid );
+		}
+	}
+	leave_repo_section(lk);
+	if (err != GIT_SUCCESS)  free(rd);
+	pass_git_exceptions(err,"Git.Odb.Reader.open_read",INVALID_EXN);
+	rd->footprint = rd->obj ? rd->size
+		: rd->loose ? sizeof(struct odb_loose) : 0;  // ignores zlib's window
+	r = caml_alloc_custom( &odb_reader_custom_ops,
+		sizeof(struct odb_reader *), rd->footprint, CAMLGC_max_git );
+	Odb_reader_val(r) = rd;
+	git_stat_add( GIT_STAT_odb_reader, 1, rd->footprint );
+	CAMLreturn(r);
+}
+
+CAMLprim value
+ocaml_git_odb_reader_size( value reader )
+	{ return Val_long( Odb_reader_val(reader)->size ); }
+
+CAMLprim value
+ocaml_git_odb_reader_read_into( value reader, value buf, value off, value len ) {
+	CAMLparam4(reader,buf,off,len);
+	struct repo_lock *lk;
+	struct odb_reader *rd = Odb_reader_val(reader);
+	intnat o = Long_val(off), l = Long_val(len);
+	int got = 0;
+	if (o < 0 || l < 0 || o + l > caml_string_length(buf))
+		caml_invalid_argument("Git.Odb.Reader.read_into");
+	if (l > INT_MAX)  l = INT_MAX;  // got, zlib's avail_out and streams take ints
+	if (rd->obj) {
+		got = rd->size - rd->pos < (size_t)l ? rd->size - rd->pos : l;
+		memcpy( String_val(buf) + o,
+			(const char *)git_odb_object_data(rd->obj) + rd->pos, got );
+	} else if (rd->stream || rd->loose) {
+		if ((size_t)l > rd->scratch_len) {
+			char *sc = realloc(rd->scratch, l);
+			if (sc == NULL)  caml_raise_out_of_memory();
+			rd->scratch = sc;  rd->scratch_len = l;
+		}
+		enter_repo_section(lk, rd->loose ? NULL : rd->db);
+		if (rd->loose) {
+			got = odb_loose_inflate( rd->loose, rd->scratch, l );
+			if ( (got > 0 && rd->pos + got > rd->size)
+			  || (got == 0 && l > 0 && rd->pos < rd->size) )
+				got = GIT_EOBJCORRUPTED;  // its header says otherwise
+		} else
+			got = rd->stream->read( rd->stream, rd->scratch, l );
+		leave_repo_section(lk);
+		pass_git_exceptions( got < 0 ? got : GIT_SUCCESS,
+			"Git.Odb.Reader.read_into", INVALID_EXN );
+		memcpy( String_val(buf) + o, rd->scratch, got );
+	}  // a closed reader reads as empty
+	rd->pos += got;
+	CAMLreturn(Val_int(got));
+}  // returns the number of bytes read, zero at the end of the object
+
+CAMLprim value
+ocaml_git_odb_reader_close( value reader ) {
+	odb_reader_close( Odb_reader_val(reader) );
+	return Val_unit;
+}
+
+
+// A batch buffers new objects in memory, deflated as they arrive and
+// deduplicated by oid, then writes them out on commit as a single version
+// 2 pack with its index, in place of a loose object file and an fsync per
+// object.  Objects are stored whole, without deltas.  Until the commit, a
+// read backend registered with the object database serves them from the
+// arena, so lookups find them like any other object.  libgit2 offers no
+// way to remove a backend, so it outlives the batch, empty, until the
+// database is freed.  The batch's own mutex guards its table and arena,
+// which writes deflate into without holding the runtime lock, and which
+// lookups through the backend read while holding the repository lock.
+// Commits take the repository lock, then the batch's, in that order.
+
+struct batch_entry { git_oid oid; int type; size_t size, off, zlen; };
+
+struct batch_backend;
+
+struct odb_batch {
+	char *dir;
+	int level;
+	pthread_mutex_t lock;		// guards ids, entries, arena and footprint
+	git_odb *db;
+	struct batch_backend *backend;	// NULL once the database is freed
+	struct oidtab ids;		// oid to entry number
+	struct packbuf entries, arena;	// struct batch_entry, deflated data
+	size_t footprint;
+};
+
+struct batch_backend {
+	git_odb_backend parent;
+	struct odb_batch *batch;	// NULL once the batch is freed
+};
+
+#define Odb_batch_val(v)  (*(struct odb_batch **)Data_custom_val(v))
+
+// Once the database is gone, there is nothing left to lock.
+
+#define odb_batch_key(b)  ((b)->backend ? (b)->db : NULL)
+
+#define odb_batch_count(b)  ((b)->entries.len / sizeof(struct batch_entry))
+
+static struct batch_entry *
+odb_batch_find( struct odb_batch *b, const unsigned char *k ) {
+	unsigned char *s = oidtab_find( &b->ids, k );
+	uint32_t n;
+	if (s == NULL)  return NULL;
+	memcpy( &n, s + GIT_OID_RAWSZ, sizeof(n) );
+	return (struct batch_entry *)b->entries.data + n;
+}
+
+static int
+odb_batch_inflate( struct odb_batch *b, const struct batch_entry *e, void *out ) {
+	uLongf len = e->size;
+	if ( e->size > 0 && ( uncompress( out, &len,
+			(const Bytef *)b->arena.data + e->off, e->zlen ) != Z_OK
+			|| len != e->size ) )
+		return GIT_EOBJCORRUPTED;
+	return GIT_SUCCESS;
+}
+
+static void
+odb_batch_clear( struct odb_batch *b ) {
+	git_stat_add( GIT_STAT_odb_batch, 0, -(intnat)b->footprint );
+	b->footprint = 0;
+	packbuf_free(&b->entries);
+	packbuf_free(&b->arena);
+	oidtab_clear(&b->ids);
+}
+
+static int
+batch_backend_read( void **out, size_t *len, git_otype *type,
+		git_odb_backend *be, const git_oid *oid ) {
+	struct odb_batch *b = ((struct batch_backend *)be)->batch;
+	struct batch_entry *e;
+	int err = GIT_ENOTFOUND;
+	if (b == NULL)  return GIT_ENOTFOUND;
+	pthread_mutex_lock(&b->lock);
+	if ((e = odb_batch_find( b, oid->id )) != NULL) {
+		if ((*out = malloc( e->size ? e->size : 1 )) == NULL)
+			err = GIT_ENOMEM;
+		else if ((err = odb_batch_inflate( b, e, *out )) != GIT_SUCCESS)
+			free(*out);
+		else {
+			*len = e->size;  *type = e->type;
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+	return err;
+}  // libgit2 frees the buffer
+
+static int
+batch_backend_read_header( size_t *len, git_otype *type,
+		git_odb_backend *be, const git_oid *oid ) {
+	struct odb_batch *b = ((struct batch_backend *)be)->batch;
+	struct batch_entry *e;
+	int err = GIT_ENOTFOUND;
+	if (b == NULL)  return GIT_ENOTFOUND;
+	pthread_mutex_lock(&b->lock);
+	if ((e = odb_batch_find( b, oid->id )) != NULL) {
+		*len = e->size;  *type = e->type;
+		err = GIT_SUCCESS;
+	}
+	pthread_mutex_unlock(&b->lock);
+	return err;
+}
+
+static int
+batch_backend_exists( git_odb_backend *be, const git_oid *oid ) {
+	struct odb_batch *b = ((struct batch_backend *)be)->batch;
+	int found;
+	if (b == NULL)  return 0;
+	pthread_mutex_lock(&b->lock);
+	found = odb_batch_find( b, oid->id ) != NULL;
+	pthread_mutex_unlock(&b->lock);
+	return found;
+}
+
+static void
+batch_backend_free( git_odb_backend *be ) {
+	struct odb_batch *b = ((struct batch_backend *)be)->batch;
+	if (b)  b->backend = NULL;
+	free(be);
+}  // called by libgit2 as the database gets freed
+
+static void
+odb_batch_free( void *p ) {
+	struct odb_batch *b = p;
+	if (b->backend)  b->backend->batch = NULL;
+	odb_batch_clear(b);
+	oidtab_free(&b->ids);
+	pthread_mutex_destroy(&b->lock);
+	free(b->dir);
+	free(b);
+}
+
+void custom_odb_batch_finalize (value v) {
+	struct odb_batch *b = Odb_batch_val(v);
+	git_stat_add( GIT_STAT_odb_batch, -1, 0 );
+	if (b->backend)
+		repo_defer( b->db, &odb_batch_free, b );
+	else
+		odb_batch_free(b);
+}
+
+static struct custom_operations odb_batch_custom_ops = {
+    identifier:  "Git odb batch",
+    finalize:    &custom_odb_batch_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+CAMLprim value
+ocaml_git_odb_batch_create( value odb, value dir, value level ) {
+	CAMLparam3(odb,dir,level);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	git_odb *db = *(git_odb **)Data_custom_val(odb);
+	struct batch_backend *be;
+	struct odb_batch *b;
+	int err;
+	if (Int_val(level) < Z_DEFAULT_COMPRESSION || Int_val(level) > Z_BEST_COMPRESSION)
+		caml_invalid_argument("Git.Odb.Batch.create");
+	b = calloc( 1, sizeof(struct odb_batch) );
+	be = calloc( 1, sizeof(struct batch_backend) );
+	if ( b == NULL || be == NULL || (b->dir = strdup(String_val(dir))) == NULL
+			|| oidtab_init(&b->ids, OIDTAB_TABLE_SLOT, 0) != GIT_SUCCESS ) {
+		if (b)  free(b->dir);
+		free(b);  free(be);
+		caml_raise_out_of_memory();
+	}
+	b->level = Int_val(level);
+	b->db = db;
+	pthread_mutex_init( &b->lock, NULL );
+	be->batch = b;
+	be->parent.read = &batch_backend_read;
+	be->parent.read_header = &batch_backend_read_header;
+	be->parent.exists = &batch_backend_exists;
+	be->parent.free = &batch_backend_free;
+	enter_repo_section(lk, db);
+	err = git_odb_add_backend( db, &be->parent, 0 );  // after loose and packs
+	leave_repo_section(lk);
+	if (err != GIT_SUCCESS) {
+		free(be);
+		oidtab_free(&b->ids);
+		pthread_mutex_destroy(&b->lock);
+		free(b->dir);
+		free(b);
+	}
+	pass_git_exceptions(err,"Git.Odb.Batch.create",INVALID_EXN);
+	b->backend = be;
+	r = caml_alloc_custom( &odb_batch_custom_ops,
+		sizeof(struct odb_batch *), 0, CAMLGC_max_git );
+	Odb_batch_val(r) = b;
+	git_stat_add( GIT_STAT_odb_batch, 1, 0 );
+	CAMLreturn(r);
+}
+
+// Writes copy the data out of the OCaml heap, then hash and deflate it with
+// the runtime lock released, taking the batch's lock only to look the oid
+// up and to append the deflated data.
+
+static int
+odb_batch_add( struct odb_batch *b, struct batch_entry *e, const char *data ) {
+	uLongf zlen = compressBound(e->size);
+	unsigned char *z = NULL, *slot;
+	uint32_t n;
+	int err, found;
+	if ((err = git_odb_hash( &e->oid, data, e->size, e->type )) != GIT_SUCCESS)
+		return err;
+	pthread_mutex_lock(&b->lock);
+	found = oidtab_find( &b->ids, e->oid.id ) != NULL;
+	pthread_mutex_unlock(&b->lock);
+	if (found)  return GIT_SUCCESS;
+	if ( (z = malloc(zlen)) == NULL
+	  || compress2( z, &zlen, (const Bytef *)data, e->size, b->level ) != Z_OK ) {
+		free(z);
+		return GIT_ENOMEM;
+	}
+	pthread_mutex_lock(&b->lock);
+	n = odb_batch_count(b);
+	if (oidtab_find( &b->ids, e->oid.id ) != NULL)
+		;  // another thread got there first
+	else if ( packbuf_grow(&b->arena, zlen) != GIT_SUCCESS
+			|| packbuf_grow(&b->entries, sizeof(*e)) != GIT_SUCCESS
+			|| oidtab_insert(&b->ids, e->oid.id, &slot) == GIT_ENOMEM )
+		err = GIT_ENOMEM;
+	else {
+		memcpy( slot + GIT_OID_RAWSZ, &n, sizeof(n) );
+		e->off = b->arena.len;  e->zlen = zlen;
+		packbuf_put( &b->arena, z, zlen );
+		packbuf_put( &b->entries, e, sizeof(*e) );
+		b->footprint += zlen + sizeof(*e);
+		git_stat_add( GIT_STAT_odb_batch, 0, zlen + sizeof(*e) );
+	}
+	pthread_mutex_unlock(&b->lock);
+	free(z);
+	return err;
+}  // the table entry goes in last, so a failed write leaves no trace
+
+CAMLprim value
+ocaml_git_odb_batch_write( value batch, value type, value data ) {
+	CAMLparam3(batch,type,data);
+	CAMLlocal1(id);
+	struct odb_batch *b = Odb_batch_val(batch);
+	struct batch_entry e;
+	char *copy;
+	int err;
+	e.type = Int_val(type);
+	e.size = caml_string_length(data);
+	if (e.type < GIT_OBJ_COMMIT || e.type > GIT_OBJ_TAG)
+		caml_invalid_argument("Git.Odb.Batch.write");
+	if ((copy = malloc( e.size ? e.size : 1 )) == NULL)  caml_raise_out_of_memory();
+	memcpy( copy, String_val(data), e.size );
+	caml_enter_blocking_section();
+	err = odb_batch_add( b, &e, copy );
+	caml_leave_blocking_section();
+	free(copy);
+	if (err == GIT_ENOMEM)  caml_raise_out_of_memory();
+	pass_git_exceptions(err,"Git.Odb.Batch.write",INVALID_EXN);
+	id = caml_alloc_string(GIT_OID_RAWSZ);
+	memcpy( String_val(id), &e.oid, GIT_OID_RAWSZ );
+	CAMLreturn(id);
+}
 
-CAMLextern value
-ocaml_git_index_insert( value index, value v ) {
-	CAMLparam2(index,v);
-	git_index_entry entry;
-	entry.ctime.seconds = (git_time_t)Double_val(Field(v,0));
-	entry.mtime.seconds = (git_time_t)Double_val(Field(v,1));
-	entry.dev = Int_val(Field(v,2));
-	entry.ino = Int_val(Field(v,3));
-	entry.mode = Int_val(Field(v,4));
-	entry.uid = Int_val(Field(v,5));
-	entry.gid = Int_val(Field(v,6));
-	entry.file_size = Int_val(Field(v,7));
-	memcpy( &entry.oid, String_val(Field(v,8)), GIT_OID_RAWSZ );
-	entry.flags = Int_val(Field(v,9));
-	entry.flags_extended = Int_val(Field(v,10));
-	entry.path = String_val(Field(v,11));
-	int err = git_index_insert( *(git_index **)Data_custom_val(index), &entry );
-	pass_git_exceptions(err,"Git.Index.insert",INVALID_EXN);
-	CAMLreturn(Val_unit);
+// The other batch stubs take the batch's lock with the runtime lock released
+// too, since a commit holds it while writing the pack.
+
+CAMLprim value
+ocaml_git_odb_batch_mem( value batch, value id ) {
+	CAMLparam2(batch,id);
+	struct odb_batch *b = Odb_batch_val(batch);
+	git_oid oid;
+	int found;
+	memcpy( &oid, String_val(id), GIT_OID_RAWSZ );
+	caml_enter_blocking_section();
+	pthread_mutex_lock(&b->lock);
+	found = odb_batch_find( b, oid.id ) != NULL;
+	pthread_mutex_unlock(&b->lock);
+	caml_leave_blocking_section();
+	CAMLreturn(Val_bool(found));
 }
 
-CAMLextern value
-git_index_entry_to_ocaml_index_entry(git_index_entry *entry) {
-	CAMLparam0();
-	CAMLlocal2(r,oid);
-	oid = caml_alloc_string( GIT_OID_RAWSZ );
-	memcpy( String_val(oid), &entry->oid, GIT_OID_RAWSZ );
-	r = caml_alloc(12,0);
-	Store_field(r, 0, caml_copy_double((double)entry->ctime.seconds));
-	Store_field(r, 1, caml_copy_double((double)entry->mtime.seconds));
-	Store_field(r, 2, Val_int(entry->dev));
-	Store_field(r, 3, Val_int(entry->ino));
-	Store_field(r, 4, Val_int(entry->mode));
-	Store_field(r, 5, Val_int(entry->uid));
-	Store_field(r, 6, Val_int(entry->gid));
-	Store_field(r, 7, Val_int(entry->file_size));
-	Store_field(r, 8, oid);
-	Store_field(r, 9, Val_int(entry->flags));
-	Store_field(r, 10, Val_int(entry->flags_extended));
-	Store_field(r, 11, caml_copy_string(entry->path));
+CAMLprim value
+ocaml_git_odb_batch_read( value batch, value id ) {
+	CAMLparam2(batch,id);
+	CAMLlocal2(r,s);
+	struct odb_batch *b = Odb_batch_val(batch);
+	struct batch_entry *e, ent;
+	char *out = NULL;
+	git_oid oid;
+	int err = GIT_ENOTFOUND;
+	memcpy( &oid, String_val(id), GIT_OID_RAWSZ );
+	caml_enter_blocking_section();
+	pthread_mutex_lock(&b->lock);
+	if ((e = odb_batch_find( b, oid.id )) != NULL) {
+		ent = *e;
+		if ((out = malloc( ent.size ? ent.size : 1 )) == NULL)
+			err = GIT_ENOMEM;
+		else
+			err = odb_batch_inflate( b, &ent, out );
+	}
+	pthread_mutex_unlock(&b->lock);
+	caml_leave_blocking_section();
+	if (err == GIT_ENOTFOUND)  caml_raise_not_found();
+	if (err != GIT_SUCCESS)  free(out);
+	pass_git_exceptions(err,"Git.Odb.Batch.read",FAILURE_EXN);
+	s = caml_alloc_string(ent.size);
+	memcpy( Bytes_val(s), out, ent.size );
+	free(out);
+	r = caml_alloc(2,0);
+	Store_field(r, 0, Val_int(ent.type));
+	Store_field(r, 1, s);
 	CAMLreturn(r);
 }
 
-wrap_retval_ptr1_val1(git_index_get,git_index_entry_to_ocaml_index_entry,
-	git_index, Int_val);
+CAMLprim value
+ocaml_git_odb_batch_count( value batch ) {
+	struct odb_batch *b = Odb_batch_val(batch);
+	size_t n;
+	caml_enter_blocking_section();
+	pthread_mutex_lock(&b->lock);
+	n = odb_batch_count(b);
+	pthread_mutex_unlock(&b->lock);
+	caml_leave_blocking_section();
+	return Val_long(n);
+}
+
+static int
+odb_batch_write_pack( struct odb_batch *b, char *tmp,
+		uint64_t *offs, uint32_t *crcs, unsigned char *sum ) {
+	struct batch_entry *e = (struct batch_entry *)b->entries.data;
+	size_t i, n = odb_batch_count(b), size;
+	unsigned char hdr[16];
+	uint64_t off = 12;
+	struct pack_out p;
+	int k, err;
+	if ((err = pack_out_open(&p, tmp, 0444)) != GIT_SUCCESS)  return err;
+	pack_out_put( &p, "PACK", 4 );
+	pack_out_be32( &p, 2 );
+	pack_out_be32( &p, n );
+	for (i=0; i < n; i++, e++) {
+		size = e->size;
+		hdr[0] = e->type << 4 | (size & 15);
+		for (k = 1, size >>= 4; size; k++, size >>= 7) {
+			hdr[k-1] |= 0x80;
+			hdr[k] = size & 0x7f;
+		}
+		offs[i] = off;
+		crcs[i] = crc32( crc32(0, hdr, k),
+			(const Bytef *)b->arena.data + e->off, e->zlen );
+		pack_out_put( &p, hdr, k );
+		pack_out_put( &p, b->arena.data + e->off, e->zlen );
+		off += k + e->zlen;
+	}
+	return pack_out_close( &p, sum );
+}  // each entry is a type and size varint followed by the zlib stream
 
+static int
+odb_batch_write_idx( struct odb_batch *b, char *tmp, const uint64_t *offs,
+		const uint32_t *crcs, const unsigned char *pack_sum ) {
+	struct batch_entry *es = (struct batch_entry *)b->entries.data;
+	size_t i, n = odb_batch_count(b);
+	struct oid_slot *order = malloc( sizeof(struct oid_slot) * n );
+	uint32_t fanout[256], large = 0;
+	unsigned char sum[GIT_OID_RAWSZ];
+	struct pack_out p;
+	int k, err;
+	if (order == NULL)  return GIT_ENOMEM;
+	for (i=0; i < n; i++) {
+		git_oid_cpy( &order[i].oid, &es[i].oid );
+		order[i].pos = i;
+	}
+	qsort( order, n, sizeof(struct oid_slot), &oid_slot_cmp );
+	memset( fanout, 0, sizeof(fanout) );
+	for (i=0; i < n; i++)  fanout[order[i].oid.id[0]]++;
+	for (k=1; k < 256; k++)  fanout[k] += fanout[k-1];
+	if ((err = pack_out_open(&p, tmp, 0444)) != GIT_SUCCESS) {
+		free(order);
+		return err;
+	}
+	pack_out_put( &p, "\377tOc", 4 );
+	pack_out_be32( &p, 2 );
+	for (k=0; k < 256; k++)  pack_out_be32( &p, fanout[k] );
+	for (i=0; i < n; i++)  pack_out_put( &p, order[i].oid.id, GIT_OID_RAWSZ );
+	for (i=0; i < n; i++)  pack_out_be32( &p, crcs[order[i].pos] );
+	for (i=0; i < n; i++)
+		pack_out_be32( &p, offs[order[i].pos] < 0x80000000
+			? (uint32_t)offs[order[i].pos] : 0x80000000 | large++ );
+	for (i=0; i < n; i++)
+		if (offs[order[i].pos] >= 0x80000000) {
+			pack_out_be32( &p, (uint32_t)(offs[order[i].pos] >> 32) );
+			pack_out_be32( &p, (uint32_t)offs[order[i].pos] );
+		}
+	pack_out_put( &p, pack_sum, GIT_OID_RAWSZ );
+	free(order);
+	return pack_out_close( &p, sum );
+}  // offsets past 2GB go in a trailing table of 64 bit offsets
 
-/* *** Object database operations *** */
+// We name the pack after its checksum, as git does, and rename the pack
+// into place before its index, since readers find packs by their index.
 
-define_git_ptr_type_manual(odb);  
+static int
+odb_batch_commit( struct odb_batch *b, char *pack_tmp, char *idx_tmp, char *path ) {
+	size_t n = odb_batch_count(b), dlen = strlen(b->dir);
+	uint64_t *offs = malloc( sizeof(uint64_t) * n );
+	uint32_t *crcs = malloc( sizeof(uint32_t) * n );
+	unsigned char sum[GIT_OID_RAWSZ];
+	int err = GIT_ENOMEM;
+	sprintf( pack_tmp, "%s/tmp_pack_XXXXXX", b->dir );
+	sprintf( idx_tmp, "%s/tmp_idx_XXXXXX", b->dir );
+	if (offs && crcs)
+		err = odb_batch_write_pack( b, pack_tmp, offs, crcs, sum );
+	if (err == GIT_SUCCESS) {
+		err = odb_batch_write_idx( b, idx_tmp, offs, crcs, sum );
+		if (err != GIT_SUCCESS)  unlink(pack_tmp);
+	}
+	free(offs);
+	free(crcs);
+	if (err != GIT_SUCCESS)  return err;
+	memcpy( path, b->dir, dlen );
+	memcpy( path + dlen, "/pack-", 6 );
+	git_oid_fmt( path + dlen + 6, (git_oid *)sum );
+	strcpy( path + dlen + 6 + GIT_OID_HEXSZ, ".pack" );
+	if (rename(pack_tmp, path) != 0) {
+		unlink(pack_tmp);
+		unlink(idx_tmp);
+		return GIT_EOSERR;
+	}
+	strcpy( path + dlen + 6 + GIT_OID_HEXSZ, ".idx" );
+	if (rename(idx_tmp, path) != 0) {
+		unlink(idx_tmp);
+		return GIT_EOSERR;
+	}  // an orphaned pack is harmless, git gc removes it
+	strcpy( path + dlen + 6 + GIT_OID_HEXSZ, ".pack" );
+	return GIT_SUCCESS;
+}
 
-wrap_retunit_ptr1(git_odb_close,git_odb);
+CAMLprim value
+ocaml_git_odb_batch_commit( value batch ) {
+	CAMLparam1(batch);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	struct odb_batch *b = Odb_batch_val(batch);
+	size_t dlen = strlen(b->dir);
+	char *pack_tmp = malloc(dlen + 32), *idx_tmp = malloc(dlen + 32),
+		*path = malloc(dlen + GIT_OID_HEXSZ + 32);
+	int err = GIT_ENOMEM;
+	if (pack_tmp && idx_tmp && path) {
+		enter_repo_section(lk, odb_batch_key(b));
+		pthread_mutex_lock(&b->lock);
+		err = odb_batch_commit( b, pack_tmp, idx_tmp, path );
+		if (err == GIT_SUCCESS)  odb_batch_clear(b);
+		pthread_mutex_unlock(&b->lock);
+		leave_repo_section(lk);
+	}
+	if (err == GIT_SUCCESS)  r = caml_copy_string(path);
+	free(pack_tmp);
+	free(idx_tmp);
+	free(path);
+	pass_git_exceptions(err,"Git.Odb.Batch.commit",FAILURE_EXN);
+	CAMLreturn(r);
+}  // returns the pack's path, the batch keeps its objects if this fails
 
-wrap_retval_ptr1_val1(git_odb_exists,Val_bool,git_odb,
-	(git_oid *)String_val);
+CAMLprim value
+ocaml_git_odb_batch_abort( value batch ) {
+	struct odb_batch *b = Odb_batch_val(batch);
+	caml_enter_blocking_section();
+	pthread_mutex_lock(&b->lock);
+	odb_batch_clear(b);
+	pthread_mutex_unlock(&b->lock);
+	caml_leave_blocking_section();
+	return Val_unit;
+}
 
 
 /* *** Repository operations *** */
 
 define_git_ptr_type_manual(repository);
 
-wrap_retptr_ptr1(git_repository_database,git_odb,
-	"Git.Repository.database",
-	git_repository);
+CAMLprim value
+ocaml_git_repository_database( value repo ) {
+	CAMLparam1(repo);
+	CAMLlocal1(v);
+	git_repository *r = *(git_repository **)Data_custom_val(repo);
+	const char *dir = git_repository_path( r, GIT_REPO_PATH_ODB );
+	struct git_odb_block *b;
+	char *objects = dir ? strdup(dir) : NULL;
+	if (dir != NULL && objects == NULL)  caml_raise_out_of_memory();
+	v = caml_alloc_custom( &git_odb_custom_ops,
+		sizeof(struct git_odb_block), CAMLGC_used_git_odb, CAMLGC_max_git );
+	b = Data_custom_val(v);
+	b->db = git_repository_database(r);  b->objects = objects;
+	CAMLreturn(v);
+}  // the database belongs to the repository, which frees it
 
-wrap_setptr_val2(git_repository_init,git_repository,
+wrap_setptr_blocking_val2(git_repository_init,git_repository,
 	"Git.Repository._init",FAILURE_EXN,
-	String_val,Bool_val);
+	char *,String_copy,free, int,Bool_val,Release_none);
 
 #define git_repository_open1 git_repository_open
-wrap_setptr_val1(git_repository_open1,git_repository,
+wrap_setptr_blocking_val1(git_repository_open1,git_repository,
 	"Git.Repository.open1",FAILURE_EXN,
-	String_val);
+	char *,String_copy,free);
 
-wrap_setptr_val4(git_repository_open2,git_repository,
+wrap_setptr_blocking_val4(git_repository_open2,git_repository,
 	"Git.Repository.open2",FAILURE_EXN,
-	String_val,String_val,String_val,String_val);
+	char *,String_copy,free, char *,String_copy,free,
+	char *,String_copy,free, char *,String_copy,free);
 
 
-wrap_retunit_ptr1(git_repository_free,git_repository);
+CAMLprim value
+ocaml_git_repository_free( value repo ) {
+	git_repository *r = *(git_repository **)Data_custom_val(repo);
+	repo_forget( Repo_key(r) );
+	git_repository_free(r);
+	return Val_unit;
+}  // runs the closes still queued for the repository first
 // Warning : git_repository_close exists only as an extern in repository.h
 
-wrap_setptr_ptr1(git_repository_index,git_index,
-	"Git.Repository.index",INVALID_EXN,
- 	git_repository);
+CAMLprim value
+ocaml_git_repository_index( value repo ) {
+	CAMLparam1(repo);
+	struct repo_lock *lk;
+	git_repository *r = *(git_repository **)Data_custom_val(repo);
+	git_index *ix = NULL;
+	const char *file;
+	char *path = NULL;
+	int err;
+	enter_repo_section(lk, Repo_key(r));
+	err = git_repository_index( &ix, r );
+	if ( err == GIT_SUCCESS
+	  && (file = git_repository_path( r, GIT_REPO_PATH_INDEX )) != NULL
+	  && (path = strdup(file)) == NULL )
+		err = GIT_ENOMEM;
+	leave_repo_section(lk);
+	pass_git_exceptions(err,"Git.Repository.index",INVALID_EXN);
+	CAMLreturn( caml_wrap_git_index_path(ix, path) );
+}  // the index belongs to the repository, which frees it
 
 
 /* *** Object operations *** */
 
-define_git_ptr_type_gced(object,close);
+// Database object handles remember the footprint we charged them with, an
+// estimate of the memory the parsed object pins in libgit2's heap, so that
+// their finalizer releases exactly as much.  The pointer comes first, so
+// Git_ptr_val(git_object,v) still works.
+
+#define GIT_TREE_ENTRY_FOOTPRINT	64
+#define GIT_SIGNATURE_FOOTPRINT		96
+#define GIT_OBJECT_FOOTPRINT		64
+
+struct git_object_block { git_object *obj; size_t bytes; };
+
+size_t git_object_footprint( git_object *obj ) {
+	size_t n = GIT_OBJECT_FOOTPRINT;
+	const char *m;
+	switch ( git_object_type(obj) ) {
+	case GIT_OBJ_BLOB :
+		n += git_blob_rawsize( (git_blob *)obj );
+		break;
+	case GIT_OBJ_TREE :
+		n += git_tree_entrycount( (git_tree *)obj ) * GIT_TREE_ENTRY_FOOTPRINT;
+		break;
+	case GIT_OBJ_COMMIT :
+		m = git_commit_message( (git_commit *)obj );
+		n += 2 * GIT_SIGNATURE_FOOTPRINT + (m ? strlen(m) : 0)
+			+ git_commit_parentcount( (git_commit *)obj ) * sizeof(git_oid);
+		break;
+	case GIT_OBJ_TAG :
+		m = git_tag_message( (git_tag *)obj );
+		n += GIT_SIGNATURE_FOOTPRINT + (m ? strlen(m) : 0);
+		break;
+	default :
+		break;
+	}
+	return n;
+}
+
+static void git_object_deferred_close( void *p ) { git_object_close(p); }
+
+void custom_git_object_ptr_finalize (value v) {
+	struct git_object_block *b = Data_custom_val(v);
+	if (b->obj == NULL)  return;  // closed early by ocaml_git_object_close
+	git_stat_add( git_stat_of_otype(git_object_type(b->obj)), -1, -(intnat)b->bytes );
+	repo_defer( Object_repo_key(b->obj), &git_object_deferred_close, b->obj );
+}
+
+static struct custom_operations git_object_custom_ops = {
+    identifier:  "Git object GCed pointer handling",
+    finalize:    &custom_git_object_ptr_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+CAMLprim value
+ocaml_git_object_footprint( value u ) {
+	if (!Is_block(u))  return Val_int(0);  // Invalid_object
+	return Val_long( ((struct git_object_block *)Data_custom_val(Field(u,0)))->bytes );
+}  // takes an object_u
+
+// Closes an object ahead of the collector, on the calling thread, which
+// Parallel needs for objects of a worker's repository.  The handle must
+// not be used afterwards.
+
+CAMLprim value
+ocaml_git_object_close( value u ) {
+	struct git_object_block *b;
+	if (!Is_block(u))  return Val_unit;  // Invalid_object
+	b = Data_custom_val(Field(u,0));
+	if (b->obj == NULL)  return Val_unit;
+	git_stat_add( git_stat_of_otype(git_object_type(b->obj)), -1, -(intnat)b->bytes );
+	repo_defer( Object_repo_key(b->obj), &git_object_deferred_close, b->obj );
+	b->obj = NULL;
+	return Val_unit;
+}  // takes an object_u
+
+value caml_wrap_git_object( git_object *obj ) {
+	size_t bytes = git_object_footprint(obj);
+	value v = caml_alloc_custom( &git_object_custom_ops,
+		sizeof(struct git_object_block), bytes, CAMLGC_max_git );
+	struct git_object_block *b = Data_custom_val(v);
+	b->obj = obj;  b->bytes = bytes;
+	git_stat_add( git_stat_of_otype(git_object_type(obj)), 1, bytes );
+	return v;
+}
 
 CAMLprim value
 _ocaml_git_object_lookup( value repo, value id, git_otype otype ) {
 	CAMLparam2(repo,id);
 	CAMLlocal1(obj);
-	obj = caml_alloc_git_ptr(git_object);
-	int err = git_object_lookup( (git_object **)Data_custom_val(obj),
-			*(git_repository **)Data_custom_val(repo),
-			(git_oid *)String_val(id), otype);
+	struct repo_lock *lk;
+	git_repository *r = *(git_repository **)Data_custom_val(repo);
+	git_object *o;
+	git_oid oid;
+	int err;
+	memcpy( &oid, String_val(id), GIT_OID_RAWSZ );
+	enter_repo_section(lk, Repo_key(r));
+	err = git_object_lookup( &o, r, &oid, otype );
+	leave_repo_section(lk);
 	pass_git_exceptions(err,"Git.[object_type].lookup",INVALID_EXN);
+	obj = caml_wrap_git_object(o);
 	CAMLreturn(obj);
 }
 
@@ -331,8 +2703,7 @@ CAMLprim value
 ocaml_git_database_object(git_object *obj) {
 	CAMLparam0();
 	CAMLlocal2(o,r);
-	o = caml_alloc_git_ptr(git_object);
-	*(git_object **)Data_custom_val(o) = obj;
+	o = caml_wrap_git_object(obj);
 	r = caml_alloc(1, git_object_type(obj) );  // tag matches git_otype
 	Store_field(r,0, o);
 	CAMLreturn(r);
@@ -341,10 +2712,15 @@ ocaml_git_database_object(git_object *obj) {
 CAMLprim value
 ocaml_git_object_lookup( value repo, value id ) {
 	CAMLparam2(repo,id);
+	struct repo_lock *lk;
+	git_repository *r = *(git_repository **)Data_custom_val(repo);
 	git_object *obj;
-	int err = git_object_lookup( &obj,
-			*(git_repository **)Data_custom_val(repo),
-			(git_oid *)String_val(id), GIT_OBJ_ANY);
+	git_oid oid;
+	int err;
+	memcpy( &oid, String_val(id), GIT_OID_RAWSZ );
+	enter_repo_section(lk, Repo_key(r));
+	err = git_object_lookup( &obj, r, &oid, GIT_OBJ_ANY );
+	leave_repo_section(lk);
 	pass_git_exceptions(err,"Git.object_lookup",INVALID_EXN);
 	CAMLreturn( ocaml_git_database_object(obj) );
 }
@@ -353,10 +2729,38 @@ wrap_retptr_ptr1(git_object_owner,git_repository,
 	"Git.Object.owner",
 	git_object);
 
+CAMLprim value
+ocaml_git_object_lookup_many( value repo, value oids ) {
+	CAMLparam2(repo,oids);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	git_repository *rp = *(git_repository **)Data_custom_val(repo);
+	size_t i, n = Wosize_val(oids);
+	struct oid_slot *slots = sorted_oid_slots(oids,n);
+	git_object **objs = calloc( n ? n : 1, sizeof(git_object *) );
+	if (objs == NULL) {
+		free(slots);
+		caml_raise_out_of_memory();
+	}
+	enter_repo_section(lk, Repo_key(rp));
+	for (i=0; i < n; i++)
+		if ( git_object_lookup( &objs[slots[i].pos], rp,
+				&slots[i].oid, GIT_OBJ_ANY ) != GIT_SUCCESS )
+			objs[slots[i].pos] = NULL;
+	leave_repo_section(lk);
+	free(slots);
+	r = caml_alloc(n,0);
+	for (i=0; i < n; i++)
+		Store_field(r, i, objs[i] ? ocaml_git_database_object(objs[i])
+				: Val_int(0) );  // Invalid_object
+	free(objs);
+	CAMLreturn(r);
+}
+
 
 /* *** Tree operations *** */
 
-#define git_tree_custom_ops git_object_custom_ops
+#define caml_wrap_git_tree(P)  caml_wrap_git_object( (git_object *)(P) )
 
 define_git_ptr_type_manual(tree_entry);  // safely ignored
 
@@ -367,10 +2771,14 @@ wrap_retval_ptr1(git_tree_entry_id,caml_copy_git_oid,  git_tree_entry);
 CAMLprim value
 ocaml_git_tree_entry_2object( value repo, value entry ) {
 	CAMLparam2(repo,entry);
+	struct repo_lock *lk;
+	git_repository *r = *(git_repository **)Data_custom_val(repo);
+	git_tree_entry *e = *(git_tree_entry **)Data_custom_val(entry);
 	git_object *obj;
-	int err = git_tree_entry_2object( &obj,
-	 	*(git_repository **)Data_custom_val(repo),
-	 	*(git_tree_entry **)Data_custom_val(entry) );
+	int err;
+	enter_repo_section(lk, Repo_key(r));
+	err = git_tree_entry_2object( &obj, r, e );
+	leave_repo_section(lk);
 	pass_git_exceptions(err,"Git.TreeEntry.obj",INVALID_EXN);
 	CAMLreturn( ocaml_git_database_object(obj) );
 }  // calls git_object_lookup
@@ -387,10 +2795,673 @@ wrap_retptr_ptr1_val1(git_tree_entry_byindex,git_tree_entry,
 	"Git.tree.entry_byindex",
 	git_tree,Int_val);
 
+// We walk whole trees in C, handing back every full path, mode and oid in
+// one listing, instead of crossing into C for each entry and subtree.
+// Subtrees outside the requested prefix are never looked up.
+
+struct listing { struct strtab_buf paths; struct packbuf modes, oids; };
+
+int listing_add( struct listing *l, const char *path, size_t len,
+		unsigned int mode, const git_oid *oid ) {
+	if ( strtab_add(&l->paths, path, len) != GIT_SUCCESS
+	  || packbuf_put_int(&l->modes, mode) != GIT_SUCCESS
+	  || packbuf_put(&l->oids, oid, GIT_OID_RAWSZ) != GIT_SUCCESS )
+		return GIT_ENOMEM;
+	return GIT_SUCCESS;
+}
+
+void listing_free( struct listing *l ) {
+	strtab_free(&l->paths);
+	packbuf_free(&l->modes);
+	packbuf_free(&l->oids);
+}
+
+CAMLprim value caml_copy_listing( struct listing *l ) {
+	CAMLparam0();
+	CAMLlocal1(r);
+	r = caml_alloc(4,0);
+	Store_field(r, 0, Val_int(l->modes.len / sizeof(intnat)));
+	Store_field(r, 1, caml_copy_strtab(&l->paths));
+	Store_field(r, 2, caml_copy_packbuf_ints(&l->modes));
+	Store_field(r, 3, caml_copy_packbuf(&l->oids));
+	CAMLreturn(r);
+}
+
+#define WALK_POSTORDER	1	// list trees after their contents
+#define WALK_TREES	2	// list trees we descend into
+
+struct tree_walk {
+	git_repository *repo;
+	const char *prefix;  size_t plen;
+	int max_depth, flags;
+	struct packbuf path;
+	struct listing out;
+};
+
+int tree_walk_rec( struct tree_walk *w, git_tree *tree, int depth ) {
+	unsigned int i, n = git_tree_entrycount(tree), mode;
+	size_t base = w->path.len;
+	const git_tree_entry *e;
+	const char *name;
+	git_tree *sub;
+	int m, descend, err = GIT_SUCCESS;
+	for (i=0; i < n && err == GIT_SUCCESS; i++) {
+		e = git_tree_entry_byindex(tree,i);
+		name = git_tree_entry_name(e);
+		mode = git_tree_entry_attributes(e);
+		w->path.len = base;
+		if ( (base && (err = packbuf_put(&w->path,"/",1)))
+		  || (err = packbuf_put(&w->path,name,strlen(name))) )
+			break;
+		m = path_prefix_match( w->path.data, w->path.len, w->prefix, w->plen );
+		if ( m == PREFIX_OUTSIDE || (m == PREFIX_ABOVE && !git_mode_is_tree(mode)) )
+			continue;
+		descend = git_mode_is_tree(mode)
+			&& (w->max_depth < 0 || depth < w->max_depth);
+		if ( m == PREFIX_INSIDE && ( !descend
+			|| ((w->flags & WALK_TREES) && !(w->flags & WALK_POSTORDER)) ) )
+			err = listing_add( &w->out, w->path.data, w->path.len,
+					mode, git_tree_entry_id(e) );
+		if (!descend || err != GIT_SUCCESS)
+			continue;
+		err = git_tree_lookup( &sub, w->repo, git_tree_entry_id(e) );
+		if (err != GIT_SUCCESS)
+			break;
+		err = tree_walk_rec( w, sub, depth+1 );
+		git_tree_close(sub);
+		if ( err == GIT_SUCCESS && m == PREFIX_INSIDE
+		  && (w->flags & WALK_TREES) && (w->flags & WALK_POSTORDER) )
+			err = listing_add( &w->out, w->path.data, w->path.len,
+					mode, git_tree_entry_id(e) );
+	}
+	w->path.len = base;
+	return err;
+}  // trees cut off by max_depth are listed rather than expanded
+
+CAMLprim value
+ocaml_git_tree_walk( value tree, value prefix, value max_depth, value flags ) {
+	CAMLparam4(tree,prefix,max_depth,flags);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	git_tree *t = Git_ptr_val(git_tree,tree);
+	struct tree_walk w;
+	int err;
+	memset( &w, 0, sizeof(w) );
+	w.repo = git_object_owner( (git_object *)t );
+	w.prefix = String_copy(prefix);
+	w.plen = prefix_length(w.prefix);
+	w.max_depth = Int_val(max_depth);
+	w.flags = Int_val(flags);
+	enter_repo_section(lk, Repo_key(w.repo));
+	err = tree_walk_rec( &w, t, 0 );
+	leave_repo_section(lk);
+	free( (char *)w.prefix );
+	packbuf_free(&w.path);
+	if (err != GIT_SUCCESS)  listing_free(&w.out);
+	pass_git_exceptions(err,"Git.Tree.walk",INVALID_EXN);
+	r = caml_copy_listing(&w.out);
+	listing_free(&w.out);
+	CAMLreturn(r);
+}
+
+// Tree.diff merge walks the entries of two trees, which git keeps sorted
+// by name with a trailing slash appended to subtree names.  Entries whose
+// oid and mode agree on both sides are skipped, so unchanged subtrees are
+// never looked up.  A name present as a tree on one side and as a file on
+// the other compares unequal, coming out as a deletion and an addition.
+
+#define DIFF_ADDED	0	// constructors of Tree.status
+#define DIFF_DELETED	1
+#define DIFF_MODIFIED	2
+
+struct tree_change {
+	int status;
+	unsigned int old_mode, new_mode;
+	git_oid old_oid, new_oid;
+};
+
+struct tree_diff {
+	git_repository *repo;
+	const char *prefix;  size_t plen;
+	struct packbuf path;
+	struct strtab_buf paths;
+	struct packbuf changes;	// struct tree_change, one per path
+};
+
+static int
+tree_entry_cmp( const git_tree_entry *a, const git_tree_entry *b ) {
+	const unsigned char *n = (const unsigned char *)git_tree_entry_name(a);
+	const unsigned char *m = (const unsigned char *)git_tree_entry_name(b);
+	int c, d;
+	while (*n && *n == *m)  { n++;  m++; }
+	c = *n ? *n : git_mode_is_tree(git_tree_entry_attributes(a)) ? '/' : 0;
+	d = *m ? *m : git_mode_is_tree(git_tree_entry_attributes(b)) ? '/' : 0;
+	return c - d;
+}
+
+static int
+tree_diff_change( struct tree_diff *d,
+		const git_tree_entry *ea, const git_tree_entry *eb ) {
+	struct tree_change c;
+	memset( &c, 0, sizeof(c) );
+	c.status = !eb ? DIFF_DELETED : !ea ? DIFF_ADDED : DIFF_MODIFIED;
+	if (ea) {
+		c.old_mode = git_tree_entry_attributes(ea);
+		git_oid_cpy( &c.old_oid, git_tree_entry_id(ea) );
+	}
+	if (eb) {
+		c.new_mode = git_tree_entry_attributes(eb);
+		git_oid_cpy( &c.new_oid, git_tree_entry_id(eb) );
+	}
+	if ( strtab_add(&d->paths, d->path.data, d->path.len) != GIT_SUCCESS
+	  || packbuf_put(&d->changes, &c, sizeof(c)) != GIT_SUCCESS )
+		return GIT_ENOMEM;
+	return GIT_SUCCESS;
+}
+
+int tree_diff_rec( struct tree_diff *d, git_tree *a, git_tree *b );
+
+// Either entry may be NULL, otherwise both share a name and kind.
+static int
+tree_diff_entry( struct tree_diff *d,
+		const git_tree_entry *ea, const git_tree_entry *eb ) {
+	const git_tree_entry *e = ea ? ea : eb;
+	const char *name = git_tree_entry_name(e);
+	unsigned int mode = git_tree_entry_attributes(e);
+	size_t base = d->path.len;
+	git_tree *ta = NULL, *tb = NULL;
+	int m, err = GIT_SUCCESS;
+	if ( (base && (err = packbuf_put(&d->path,"/",1)))
+	  || (err = packbuf_put(&d->path,name,strlen(name))) )
+		return err;
+	m = path_prefix_match( d->path.data, d->path.len, d->prefix, d->plen );
+	if (m == PREFIX_OUTSIDE || (m == PREFIX_ABOVE && !git_mode_is_tree(mode)))
+		;
+	else if (!git_mode_is_tree(mode))
+		err = tree_diff_change( d, ea, eb );
+	else {
+		if (ea)
+			err = git_tree_lookup( &ta, d->repo, git_tree_entry_id(ea) );
+		if (eb && err == GIT_SUCCESS)
+			err = git_tree_lookup( &tb, d->repo, git_tree_entry_id(eb) );
+		if (err == GIT_SUCCESS)
+			err = tree_diff_rec( d, ta, tb );
+		if (ta)  git_tree_close(ta);
+		if (tb)  git_tree_close(tb);
+	}
+	d->path.len = base;
+	return err;
+}
+
+int tree_diff_rec( struct tree_diff *d, git_tree *a, git_tree *b ) {
+	unsigned int i = 0, j = 0;
+	unsigned int na = a ? git_tree_entrycount(a) : 0;
+	unsigned int nb = b ? git_tree_entrycount(b) : 0;
+	const git_tree_entry *ea, *eb;
+	int c, err = GIT_SUCCESS;
+	while (err == GIT_SUCCESS && (i < na || j < nb)) {
+		ea = i < na ? git_tree_entry_byindex(a,i) : NULL;
+		eb = j < nb ? git_tree_entry_byindex(b,j) : NULL;
+		c = !ea ? 1 : !eb ? -1 : tree_entry_cmp(ea,eb);
+		if (c < 0) {
+			err = tree_diff_entry( d, ea, NULL );  i++;
+		} else if (c > 0) {
+			err = tree_diff_entry( d, NULL, eb );  j++;
+		} else {
+			if ( git_oid_cmp(git_tree_entry_id(ea), git_tree_entry_id(eb)) != 0
+			  || git_tree_entry_attributes(ea) != git_tree_entry_attributes(eb) )
+				err = tree_diff_entry( d, ea, eb );
+			i++;  j++;
+		}
+	}
+	return err;
+}  // either tree may be NULL, standing for an empty tree
+
+CAMLprim value
+ocaml_git_tree_diff( value repo, value prefix, value a, value b ) {
+	CAMLparam4(repo,prefix,a,b);
+	CAMLlocal2(r,c);
+	struct repo_lock *lk;
+	struct tree_diff d;
+	struct tree_change *ch;
+	intnat *ends;
+	size_t i, n;
+	int err;
+	memset( &d, 0, sizeof(d) );
+	d.repo = *(git_repository **)Data_custom_val(repo);
+	d.prefix = String_copy(prefix);
+	d.plen = prefix_length(d.prefix);
+	enter_repo_section(lk, Repo_key(d.repo));
+	err = tree_diff_rec( &d, Git_ptr_val(git_tree,a),
+			Git_ptr_val(git_tree,b) );
+	leave_repo_section(lk);
+	free( (char *)d.prefix );
+	packbuf_free(&d.path);
+	if (err != GIT_SUCCESS) {
+		strtab_free(&d.paths);
+		packbuf_free(&d.changes);
+	}
+	pass_git_exceptions(err,"Git.Tree.diff",INVALID_EXN);
+	n = d.changes.len / sizeof(struct tree_change);
+	ch = (struct tree_change *)d.changes.data;
+	ends = (intnat *)d.paths.ends.data;
+	r = caml_alloc(n,0);
+	for (i=0; i < n; i++) {
+		c = caml_alloc(6,0);
+		Store_field(c, 0, Val_int(ch[i].status));
+		Store_field(c, 1, caml_alloc_string( ends[i] - (i ? ends[i-1] : 0) ));
+		memcpy( String_val(Field(c,1)), d.paths.strings.data + (i ? ends[i-1] : 0),
+			ends[i] - (i ? ends[i-1] : 0) );
+		Store_field(c, 2, Val_int(ch[i].old_mode));
+		Store_field(c, 3, Val_int(ch[i].new_mode));
+		Store_field(c, 4, caml_copy_git_oid(&ch[i].old_oid));
+		Store_field(c, 5, caml_copy_git_oid(&ch[i].new_oid));
+		Store_field(r, i, c);
+	}
+	strtab_free(&d.paths);
+	packbuf_free(&d.changes);
+	CAMLreturn(r);
+}  // the fields follow the Tree.change record in git.ml
+
+// TreeBuilder.of_paths applies path edits to a base tree in memory and
+// writes the new trees bottom up, rewriting only the directories along
+// edited paths.  Untouched subtrees keep their oids without being read.
+// Edits get sorted component wise, with '/' below every other byte, so
+// the edits under each directory form a single run, and with equal paths
+// in the caller's order, so the last edit to a path wins.
+
+struct tree_edit { const char *path; size_t len, seq; unsigned int mode; git_oid oid; };
+
+struct build_entry { const char *name; size_t len; unsigned int mode; git_oid oid; };
+
+struct tree_build { git_repository *repo; git_odb *odb; struct packbuf buf; };
+
+static int
+tree_edit_byte( const struct tree_edit *e, size_t i )
+	{ return i == e->len ? -1 : e->path[i] == '/' ? 0 : (unsigned char)e->path[i] + 1; }
+
+static int
+tree_edit_cmp( const void *a, const void *b ) {
+	const struct tree_edit *x = a, *y = b;
+	size_t i = 0;
+	while (i < x->len && i < y->len && x->path[i] == y->path[i])  i++;
+	if (tree_edit_byte(x,i) != tree_edit_byte(y,i))
+		return tree_edit_byte(x,i) - tree_edit_byte(y,i);
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int
+build_entry_name_cmp( const void *a, const void *b ) {
+	const struct build_entry *x = a, *y = b;
+	int c = memcmp( x->name, y->name, x->len < y->len ? x->len : y->len );
+	return c ? c : x->len < y->len ? -1 : x->len > y->len;
+}
+
+static int
+build_entry_cmp( const void *a, const void *b ) {
+	const struct build_entry *x = a, *y = b;
+	size_t n = x->len < y->len ? x->len : y->len;
+	int c = memcmp( x->name, y->name, n ), d;
+	if (c)  return c;
+	c = x->len > n ? (unsigned char)x->name[n] : git_mode_is_tree(x->mode) ? '/' : 0;
+	d = y->len > n ? (unsigned char)y->name[n] : git_mode_is_tree(y->mode) ? '/' : 0;
+	return c - d;
+}  // git's order, as in tree_entry_cmp
+
+static int
+tree_build_write( struct tree_build *b, struct build_entry *es, size_t n, git_oid *out ) {
+	char mode[16];
+	size_t i;
+	qsort( es, n, sizeof(struct build_entry), &build_entry_cmp );
+	b->buf.len = 0;
+	if (packbuf_grow(&b->buf, 1) != GIT_SUCCESS)  return GIT_ENOMEM;
+	for (i=0; i < n; i++)
+		if ( packbuf_put(&b->buf, mode, sprintf(mode, "%o ", es[i].mode)) != GIT_SUCCESS
+		  || packbuf_put(&b->buf, es[i].name, es[i].len) != GIT_SUCCESS
+		  || packbuf_put(&b->buf, "", 1) != GIT_SUCCESS
+		  || packbuf_put(&b->buf, &es[i].oid, GIT_OID_RAWSZ) != GIT_SUCCESS )
+			return GIT_ENOMEM;
+	return git_odb_write( out, b->odb, b->buf.data, b->buf.len, GIT_OBJ_TREE );
+}
+
+// Builds the directory at depth, the length of its path prefix, from base,
+// which may be NULL, and the n edits below it.  Directories left empty are
+// not written, and leave *out untouched.
+static int
+tree_build_rec( struct tree_build *b, git_tree *base,
+		struct tree_edit *ed, size_t n, size_t depth, git_oid *out, size_t *count ) {
+	struct packbuf entries = { NULL, 0, 0 };
+	struct build_entry *es, key, *hit;
+	struct tree_edit *exact, *deeper;
+	const git_tree_entry *te;
+	unsigned int i, nbase = base ? git_tree_entrycount(base) : 0;
+	size_t j, k, nes, sub = 0;
+	git_tree *subtree;
+	int err = GIT_SUCCESS;
+	for (i=0; i < nbase && err == GIT_SUCCESS; i++) {
+		te = git_tree_entry_byindex(base, i);
+		key.name = git_tree_entry_name(te);
+		key.len = strlen(key.name);
+		key.mode = git_tree_entry_attributes(te);
+		git_oid_cpy( &key.oid, git_tree_entry_id(te) );
+		err = packbuf_put( &entries, &key, sizeof(key) );
+	}
+	nes = nbase;
+	qsort( entries.data, nes, sizeof(struct build_entry), &build_entry_name_cmp );
+	for (j=0; j < n && err == GIT_SUCCESS; j = k) {
+		key.name = ed[j].path + depth;
+		key.len = strcspn( key.name, "/" );
+		exact = NULL;
+		for (k=j; k < n && ed[k].len >= depth + key.len
+				&& memcmp(ed[k].path + depth, key.name, key.len) == 0
+				&& (ed[k].len == depth + key.len || ed[k].path[depth + key.len] == '/'); k++)
+			if (ed[k].len == depth + key.len)  exact = &ed[k];
+		hit = bsearch( &key, entries.data, nes, sizeof(struct build_entry),
+			&build_entry_name_cmp );  // only base entries, new ones go after them
+		if (exact) {
+			key.mode = exact->mode;
+			git_oid_cpy( &key.oid, &exact->oid );
+		} else if (hit)
+			key = *hit;
+		else
+			key.mode = 0;
+		deeper = exact ? exact + 1 : ed + j;
+		if (deeper < ed + k) {
+			subtree = NULL;
+			if (git_mode_is_tree(key.mode))
+				err = git_tree_lookup( &subtree, b->repo, &key.oid );
+			if (err == GIT_SUCCESS)
+				err = tree_build_rec( b, subtree, deeper, ed + k - deeper,
+					depth + key.len + 1, &key.oid, &sub );
+			if (subtree)  git_tree_close(subtree);
+			key.mode = sub ? GIT_MODE_TREE : 0;
+		}  // a file edited as a directory gets replaced by one
+		if (err != GIT_SUCCESS)
+			;
+		else if (hit)
+			*hit = key;
+		else if (key.mode)
+			err = packbuf_put( &entries, &key, sizeof(key) );
+	}
+	es = (struct build_entry *)entries.data;
+	for (j = k = 0; j < entries.len / sizeof(struct build_entry); j++)
+		if (es[j].mode)  es[k++] = es[j];
+	*count = k;
+	if (err == GIT_SUCCESS && (k > 0 || depth == 0))
+		err = tree_build_write( b, es, k, out );
+	packbuf_free(&entries);
+	return err;
+}  // names point into base entries or edit paths, so base stays open until the write
+
+// The modes git writes into trees, and 0 for a removal.
+
+static int
+tree_build_mode_ok( intnat m ) {
+	return m == 0 || m == GIT_MODE_TREE || m == 0100644 || m == 0100755
+		|| m == 0120000 || m == GIT_MODE_GITLINK;
+}
+
+CAMLprim value
+ocaml_git_treebuilder_of_paths( value repo, value base, value edits ) {
+	CAMLparam3(repo,base,edits);
+	struct repo_lock *lk;
+	struct tree_build b;
+	struct tree_edit *ed;
+	size_t i, n = Wosize_val(edits), total = 0, count;
+	git_oid oid;
+	char *paths;
+	value e;
+	int err;
+	for (i=0; i < n; i++) {
+		e = Field(edits,i);
+		total += caml_string_length(Field(e,0)) + 1;
+		if ( !tree_build_mode_ok(Long_val(Field(e,1)))
+		  || caml_string_length(Field(e,2)) != GIT_OID_RAWSZ )
+			caml_invalid_argument("Git.TreeBuilder.of_paths");
+	}
+	ed = malloc( sizeof(struct tree_edit) * (n ? n : 1) );
+	paths = malloc( total ? total : 1 );
+	if (ed == NULL || paths == NULL) {
+		free(ed);  free(paths);
+		caml_raise_out_of_memory();
+	}
+	for (i = total = 0; i < n; i++) {
+		e = Field(edits,i);
+		ed[i].len = caml_string_length(Field(e,0));
+		ed[i].path = memcpy( paths + total, String_val(Field(e,0)), ed[i].len );
+		paths[total + ed[i].len] = 0;
+		total += ed[i].len + 1;
+		ed[i].seq = i;
+		ed[i].mode = Long_val(Field(e,1));
+		memcpy( &ed[i].oid, String_val(Field(e,2)), GIT_OID_RAWSZ );
+		if ( ed[i].len == 0 || memchr(ed[i].path, 0, ed[i].len)
+		  || ed[i].path[0] == '/' || ed[i].path[ed[i].len-1] == '/'
+		  || strstr(ed[i].path, "//") ) {
+			free(ed);  free(paths);
+			caml_invalid_argument("Git.TreeBuilder.of_paths");
+		}  // no empty path components
+	}
+	qsort( ed, n, sizeof(struct tree_edit), &tree_edit_cmp );
+	memset( &b, 0, sizeof(b) );
+	b.repo = *(git_repository **)Data_custom_val(repo);
+	b.odb = git_repository_database(b.repo);
+	enter_repo_section(lk, Repo_key(b.repo));
+	err = tree_build_rec( &b, Is_block(base) ? Git_ptr_val(git_tree,Field(base,0))
+		: NULL, ed, n, 0, &oid, &count );
+	leave_repo_section(lk);
+	packbuf_free(&b.buf);
+	free(ed);
+	free(paths);
+	pass_git_exceptions(err,"Git.TreeBuilder.of_paths",INVALID_EXN);
+	CAMLreturn( caml_copy_git_oid(&oid) );
+}  // edits are (path, mode, oid) triples, mode 0 removing the path
+
+// Tree.grep lists the files under a tree with the walk above, then scans
+// their blobs in place for a fixed string.  Workers claim files in chunks,
+// each through a repository of its own opened from the given path, since
+// a repository must never be used from two threads at once.  Without a
+// path, the calling thread scans alone through the caller's repository,
+// holding its lock throughout, as it does for the walk in any case.
+// Like git, we take blobs with a NUL among their first 8000 bytes to be
+// binary and skip them.  Hits get sorted back into walk order at the end.
+
+#define GREP_CHUNK		16
+#define GREP_BINARY_PROBE	8000
+
+struct grep_hit { size_t file, line, off; };
+
+struct grep_scan {
+	const char *needle;  size_t nlen;
+	const char *path;	// repository each worker opens, or NULL
+	git_repository *repo;	// used instead when path is NULL
+	struct listing *files;
+	size_t n, next;		// next is claimed atomically
+	int failed;
+};
+
+struct grep_worker {
+	struct grep_scan *s;
+	struct packbuf hits;	// struct grep_hit
+	int started, err;
+	pthread_t tid;
+};
+
+static const char *
+grep_find( const char *p, const char *end, const char *needle, size_t nlen ) {
+	const char *q;
+	while ((size_t)(end - p) >= nlen) {
+		if ((q = memchr( p, needle[0], end - p - nlen + 1 )) == NULL)
+			return NULL;
+		if ( q[nlen-1] == needle[nlen-1] && memcmp(q, needle, nlen) == 0 )
+			return q;
+		p = q + 1;
+	}
+	return NULL;
+}  // the C library vectorizes memchr, so memcmp only runs on candidates
+
+static int
+grep_blob( struct grep_worker *w, size_t file, const char *d, size_t n ) {
+	const char *p = d, *line = d, *end = d + n, *q, *nl;
+	struct grep_hit h;
+	if ( n == 0 || memchr(d, 0, n < GREP_BINARY_PROBE ? n : GREP_BINARY_PROBE) )
+		return GIT_SUCCESS;
+	h.file = file;  h.line = 1;
+	while ((q = grep_find( p, end, w->s->needle, w->s->nlen )) != NULL) {
+		while ((nl = memchr( line, '\n', q - line )) != NULL) {
+			h.line++;
+			line = nl + 1;
+		}
+		h.off = q - d;
+		if (packbuf_put( &w->hits, &h, sizeof(h) ) != GIT_SUCCESS)
+			return GIT_ENOMEM;
+		p = q + w->s->nlen;
+	}
+	return GIT_SUCCESS;
+}  // matches do not overlap, and lines count from 1
+
+static void *
+grep_worker( void *arg ) {
+	struct grep_worker *w = arg;
+	struct grep_scan *s = w->s;
+	const intnat *modes = (const intnat *)s->files->modes.data;
+	const git_oid *oids = (const git_oid *)s->files->oids.data;
+	git_repository *repo = s->repo;
+	git_blob *blob;
+	size_t i, lo, hi;
+	if (s->path && (w->err = git_repository_open( &repo, s->path )) != GIT_SUCCESS) {
+		s->failed = 1;
+		return NULL;
+	}
+	while ( !s->failed && (lo = __sync_fetch_and_add( &s->next, GREP_CHUNK )) < s->n ) {
+		hi = lo + GREP_CHUNK < s->n ? lo + GREP_CHUNK : s->n;
+		for (i=lo; i < hi && w->err == GIT_SUCCESS; i++) {
+			if ((modes[i] & GIT_MODE_TYPE_MASK) == GIT_MODE_GITLINK)
+				continue;
+			if ((w->err = git_blob_lookup( &blob, repo, &oids[i] )) != GIT_SUCCESS)
+				break;
+			w->err = grep_blob( w, i, git_blob_rawcontent(blob),
+					git_blob_rawsize(blob) );
+			git_blob_close(blob);
+		}
+		if (w->err != GIT_SUCCESS)  s->failed = 1;
+	}
+	if (s->path)  git_repository_free(repo);
+	return NULL;
+}
+
+static int
+grep_hit_cmp( const void *a, const void *b ) {
+	const struct grep_hit *x = a, *y = b;
+	if (x->file != y->file)  return x->file < y->file ? -1 : 1;
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+struct grep_matches { struct strtab_buf files; struct packbuf file, lines, offsets; };
+
+static int
+grep_collect( struct grep_worker *ws, int k, struct listing *l, struct grep_matches *m ) {
+	const intnat *ends = (const intnat *)l->paths.ends.data;
+	struct grep_hit *all;
+	size_t i, n = 0, nfiles = 0, start;
+	int j, err = GIT_SUCCESS;
+	for (j=0; j < k; j++)  n += ws[j].hits.len / sizeof(struct grep_hit);
+	if ((all = malloc( sizeof(struct grep_hit) * (n ? n : 1) )) == NULL)
+		return GIT_ENOMEM;
+	for (j = 0, n = 0; j < k; j++) {
+		memcpy( all + n, ws[j].hits.data, ws[j].hits.len );
+		n += ws[j].hits.len / sizeof(struct grep_hit);
+	}
+	qsort( all, n, sizeof(struct grep_hit), &grep_hit_cmp );
+	for (i=0; i < n && err == GIT_SUCCESS; i++) {
+		if (i == 0 || all[i].file != all[i-1].file) {
+			start = all[i].file ? ends[all[i].file - 1] : 0;
+			err = strtab_add( &m->files, l->paths.strings.data + start,
+					ends[all[i].file] - start );
+			nfiles++;
+		}
+		if ( err != GIT_SUCCESS
+		  || packbuf_put_int(&m->file, nfiles - 1) != GIT_SUCCESS
+		  || packbuf_put_int(&m->lines, all[i].line) != GIT_SUCCESS
+		  || packbuf_put_int(&m->offsets, all[i].off) != GIT_SUCCESS )
+			err = GIT_ENOMEM;
+	}
+	free(all);
+	return err;
+}  // files lists each matching path once, file indexes it per match
+
+CAMLprim value
+ocaml_git_tree_grep( value repo, value tree, value prefix, value needle, value pool ) {
+	CAMLparam5(repo,tree,prefix,needle,pool);
+	CAMLlocal1(r);
+	git_tree *t = Git_ptr_val(git_tree,tree);
+	struct tree_walk w;
+	struct grep_scan s;
+	struct grep_matches m;
+	struct grep_worker *ws;
+	struct repo_lock *lk;
+	int i, k = Is_block(pool) ? Int_val(Field(Field(pool,0),1)) : 1, err;
+	if (caml_string_length(needle) == 0)
+		caml_invalid_argument("Git.Tree.grep");
+	if (k < 1)  k = 1;
+	memset( &w, 0, sizeof(w) );
+	memset( &s, 0, sizeof(s) );
+	memset( &m, 0, sizeof(m) );
+	if ((ws = calloc( k, sizeof(struct grep_worker) )) == NULL)
+		caml_raise_out_of_memory();
+	w.repo = s.repo = *(git_repository **)Data_custom_val(repo);
+	w.prefix = String_copy(prefix);
+	w.plen = prefix_length(w.prefix);
+	w.max_depth = -1;
+	s.needle = String_copy(needle);
+	s.nlen = caml_string_length(needle);
+	s.path = k > 1 ? String_copy(Field(Field(pool,0),0)) : NULL;
+	s.files = &w.out;
+	caml_enter_blocking_section();
+	lk = repo_enter( Repo_key(w.repo) );
+	err = tree_walk_rec( &w, t, 0 );
+	if (s.path)  repo_leave(lk);
+	s.n = w.out.modes.len / sizeof(intnat);
+	if (err == GIT_SUCCESS) {
+		for (i=0; i < k; i++)  ws[i].s = &s;
+		for (i=1; i < k; i++)
+			ws[i].started = pthread_create( &ws[i].tid, NULL, &grep_worker, &ws[i] ) == 0;
+		grep_worker(&ws[0]);
+		for (i=1; i < k; i++)
+			if (ws[i].started)  pthread_join( ws[i].tid, NULL );
+		for (i=0; i < k && err == GIT_SUCCESS; i++)
+			err = ws[i].err;
+	}
+	if (s.path == NULL)  repo_leave(lk);
+	if (err == GIT_SUCCESS)
+		err = grep_collect( ws, k, &w.out, &m );
+	caml_leave_blocking_section();
+	for (i=0; i < k; i++)  packbuf_free(&ws[i].hits);
+	free(ws);
+	free( (char *)w.prefix );
+	free( (char *)s.needle );
+	free( (char *)s.path );
+	packbuf_free(&w.path);
+	listing_free(&w.out);
+	if (err != GIT_SUCCESS) {
+		strtab_free(&m.files);
+		packbuf_free(&m.file);  packbuf_free(&m.lines);  packbuf_free(&m.offsets);
+	}
+	pass_git_exceptions(err,"Git.Tree.grep",INVALID_EXN);
+	r = caml_alloc(5,0);
+	Store_field(r, 0, Val_long(m.file.len / sizeof(intnat)));
+	Store_field(r, 1, caml_copy_strtab(&m.files));
+	Store_field(r, 2, caml_copy_packbuf_ints(&m.file));
+	Store_field(r, 3, caml_copy_packbuf_ints(&m.lines));
+	Store_field(r, 4, caml_copy_packbuf_ints(&m.offsets));
+	strtab_free(&m.files);
+	packbuf_free(&m.file);  packbuf_free(&m.lines);  packbuf_free(&m.offsets);
+	CAMLreturn(r);
+}  // the fields follow the Tree.matches record in git.ml
+
 
 /* *** Commit operations *** */
 
-#define git_commit_custom_ops git_object_custom_ops
+#define caml_wrap_git_commit(P)  caml_wrap_git_object( (git_object *)(P) )
 
 CAMLprim value ocaml_git_commit_lookup( value repo, value id )
    { return _ocaml_git_object_lookup(repo,id,GIT_OBJ_COMMIT); }
@@ -399,27 +3470,439 @@ CAMLprim value
 ocaml_git_commit_time(value commit) {
    CAMLparam1(commit);
    git_time time;
-   git_commit *c = *(git_commit **)Data_custom_val(commit);
+   git_commit *c = Git_ptr_val(git_commit,commit);
    time.time = git_commit_time(c);
    time.offset = git_commit_time_offset(c);
    CAMLreturn( git_time_to_ocaml_time(time) );
 }  // should submit a patch to libgit2 to use a git_time
 
-#define wrap_retval_commit(NN,C)  wrap_retval_ptr1(NN,C,git_commit)
-wrap_retval_commit(git_commit_message_short,caml_copy_string);
-wrap_retval_commit(git_commit_message,caml_copy_string);
-wrap_retval_commit(git_commit_committer,git_signture_to_ocaml_signture);
-wrap_retval_commit(git_commit_author,git_signture_to_ocaml_signture);
+#define wrap_retval_commit(NN,C)  wrap_retval_ptr1(NN,C,git_commit)
+wrap_retval_commit(git_commit_message_short,caml_copy_string);
+wrap_retval_commit(git_commit_message,caml_copy_string);
+wrap_retval_commit(git_commit_committer,git_signture_to_ocaml_signture);
+wrap_retval_commit(git_commit_author,git_signture_to_ocaml_signture);
+
+wrap_setptr_blocking_ptr1(git_commit_tree,git_tree,
+	"Git.Commit.tree",INVALID_EXN,
+	git_commit);
+// ocaml_git_commit_tree calls git_tree_lookup
+
+wrap_retval_commit(git_commit_parentcount, Val_int);
+wrap_setptr_blocking_ptr1_val1(git_commit_parent,git_commit,
+	"Git.Commit.parent",INVALID_EXN,
+	git_commit,int,Int_val,Release_none);
+
+// libgit2 offers no accessors for the raw tree and parent oids, and
+// git_commit_tree and git_commit_parent parse the whole tree or parent
+// commit to hand them back.  Neither does git_commit_lookup leave us the
+// object it parsed, so asking for a commit's header fields through it
+// reads and inflates the commit twice.  We parse the raw object ourselves
+// instead, like reach_parse, reading it once for all of its fields, so
+// callers who only want the oids, like Git.Cache, never touch the objects
+// they name, and log_columns never builds a git_commit at all.
+
+struct commit_sig {
+	const char *name, *email;
+	size_t name_len, email_len;
+	git_time when;
+};
+
+struct commit_raw {
+	git_odb_object *obj;
+	git_oid tree;
+	const char *parents;		// the first "parent " line
+	unsigned int parentcount;
+	struct commit_sig author, committer;
+	const char *message;		// the first paragraph, if any
+	size_t message_len;
+};
+
+#define COMMIT_PARENT_LINE	(sizeof("parent ") - 1 + GIT_OID_HEXSZ + 1)
+
+// Parses a "field Name <email> 1234567890 +0100\n" line the way libgit2's
+// signature parser does, the offset counted in minutes.
+
+static int
+commit_sig_parse( const char **p, const char *end, const char *field,
+		struct commit_sig *sig ) {
+	size_t len = strlen(field);
+	const char *line = *p + len, *eol, *lt, *gt, *q;
+	int sign, hh, mm;
+	if ((size_t)(end - *p) < len || memcmp(*p, field, len) != 0)
+		return GIT_EOBJCORRUPTED;
+	if ( (eol = memchr(line, '\n', end - line)) == NULL
+	  || (lt = memchr(line, '<', eol - line)) == NULL
+	  || (gt = memchr(lt, '>', eol - lt)) == NULL )
+		return GIT_EOBJCORRUPTED;
+	sig->name = line;
+	for (sig->name_len = lt - line; sig->name_len && line[sig->name_len-1] == ' '; )
+		sig->name_len--;
+	sig->email = lt + 1;
+	sig->email_len = gt - lt - 1;
+	for (q = gt + 1; q < eol && *q == ' '; q++)
+		;
+	if (q == eol || *q < '0' || *q > '9')  return GIT_EOBJCORRUPTED;
+	for (sig->when.time = 0; q < eol && *q >= '0' && *q <= '9'; q++)
+		sig->when.time = sig->when.time * 10 + (*q - '0');
+	for (; q < eol && *q == ' '; q++)
+		;
+	if ( eol - q < 5 || (*q != '+' && *q != '-')
+	  || q[1] < '0' || q[1] > '9' || q[2] < '0' || q[2] > '9'
+	  || q[3] < '0' || q[3] > '9' || q[4] < '0' || q[4] > '9' )
+		return GIT_EOBJCORRUPTED;
+	sign = *q == '-' ? -1 : 1;
+	hh = (q[1] - '0') * 10 + (q[2] - '0');
+	mm = (q[3] - '0') * 10 + (q[4] - '0');
+	sig->when.offset = sign * (hh * 60 + mm);
+	*p = eol + 1;
+	return GIT_SUCCESS;
+}
+
+// Skips any further headers, like encoding or a multiline gpgsig, to the
+// blank line, and takes the message's first paragraph with its newlines
+// to be spaces, as git_commit_message_short has it.
+
+static void
+commit_raw_message( struct commit_raw *raw, const char *p, const char *end ) {
+	const char *eol;
+	while (p < end && *p != '\n') {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)  { p = end;  break; }
+		p = eol + 1;
+	}
+	while (p < end && *p == '\n')
+		p++;
+	raw->message = p;
+	for (eol = p; eol < end; eol++)
+		if (*eol == '\n' && (eol + 1 == end || eol[1] == '\n'))  break;
+	raw->message_len = eol - p;
+}
+
+// Reads the commit once, leaving its object open for the fields to point
+// into until commit_raw_close.  The caller holds the repository's lock.
+
+static int
+commit_raw_read( git_odb *db, const git_oid *oid, struct commit_raw *raw ) {
+	const char *p, *end;
+	git_oid parent;
+	int err;
+	memset( raw, 0, sizeof(*raw) );
+	if ((err = git_odb_read( &raw->obj, db, oid )) != GIT_SUCCESS)
+		return err;
+	if (git_odb_object_type(raw->obj) != GIT_OBJ_COMMIT) {
+		err = GIT_ENOTFOUND;  // no such commit
+		goto fail;
+	}
+	p = git_odb_object_data(raw->obj);
+	end = p + git_odb_object_size(raw->obj);
+	if ((err = header_oid( &p, end, "tree ", &raw->tree )) != GIT_SUCCESS) {
+		if (err == GIT_ENOTFOUND)  err = GIT_EOBJCORRUPTED;
+		goto fail;
+	}
+	raw->parents = p;
+	while ((err = header_oid( &p, end, "parent ", &parent )) == GIT_SUCCESS)
+		raw->parentcount++;
+	if ( err != GIT_ENOTFOUND
+	  || (err = commit_sig_parse( &p, end, "author ", &raw->author )) != GIT_SUCCESS
+	  || (err = commit_sig_parse( &p, end, "committer ", &raw->committer )) != GIT_SUCCESS )
+		goto fail;
+	commit_raw_message( raw, p, end );
+	return GIT_SUCCESS;
+fail:
+	git_odb_object_close(raw->obj);
+	raw->obj = NULL;
+	return err;
+}
+
+static void
+commit_raw_parent( const struct commit_raw *raw, unsigned int n, git_oid *oid ) {
+	git_oid_mkstr( oid, raw->parents + n * COMMIT_PARENT_LINE + sizeof("parent ") - 1 );
+}  // commit_raw_read checked every parent line
+
+// Hands the object's close to repo_defer, so callers who copy the fields
+// out after leaving the repository section may close it there too.
+
+static void
+commit_raw_close( git_odb *db, struct commit_raw *raw ) {
+	if (raw->obj)  repo_defer( db, &odb_object_deferred_close, raw->obj );
+	raw->obj = NULL;
+}
+
+#define Commit_odb(C)	git_repository_database( git_object_owner((git_object *)(C)) )
+
+static value
+caml_copy_commit_sig( const struct commit_sig *sig ) {
+	CAMLparam0();
+	CAMLlocal1(b);
+	b = caml_alloc(3,0);
+	Store_field(b, 0, caml_alloc_string(sig->name_len) );
+	memcpy( String_val(Field(b,0)), sig->name, sig->name_len );
+	Store_field(b, 1, caml_alloc_string(sig->email_len) );
+	memcpy( String_val(Field(b,1)), sig->email, sig->email_len );
+	Store_field(b, 2, git_time_to_ocaml_time(sig->when) );
+	CAMLreturn(b);
+}  // like git_signture_to_ocaml_signture
+
+static value
+caml_copy_commit_parents( const struct commit_raw *raw ) {
+	CAMLparam0();
+	CAMLlocal1(ps);
+	git_oid oid;
+	unsigned int i;
+	ps = caml_alloc(raw->parentcount,0);
+	for (i=0; i < raw->parentcount; i++) {
+		commit_raw_parent( raw, i, &oid );
+		Store_field(ps, i, caml_copy_git_oid(&oid));
+	}
+	CAMLreturn(ps);
+}
+
+CAMLprim value
+ocaml_git_commit_tree_id( value commit ) {
+	CAMLparam1(commit);
+	struct repo_lock *lk;
+	git_commit *c = Git_ptr_val(git_commit,commit);
+	git_odb *db = Commit_odb(c);
+	struct commit_raw raw;
+	int err;
+	enter_repo_section(lk, db);
+	err = commit_raw_read( db, git_object_id((git_object *)c), &raw );
+	commit_raw_close( db, &raw );
+	leave_repo_section(lk);
+	pass_git_exceptions(err,"Git.Commit.tree_id",INVALID_EXN);
+	CAMLreturn( caml_copy_git_oid(&raw.tree) );
+}
+
+CAMLprim value
+ocaml_git_commit_parent_id( value commit, value n ) {
+	CAMLparam2(commit,n);
+	struct repo_lock *lk;
+	git_commit *c = Git_ptr_val(git_commit,commit);
+	git_odb *db = Commit_odb(c);
+	struct commit_raw raw;
+	git_oid oid;
+	int err;
+	enter_repo_section(lk, db);
+	err = commit_raw_read( db, git_object_id((git_object *)c), &raw );
+	if (err == GIT_SUCCESS && (Long_val(n) < 0 || Long_val(n) >= raw.parentcount))
+		err = GIT_ENOTFOUND;
+	if (err == GIT_SUCCESS)  commit_raw_parent( &raw, Long_val(n), &oid );
+	commit_raw_close( db, &raw );
+	leave_repo_section(lk);
+	pass_git_exceptions(err,"Git.Commit.parent_id",INVALID_EXN);
+	CAMLreturn( caml_copy_git_oid(&oid) );
+}
+
+CAMLprim value
+ocaml_git_commit_parent_ids( value commit ) {
+	CAMLparam1(commit);
+	CAMLlocal1(ps);
+	struct repo_lock *lk;
+	git_commit *c = Git_ptr_val(git_commit,commit);
+	git_odb *db = Commit_odb(c);
+	struct commit_raw raw;
+	int err;
+	enter_repo_section(lk, db);
+	err = commit_raw_read( db, git_object_id((git_object *)c), &raw );
+	leave_repo_section(lk);
+	pass_git_exceptions(err,"Git.Commit.parent_ids",INVALID_EXN);
+	ps = caml_copy_commit_parents(&raw);
+	commit_raw_close( db, &raw );
+	CAMLreturn(ps);
+}  // the object stays open while we copy, repo_defer closing it
+
+// Commit.info gathers a commit's metadata in one crossing and one read,
+// the fields following the Commit.info record in git.ml.
+
+CAMLprim value
+ocaml_git_commit_info( value commit ) {
+	CAMLparam1(commit);
+	CAMLlocal2(r,ps);
+	struct repo_lock *lk;
+	git_commit *c = Git_ptr_val(git_commit,commit);
+	git_odb *db = Commit_odb(c);
+	struct commit_raw raw;
+	size_t i;
+	int err;
+	enter_repo_section(lk, db);
+	err = commit_raw_read( db, git_object_id((git_object *)c), &raw );
+	leave_repo_section(lk);
+	pass_git_exceptions(err,"Git.Commit.info",INVALID_EXN);
+	r = caml_alloc(6,0);
+	Store_field(r, 0, caml_copy_git_oid(&raw.tree));
+	Store_field(r, 1, caml_copy_commit_parents(&raw));
+	Store_field(r, 2, caml_copy_commit_sig(&raw.author));
+	Store_field(r, 3, caml_copy_commit_sig(&raw.committer));
+	Store_field(r, 4, git_time_to_ocaml_time(raw.committer.when));
+	ps = caml_alloc_string(raw.message_len);
+	for (i=0; i < raw.message_len; i++)
+		String_val(ps)[i] = raw.message[i] == '\n' ? ' ' : raw.message[i];
+	Store_field(r, 5, ps);
+	commit_raw_close( db, &raw );
+	CAMLreturn(r);
+}
+
+// Signatures repeat endlessly across a history, so log_columns interns
+// each distinct name and email pair once, in an open addressing table of
+// indexes into the pair of string tables.
+
+struct ident_tab {
+	struct strtab_buf names, emails;
+	intnat *slots;			// -1 marks an empty slot
+	size_t mask, count;
+};
+
+static const char *
+ident_get( struct strtab_buf *t, intnat i, size_t *len ) {
+	intnat *ends = (intnat *)t->ends.data;
+	intnat start = i ? ends[i-1] : 0;
+	*len = ends[i] - start;
+	return t->strings.data + start;
+}
+
+static size_t
+ident_hash( const char *name, size_t nlen, const char *email, size_t elen ) {
+	size_t h = 2166136261u, i;
+	for (i=0; i < nlen; i++)  h = (h ^ (unsigned char)name[i]) * 16777619u;
+	h = (h ^ 0xff) * 16777619u;
+	for (i=0; i < elen; i++)  h = (h ^ (unsigned char)email[i]) * 16777619u;
+	return h;
+}  // FNV-1a over both strings
+
+static size_t
+ident_slot( struct ident_tab *t, intnat *slots, size_t mask,
+		const char *name, size_t nlen, const char *email, size_t elen ) {
+	size_t j = ident_hash(name,nlen,email,elen) & mask, l;
+	const char *p;
+	while (slots[j] >= 0) {
+		p = ident_get(&t->names, slots[j], &l);
+		if (l == nlen && memcmp(p,name,l) == 0) {
+			p = ident_get(&t->emails, slots[j], &l);
+			if (l == elen && memcmp(p,email,l) == 0)  break;
+		}
+		j = (j + 1) & mask;
+	}
+	return j;
+}
+
+static int
+ident_grow( struct ident_tab *t ) {
+	size_t i, mask = t->mask ? 2 * t->mask + 1 : 255, nlen, elen;
+	intnat *slots = malloc( sizeof(intnat) * (mask + 1) );
+	const char *name, *email;
+	if (slots == NULL)  return GIT_ENOMEM;
+	memset( slots, 0xff, sizeof(intnat) * (mask + 1) );
+	for (i=0; i < t->count; i++) {
+		name = ident_get(&t->names, i, &nlen);
+		email = ident_get(&t->emails, i, &elen);
+		slots[ident_slot(t,slots,mask,name,nlen,email,elen)] = i;
+	}
+	free(t->slots);
+	t->slots = slots;  t->mask = mask;
+	return GIT_SUCCESS;
+}
+
+static int
+ident_intern( struct ident_tab *t, const struct commit_sig *sig, intnat *idx ) {
+	size_t nlen = sig->name_len, elen = sig->email_len, j;
+	if ( 2 * (t->count + 1) > t->mask && ident_grow(t) != GIT_SUCCESS )
+		return GIT_ENOMEM;
+	j = ident_slot(t, t->slots, t->mask, sig->name, nlen, sig->email, elen);
+	if (t->slots[j] < 0) {
+		if ( strtab_add(&t->names, sig->name, nlen) != GIT_SUCCESS
+		  || strtab_add(&t->emails, sig->email, elen) != GIT_SUCCESS )
+			return GIT_ENOMEM;
+		t->slots[j] = t->count++;
+	}
+	*idx = t->slots[j];
+	return GIT_SUCCESS;
+}
+
+static void
+ident_free( struct ident_tab *t ) {
+	strtab_free(&t->names);
+	strtab_free(&t->emails);
+	free(t->slots);
+}
+
+struct log_columns {
+	struct packbuf times, offsets, parents, parent_ends, authors, committers;
+	struct ident_tab idents;
+};
+
+static void
+log_columns_free( struct log_columns *l ) {
+	packbuf_free(&l->times);	packbuf_free(&l->offsets);
+	packbuf_free(&l->parents);	packbuf_free(&l->parent_ends);
+	packbuf_free(&l->authors);	packbuf_free(&l->committers);
+	ident_free(&l->idents);
+}
+
+static int
+log_columns_add( struct log_columns *l, const struct commit_raw *raw ) {
+	unsigned int i;
+	intnat a, m;
+	git_oid oid;
+	for (i=0; i < raw->parentcount; i++) {
+		commit_raw_parent( raw, i, &oid );
+		if (packbuf_put( &l->parents, &oid, sizeof(oid) ) != GIT_SUCCESS)
+			return GIT_ENOMEM;
+	}
+	if ( ident_intern(&l->idents, &raw->author, &a) != GIT_SUCCESS
+	  || ident_intern(&l->idents, &raw->committer, &m) != GIT_SUCCESS
+	  || packbuf_put_int(&l->times, raw->committer.when.time) != GIT_SUCCESS
+	  || packbuf_put_int(&l->offsets, raw->committer.when.offset) != GIT_SUCCESS
+	  || packbuf_put_int(&l->parent_ends, l->parents.len / GIT_OID_RAWSZ) != GIT_SUCCESS
+	  || packbuf_put_int(&l->authors, a) != GIT_SUCCESS
+	  || packbuf_put_int(&l->committers, m) != GIT_SUCCESS )
+		return GIT_ENOMEM;
+	return GIT_SUCCESS;
+}
 
-wrap_setptr_ptr1(git_commit_tree,git_tree,
-	"Git.Commit.tree",INVALID_EXN,
-	git_commit);
-// ocaml_git_commit_tree calls git_tree_lookup
+// The fields follow the Commit.columns record in git.ml.  Parent offsets
+// get their leading zero upon copying, like a string table's offsets.
 
-wrap_retval_commit(git_commit_parentcount, Int_val);
-wrap_setptr_ptr1_val1(git_commit_parent,git_commit,
-	"Git.Commit.parent",INVALID_EXN,
-	git_commit,Int_val);
+CAMLprim value
+ocaml_git_commit_log_columns( value repo, value oids ) {
+	CAMLparam2(repo,oids);
+	CAMLlocal2(r,po);
+	struct repo_lock *lk;
+	git_repository *rp = *(git_repository **)Data_custom_val(repo);
+	git_odb *db = Repo_key(rp);
+	size_t i, n = Wosize_val(oids);
+	struct log_columns l;
+	struct commit_raw raw;
+	git_oid *ids = malloc( sizeof(git_oid) * (n ? n : 1) );
+	int err = GIT_SUCCESS;
+	if (ids == NULL)  caml_raise_out_of_memory();
+	for (i=0; i < n; i++)
+		memcpy( &ids[i], String_val(Field(oids,i)), GIT_OID_RAWSZ );
+	memset( &l, 0, sizeof(l) );
+	enter_repo_section(lk, db);
+	for (i=0; err == GIT_SUCCESS && i < n; i++) {
+		if ((err = commit_raw_read(db, &ids[i], &raw)) != GIT_SUCCESS)  break;
+		err = log_columns_add(&l, &raw);
+		git_odb_object_close(raw.obj);
+	}
+	leave_repo_section(lk);
+	free(ids);
+	if (err != GIT_SUCCESS)  log_columns_free(&l);
+	pass_git_exceptions(err,"Git.Commit.log_columns",INVALID_EXN);
+	po = caml_alloc_intarray(n + 1);
+	((intnat *)Caml_ba_data_val(po))[0] = 0;
+	memcpy( (intnat *)Caml_ba_data_val(po) + 1, l.parent_ends.data, l.parent_ends.len );
+	r = caml_alloc(9,0);
+	Store_field(r, 0, Val_long(n));
+	Store_field(r, 1, caml_copy_packbuf_ints(&l.times));
+	Store_field(r, 2, caml_copy_packbuf_ints(&l.offsets));
+	Store_field(r, 3, caml_copy_packbuf(&l.parents));
+	Store_field(r, 4, po);
+	Store_field(r, 5, caml_copy_packbuf_ints(&l.authors));
+	Store_field(r, 6, caml_copy_packbuf_ints(&l.committers));
+	Store_field(r, 7, caml_copy_strtab(&l.idents.names));
+	Store_field(r, 8, caml_copy_strtab(&l.idents.emails));
+	log_columns_free(&l);
+	CAMLreturn(r);
+}
 
 CAMLprim value
 ocaml_git_commit_create(value repo, value update_ref,
@@ -463,13 +3946,15 @@ ocaml_git_commit_create_o(value repo, value update_ref,
 	git_signature a = ocaml_signture_to_git_signture_dirty(author);
 	git_signature c = ocaml_signture_to_git_signture_dirty(committer);
 	len = Wosize_val(parents);
+	for (i=0; i < len; i++)  // raises before the malloc
+		Git_ptr_val(git_commit,Field(parents,i));
 	p = malloc(sizeof(git_oid *) * len);
 	for (i=0; i < len; i++)
-		p[i] = *(git_commit **)Data_custom_val(Field(parents,i));
+		p[i] = Git_ptr_val(git_commit,Field(parents,i));
 	int err = git_commit_create_o( (git_oid *)String_val(id),
 		*(git_repository **)Data_custom_val(repo),
 		String_val(update_ref), &a, &c, String_val(msg),
-		*(git_tree **)Data_custom_val(tree), len, p );
+		Git_ptr_val(git_tree,tree), len, p );
 	free(p);
 	pass_git_exceptions(err,"Git.Commit.create_o",INVALID_EXN);
 	CAMLreturn(id);
@@ -482,7 +3967,7 @@ ocaml_git_commit_create_o_bytecode(value *a,int n)
 
 /* *** Blob operations *** */
 
-#define git_blob_custom_ops git_object_custom_ops
+#define caml_wrap_git_blob(P)  caml_wrap_git_object( (git_object *)(P) )
 
 CAMLprim value ocaml_git_blob_lookup( value repo, value id )
 	{ return _ocaml_git_object_lookup(repo,id,GIT_OBJ_BLOB); }
@@ -494,22 +3979,89 @@ CAMLprim value
 ocaml_git_blob_rawcontent(value blob) {
 	CAMLparam1(blob);
 	CAMLlocal1(c);
-	git_blob *b = *(git_blob **)Data_custom_val(blob);
+	git_blob *b = Git_ptr_val(git_blob,blob);
 	size_t size = git_blob_rawsize(b);
 	c = caml_alloc_string(size);
 	memcpy( String_val(c), git_blob_rawcontent(b), size );
 	CAMLreturn(c);
 }  // null blobs are returnned as empty blobs
 
+// A content view exposes libgit2's own blob buffer as a bigarray instead of
+// copying it into the heap.  The bigarray is a plain external one, paired
+// in a Blob.view record with an owner block holding a second reference on
+// the blob, whose finalizer closes it.  The lookup hits the repository's
+// object cache.  Blob.View only reads the buffer, which libgit2 shares
+// with every other handle on the blob, and copies out through blit.
+
+struct blob_view_owner { git_object *blob; size_t bytes; };
+
+void custom_blob_view_owner_finalize (value v) {
+	struct blob_view_owner *w = Data_custom_val(v);
+	git_stat_add( GIT_STAT_blob_view, -1, -(intnat)w->bytes );
+	repo_defer( Object_repo_key(w->blob), &git_object_deferred_close, w->blob );
+}
+
+static struct custom_operations blob_view_owner_custom_ops = {
+    identifier:  "Git blob view",
+    finalize:    &custom_blob_view_owner_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+CAMLprim value
+ocaml_git_blob_content_view(value blob) {
+	CAMLparam1(blob);
+	CAMLlocal3(r,data,owner);
+	struct repo_lock *lk;
+	git_object *o = Git_ptr_val(git_object,blob), *ref;
+	struct blob_view_owner *w;
+	int err;
+	enter_repo_section(lk, Object_repo_key(o));
+	err = git_object_lookup( &ref, git_object_owner(o), git_object_id(o), GIT_OBJ_BLOB );
+	leave_repo_section(lk);
+	pass_git_exceptions(err,"Git.Blob.content_view",INVALID_EXN);
+	owner = caml_alloc_custom( &blob_view_owner_custom_ops,
+		sizeof(struct blob_view_owner), git_blob_rawsize((git_blob *)ref),
+		CAMLGC_max_git );
+	w = Data_custom_val(owner);
+	w->blob = ref;  w->bytes = git_blob_rawsize((git_blob *)ref);
+	git_stat_add( GIT_STAT_blob_view, 1, w->bytes );
+	data = caml_ba_alloc_dims( CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_EXTERNAL,
+		1, (void *)git_blob_rawcontent((git_blob *)ref), (intnat)w->bytes );
+	r = caml_alloc(2,0);
+	Store_field(r, 0, data);
+	Store_field(r, 1, owner);
+	CAMLreturn(r);
+}  // the fields follow the Blob.view record in git.ml
+
+CAMLprim value
+ocaml_git_blob_view_blit( value view, value off, value buf, value boff, value len ) {
+	value data = Field(view,0);
+	intnat o = Long_val(off), bo = Long_val(boff), l = Long_val(len);
+	if ( o < 0 || bo < 0 || l < 0 || o + l > Caml_ba_array_val(data)->dim[0]
+	  || bo + l > caml_string_length(buf) )
+		caml_invalid_argument("Git.Blob.View.blit");
+	memcpy( Bytes_val(buf) + bo, (char *)Caml_ba_data_val(data) + o, l );
+	return Val_unit;
+}
+
 CAMLprim value 
 ocaml_git_blob_create_fromfile(value repo,value fn) {
         CAMLparam2(repo,fn);
 	CAMLlocal1(id);
-	id = caml_alloc_string( GIT_OID_RAWSZ );
-	int err = git_blob_create_fromfile( (git_oid *)String_val(id),
-			*(git_repository **)Data_custom_val(repo),
-			String_val(fn) );
+	struct repo_lock *lk;
+	git_repository *r = *(git_repository **)Data_custom_val(repo);
+	char *path = String_copy(fn);
+	git_oid oid;
+	int err;
+	enter_repo_section(lk, Repo_key(r));
+	err = git_blob_create_fromfile( &oid, r, path );
+	leave_repo_section(lk);
+	free(path);
 	pass_git_exceptions(err, "Git.Blob.create_fromfile", INVALID_EXN );
+	id = caml_copy_git_oid(&oid);
         CAMLreturn(id);
 }
 
@@ -525,10 +4077,166 @@ ocaml_git_blob_create_frombuffer(value repo,value b) {
 	CAMLreturn(id);
 }
 
+// Blob writers stream content of a known size into an odb write stream,
+// which hashes and deflates incrementally, so memory stays bounded by the
+// chunk size rather than the blob size.  Chunks from Bytes are copied out
+// of the heap before we release the runtime lock, while bigarray chunks
+// and file descriptor reads need no such copy.
+
+#define BLOB_WRITER_CHUNK	65536
+#define BLOB_WRITER_FOOTPRINT	(256 * 1024)	// mostly zlib's deflate state
+
+struct blob_writer { git_odb *db; git_odb_stream *stream; size_t size, written; };
+
+void custom_blob_writer_finalize (value v) {
+	struct blob_writer *w = *(struct blob_writer **)Data_custom_val(v);
+	git_stat_add( GIT_STAT_blob_writer, -1, -BLOB_WRITER_FOOTPRINT );
+	if (w->stream)  repo_defer( w->db, &odb_stream_deferred_free, w->stream );
+	free(w);
+}
+
+static struct custom_operations blob_writer_custom_ops = {
+    identifier:  "Git blob writer",
+    finalize:    &custom_blob_writer_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+#define Blob_writer_val(v)  (*(struct blob_writer **)Data_custom_val(v))
+
+CAMLprim value
+ocaml_git_blob_writer_create( value repo, value size ) {
+	CAMLparam2(repo,size);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	git_odb *db = git_repository_database( *(git_repository **)Data_custom_val(repo) );
+	struct blob_writer *w;
+	git_odb_stream *stream;
+	size_t sz = Long_val(size);
+	int err;
+	if (Long_val(size) < 0)
+		caml_invalid_argument("Git.Blob.Writer.create : negative size");
+	enter_repo_section(lk, db);
+	err = git_odb_open_wstream( &stream, db, sz, GIT_OBJ_BLOB );
+	leave_repo_section(lk);
+	pass_git_exceptions(err,"Git.Blob.Writer.create",INVALID_EXN);
+	if ((w = malloc(sizeof(struct blob_writer))) == NULL) {
+		repo_defer( db, &odb_stream_deferred_free, stream );
+		caml_raise_out_of_memory();
+	}
+	w->db = db;  w->stream = stream;  w->size = sz;  w->written = 0;
+	r = caml_alloc_custom( &blob_writer_custom_ops,
+		sizeof(struct blob_writer *), BLOB_WRITER_FOOTPRINT, CAMLGC_max_git );
+	Blob_writer_val(r) = w;
+	git_stat_add( GIT_STAT_blob_writer, 1, BLOB_WRITER_FOOTPRINT );
+	CAMLreturn(r);
+}
+
+static void
+blob_writer_check( struct blob_writer *w, intnat len ) {
+	if (w->stream == NULL)
+		caml_invalid_argument("Git.Blob.Writer : writer already finished");
+	if (len < 0 || w->written + len > w->size)
+		caml_invalid_argument("Git.Blob.Writer : more data than declared");
+}
+
+static int
+blob_writer_put( struct blob_writer *w, const char *buf, size_t len ) {
+	int err = w->stream->write( w->stream, buf, len );
+	if (err == GIT_SUCCESS)  w->written += len;
+	return err;
+}  // call without the runtime lock
+
+CAMLprim value
+ocaml_git_blob_writer_write( value writer, value buf, value off, value len ) {
+	CAMLparam4(writer,buf,off,len);
+	struct blob_writer *w = Blob_writer_val(writer);
+	intnat o = Long_val(off), l = Long_val(len);
+	char *chunk;
+	int err;
+	blob_writer_check(w,l);
+	if (o < 0 || o + l > caml_string_length(buf))
+		caml_invalid_argument("Git.Blob.Writer.write");
+	if ((chunk = malloc(l ? l : 1)) == NULL)  caml_raise_out_of_memory();
+	memcpy( chunk, String_val(buf) + o, l );
+	caml_enter_blocking_section();
+	err = blob_writer_put( w, chunk, l );
+	caml_leave_blocking_section();
+	free(chunk);
+	pass_git_exceptions(err,"Git.Blob.Writer.write",INVALID_EXN);
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+ocaml_git_blob_writer_write_bigstring( value writer, value buf, value off, value len ) {
+	CAMLparam4(writer,buf,off,len);
+	struct blob_writer *w = Blob_writer_val(writer);
+	intnat o = Long_val(off), l = Long_val(len);
+	char *data = (char *)Caml_ba_data_val(buf) + o;
+	int err;
+	blob_writer_check(w,l);
+	if (o < 0 || o + l > Caml_ba_array_val(buf)->dim[0])
+		caml_invalid_argument("Git.Blob.Writer.write_bigstring");
+	caml_enter_blocking_section();
+	err = blob_writer_put( w, data, l );
+	caml_leave_blocking_section();
+	pass_git_exceptions(err,"Git.Blob.Writer.write_bigstring",INVALID_EXN);
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+ocaml_git_blob_writer_write_fd( value writer, value fd ) {
+	CAMLparam2(writer,fd);
+	struct blob_writer *w = Blob_writer_val(writer);
+	size_t start = w->written, want;
+	char *chunk;
+	int f = Int_val(fd), err = GIT_SUCCESS, errnum = 0;
+	ssize_t got = 0;
+	blob_writer_check(w,0);
+	if ((chunk = malloc(BLOB_WRITER_CHUNK)) == NULL)  caml_raise_out_of_memory();
+	caml_enter_blocking_section();
+	while (err == GIT_SUCCESS && w->written < w->size) {
+		want = w->size - w->written;
+		if (want > BLOB_WRITER_CHUNK)  want = BLOB_WRITER_CHUNK;
+		got = read( f, chunk, want );
+		if (got < 0 && errno == EINTR)  continue;
+		if (got <= 0)  break;
+		err = blob_writer_put( w, chunk, got );
+	}
+	if (got < 0)  errnum = errno;
+	caml_leave_blocking_section();
+	free(chunk);
+	if (errnum)
+		unix_error( errnum, "Git.Blob.Writer.write_fd", Nothing );
+	pass_git_exceptions(err,"Git.Blob.Writer.write_fd",INVALID_EXN);
+	CAMLreturn(Val_int(w->written - start));
+}  // reads until end of file or the declared size, returns the bytes read
+
+CAMLprim value
+ocaml_git_blob_writer_finish( value writer ) {
+	CAMLparam1(writer);
+	struct repo_lock *lk;
+	struct blob_writer *w = Blob_writer_val(writer);
+	git_oid oid;
+	int err;
+	blob_writer_check(w,0);
+	if (w->written != w->size)
+		caml_invalid_argument("Git.Blob.Writer.finish : less data than declared");
+	enter_repo_section(lk, w->db);
+	err = w->stream->finalize_write( &oid, w->stream );
+	w->stream->free(w->stream);
+	w->stream = NULL;
+	leave_repo_section(lk);
+	pass_git_exceptions(err,"Git.Blob.Writer.finish",INVALID_EXN);
+	CAMLreturn( caml_copy_git_oid(&oid) );
+}
+
 
 /* *** Tag operations *** */
 
-#define git_tag_custom_ops git_object_custom_ops
+#define caml_wrap_git_tag(P)  caml_wrap_git_object( (git_object *)(P) )
 
 CAMLprim value ocaml_git_tag_lookup( value repo, value id )
 	{ return _ocaml_git_object_lookup(repo,id,GIT_OBJ_TAG); }
@@ -543,8 +4251,13 @@ wrap_retval_tag(git_tag_tagger,git_signture_to_ocaml_signture);
 CAMLprim value
 ocaml_git_tag_target( value tag ) {
 	CAMLparam1(tag);
+	struct repo_lock *lk;
+	git_tag *t = Git_ptr_val(git_tag,tag);
 	git_object *obj;
-	int err = git_tag_target( &obj, *(git_tag **)Data_custom_val(tag) );
+	int err;
+	enter_repo_section(lk, Object_repo_key(t));
+	err = git_tag_target( &obj, t );
+	leave_repo_section(lk);
 	pass_git_exceptions(err,"Git.Tag.target",INVALID_EXN);
 	CAMLreturn( ocaml_git_database_object(obj) );
 }  // calls git_object_lookup
@@ -588,14 +4301,14 @@ ocaml_git_tag_create_o(value repo, value name, value target, value tagger, value
 
 define_git_ptr_type_manual(reference);
 
-wrap_setptr_ptr1_val1(git_reference_lookup,git_reference,
+wrap_setptr_blocking_ptr1_val1(git_reference_lookup,git_reference,
 	"Git.Reference.lookup",INVALID_EXN,
-	git_repository, (char *)String_val);
+	git_repository, char *,String_copy,free);
 
 #define wrap_retval_reference(NN,C)  wrap_retval_ptr1(NN,C,git_reference)
 wrap_retval_reference(git_reference_name,caml_copy_string);
 
-wrap_setptr_ptr1(git_reference_resolve,git_reference,
+wrap_setptr_blocking_ptr1(git_reference_resolve,git_reference,
 	"Git.Reference.resolve",INVALID_EXN,
 	git_reference);
 
@@ -608,8 +4321,13 @@ wrap_retval_reference(git_reference_target,caml_copy_string);
 CAMLprim value ocaml_git_reference_listall( value repo, value flags ) {
 	CAMLparam2(repo,flags);
 	CAMLlocal1(r);
-	git_strarray a; int i;
-	int err = git_reference_listall( &a, *(git_repository **)Data_custom_val(repo), Int_val(flags) );
+	struct repo_lock *lk;
+	git_repository *rp = *(git_repository **)Data_custom_val(repo);
+	unsigned int fl = Int_val(flags);
+	git_strarray a; int i, err;
+	enter_repo_section(lk, Repo_key(rp));
+	err = git_reference_listall( &a, rp, fl );
+	leave_repo_section(lk);
 	pass_git_exceptions(err,"Git.Reference.listall",INVALID_EXN);
 	r = caml_alloc(a.count, 0);
 	for (i=0; i < a.count; i++) {
@@ -619,9 +4337,1158 @@ CAMLprim value ocaml_git_reference_listall( value repo, value flags ) {
 	CAMLreturn(r);
 }
 
+// Reference.snapshot lists the references under a name prefix, sorted,
+// looking each up and peeling annotated tags in C.  libgit2 parses the
+// packed-refs file once into its reference cache, so the lookups do not
+// go back to disk for packed references.  Object types come from
+// git_odb_read_header, so only tags get parsed.  Unreadable targets peel
+// to the zero oid instead of failing the whole snapshot.
+
+#define PEEL_MAX_DEPTH	16
+
+static void
+reference_peel( git_repository *repo, const git_oid *id, git_oid *out ) {
+	git_odb *odb = git_repository_database(repo);
+	git_object *tag;
+	git_otype type;
+	git_oid cur;
+	size_t len;
+	int depth;
+	git_oid_cpy( &cur, id );
+	memset( out, 0, sizeof(git_oid) );
+	for (depth=0; depth < PEEL_MAX_DEPTH; depth++) {
+		if (git_odb_read_header( &len, &type, odb, &cur ) != GIT_SUCCESS)
+			return;
+		if (type != GIT_OBJ_TAG)
+			break;
+		if (git_object_lookup( &tag, repo, &cur, GIT_OBJ_TAG ) != GIT_SUCCESS)
+			return;
+		git_oid_cpy( &cur, git_tag_target_oid((git_tag *)tag) );
+		git_object_close(tag);
+	}
+	if (depth < PEEL_MAX_DEPTH)
+		git_oid_cpy( out, &cur );
+}
+
+static int
+reference_name_cmp( const void *a, const void *b ) {
+	return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+struct ref_snapshot { struct strtab_buf names, symbolic; struct packbuf targets, peeled; };
+
+static void
+ref_snapshot_free( struct ref_snapshot *s ) {
+	strtab_free(&s->names);
+	strtab_free(&s->symbolic);
+	packbuf_free(&s->targets);
+	packbuf_free(&s->peeled);
+}
+
+static int
+ref_snapshot_fill( struct ref_snapshot *s, git_repository *repo,
+		const char *prefix ) {
+	static const git_oid zero;
+	size_t i, plen = strlen(prefix);
+	git_reference *ref, *res;
+	const char *name, *target;
+	const git_oid *oid;
+	git_oid peeled;
+	git_strarray a;
+	int err = git_reference_listall( &a, repo, GIT_REF_LISTALL );
+	if (err != GIT_SUCCESS)  return err;
+	qsort( a.strings, a.count, sizeof(char *), &reference_name_cmp );
+	for (i=0; i < a.count && err == GIT_SUCCESS; i++) {
+		name = a.strings[i];
+		if ( strncmp(name, prefix, plen) != 0
+		  || git_reference_lookup( &ref, repo, name ) != GIT_SUCCESS )
+			continue;  // deleted since listing
+		oid = &zero;  target = "";
+		if (git_reference_type(ref) & GIT_REF_SYMBOLIC) {
+			target = git_reference_target(ref);
+			if (git_reference_resolve( &res, ref ) == GIT_SUCCESS)
+				reference_peel( repo, git_reference_oid(res), &peeled );
+			else
+				memset( &peeled, 0, sizeof(git_oid) );
+		} else {
+			oid = git_reference_oid(ref);
+			reference_peel( repo, oid, &peeled );
+		}
+		if ( strtab_add(&s->names, name, strlen(name)) != GIT_SUCCESS
+		  || strtab_add(&s->symbolic, target, strlen(target)) != GIT_SUCCESS
+		  || packbuf_put(&s->targets, oid, GIT_OID_RAWSZ) != GIT_SUCCESS
+		  || packbuf_put(&s->peeled, &peeled, GIT_OID_RAWSZ) != GIT_SUCCESS )
+			err = GIT_ENOMEM;
+	}
+	git_strarray_free(&a);
+	return err;
+}
+
+CAMLprim value
+ocaml_git_reference_snapshot( value repo, value prefix ) {
+	CAMLparam2(repo,prefix);
+	CAMLlocal1(r);
+	struct repo_lock *lk;
+	git_repository *rp = *(git_repository **)Data_custom_val(repo);
+	char *p = String_copy(prefix);
+	struct ref_snapshot s;
+	int err;
+	memset( &s, 0, sizeof(s) );
+	enter_repo_section(lk, Repo_key(rp));
+	err = ref_snapshot_fill( &s, rp, p );
+	leave_repo_section(lk);
+	free(p);
+	if (err != GIT_SUCCESS)  ref_snapshot_free(&s);
+	pass_git_exceptions(err,"Git.Reference.snapshot",INVALID_EXN);
+	r = caml_alloc(5,0);
+	Store_field(r, 0, Val_long(s.targets.len / GIT_OID_RAWSZ));
+	Store_field(r, 1, caml_copy_strtab(&s.names));
+	Store_field(r, 2, caml_copy_packbuf(&s.targets));
+	Store_field(r, 3, caml_copy_strtab(&s.symbolic));
+	Store_field(r, 4, caml_copy_packbuf(&s.peeled));
+	ref_snapshot_free(&s);
+	CAMLreturn(r);
+}  // the fields follow the Reference.snapshot record in git.ml
+
 
 /* *** Revwalk operations *** */
 
-// define_git_ptr_type_gced(revwalk); // never a repository object per se
+define_git_ptr_type_gced(revwalk,free); // never a repository object per se
+
+wrap_setptr_ptr1(git_revwalk_new,git_revwalk,
+	"Git.Revwalk.create",INVALID_EXN,
+	git_repository);
+
+wrap_retunit_ptr1(git_revwalk_reset,git_revwalk);
+wrap_retunit_ptr1_val1(git_revwalk_sorting,
+	git_revwalk,Int_val);
+wrap_retunit_exn_blocking_ptr1_val1(git_revwalk_push,
+	"Git.Revwalk.push",INVALID_EXN,
+	git_revwalk,git_oid *,Oid_copy,free);
+wrap_retunit_exn_blocking_ptr1_val1(git_revwalk_hide,
+	"Git.Revwalk.hide",INVALID_EXN,
+	git_revwalk,git_oid *,Oid_copy,free);
+
+// We hand back oids in bulk, packed back to back as raw 20 byte strings,
+// so that walking a long history costs one crossing per batch rather than
+// one crossing and one allocation per commit.
+
+static int
+revwalk_fill( git_revwalk *w, git_oid *out, int max, int *err ) {
+	struct repo_lock *lk;
+	int i = 0;
+	*err = GIT_SUCCESS;
+	enter_repo_section(lk, git_revwalk_repo_key(w));
+	while ( i < max && (*err = git_revwalk_next(&out[i], w)) == GIT_SUCCESS )
+		i++;
+	leave_repo_section(lk);
+	if (*err == GIT_EREVWALKOVER)  *err = GIT_SUCCESS;
+	return i;
+}  // returns the number of oids written, zero once the walk is over
+
+CAMLprim value
+ocaml_git_revwalk_next_batch( value walk, value buf, value max ) {
+	CAMLparam3(walk,buf,max);
+	int n = Int_val(max), err;
+	if ( n < 0 || n > Caml_ba_array_val(buf)->dim[0] / GIT_OID_RAWSZ )
+		caml_invalid_argument("Git.Revwalk.next_batch : buffer too small");
+	n = revwalk_fill( *(git_revwalk **)Data_custom_val(walk),
+			(git_oid *)Caml_ba_data_val(buf), n, &err );
+	pass_git_exceptions(err,"Git.Revwalk.next_batch",INVALID_EXN);
+	CAMLreturn(Val_int(n));
+}
+
+CAMLprim value
+ocaml_git_revwalk_next_packed( value walk, value max ) {
+	CAMLparam2(walk,max);
+	CAMLlocal1(r);
+	int n = Int_val(max), err;
+	git_oid *tmp;
+	if (n < 0)
+		caml_invalid_argument("Git.Revwalk.next_packed : negative count");
+	tmp = malloc( sizeof(git_oid) * (n ? n : 1) );
+	if (tmp == NULL)  caml_raise_out_of_memory();
+	n = revwalk_fill( *(git_revwalk **)Data_custom_val(walk), tmp, n, &err );
+	if (err != GIT_SUCCESS)  free(tmp);
+	pass_git_exceptions(err,"Git.Revwalk.next_packed",INVALID_EXN);
+	r = caml_alloc_string( n * GIT_OID_RAWSZ );
+	memcpy( String_val(r), tmp, n * GIT_OID_RAWSZ );
+	free(tmp);
+	CAMLreturn(r);
+}  // string length is a multiple of 20, empty once the walk is over
+
+
+/* *** Commit graphs *** */
+
+// A commit graph file indexes every commit reachable from some heads, so
+// that ancestry queries never touch the object database.  The file holds,
+// in native byte order, a 16 byte header with the magic "OCG1", the commit
+// count, the parent count and a reserved word, and then
+//	times		count int64		commit times
+//	generations	count uint32		1 + the longest parent chain
+//	parent_start	count+1 uint32		parents of i start here
+//	fanout		256 uint32		commits whose first byte <= b
+//	oids		count * 20 bytes	sorted
+//	parents		nparents uint32		indexes into oids
+// Graphs are mapped read only and replaced by renaming a new file over
+// the old, so a mapped graph stays valid while its successor gets built.
+
+#define GRAPH_MAGIC	"OCG1"
+#define GRAPH_HEADER	16
+#define GRAPH_NONE	0xffffffffu
+
+struct commit_graph {
+	void *map;  size_t size;
+	uint32_t count, nparents;
+	const int64_t *times;
+	const uint32_t *generations, *parent_start, *fanout, *parents;
+	const unsigned char *oids;
+};
+
+static size_t
+graph_size( size_t count, size_t nparents ) {
+	return GRAPH_HEADER + 8 * count + 4 * count + 4 * (count + 1)
+		+ 4 * 256 + GIT_OID_RAWSZ * count + 4 * nparents;
+}
+
+static void
+graph_layout( struct commit_graph *g ) {
+	const unsigned char *p = (const unsigned char *)g->map + GRAPH_HEADER;
+	g->times = (const int64_t *)p;		p += 8 * (size_t)g->count;
+	g->generations = (const uint32_t *)p;	p += 4 * (size_t)g->count;
+	g->parent_start = (const uint32_t *)p;	p += 4 * ((size_t)g->count + 1);
+	g->fanout = (const uint32_t *)p;	p += 4 * 256;
+	g->oids = p;				p += GIT_OID_RAWSZ * (size_t)g->count;
+	g->parents = (const uint32_t *)p;
+}
+
+static uint32_t
+graph_find( const struct commit_graph *g, const unsigned char *k ) {
+	uint32_t lo = k[0] ? g->fanout[k[0]-1] : 0, hi = g->fanout[k[0]], mid;
+	int c;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = memcmp( g->oids + (size_t)mid * GIT_OID_RAWSZ, k, GIT_OID_RAWSZ );
+		if (c == 0)  return mid;
+		if (c < 0)  lo = mid + 1;  else  hi = mid;
+	}
+	return GRAPH_NONE;
+}
+
+static int
+graph_check( const struct commit_graph *g ) {
+	uint32_t i, j;
+	if ( g->fanout[255] != g->count || g->parent_start[0] != 0
+	  || g->parent_start[g->count] != g->nparents )
+		return GIT_EOBJCORRUPTED;
+	for (i=1; i < 256; i++)	// graph_find searches fanout[b-1] to fanout[b]
+		if (g->fanout[i-1] > g->fanout[i])
+			return GIT_EOBJCORRUPTED;
+	for (i=0; i < g->count; i++)
+		if (g->parent_start[i] > g->parent_start[i+1])
+			return GIT_EOBJCORRUPTED;
+	for (j=0; j < g->nparents; j++)
+		if (g->parents[j] >= g->count)
+			return GIT_EOBJCORRUPTED;
+	return GIT_SUCCESS;
+}  // queries trust the indexes once checked
+
+void custom_commit_graph_finalize (value v) {
+	struct commit_graph *g = (struct commit_graph *)Data_custom_val(v);
+	if (g->map)  munmap( g->map, g->size );
+}
+
+static struct custom_operations commit_graph_custom_ops = {
+    identifier:  "Git commit graph",
+    finalize:    &custom_commit_graph_finalize,
+    compare:     custom_compare_default,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+// Queries copy the struct out of the custom block, whose address may
+// change while the runtime lock is released, unlike the mapping itself.
+#define Commit_graph_val(v)  (*(struct commit_graph *)Data_custom_val(v))
+
+static int
+graph_map( struct commit_graph *g, const char *path ) {
+	struct stat st;
+	uint32_t h[4];
+	int fd = open( path, O_RDONLY );
+	memset( g, 0, sizeof(struct commit_graph) );
+	if (fd < 0)  return GIT_EOSERR;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return GIT_EOSERR;
+	}
+	if ((size_t)st.st_size < graph_size(0,0)) {
+		close(fd);
+		return GIT_EOBJCORRUPTED;
+	}
+	g->size = st.st_size;
+	g->map = mmap( NULL, g->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close(fd);
+	if (g->map == MAP_FAILED) {
+		g->map = NULL;
+		return GIT_EOSERR;
+	}
+	memcpy( h, g->map, GRAPH_HEADER );
+	g->count = h[1];  g->nparents = h[2];
+	if ( memcmp(g->map, GRAPH_MAGIC, 4) != 0
+	  || graph_size(g->count, g->nparents) != g->size )
+		return GIT_EOBJCORRUPTED;
+	graph_layout(g);
+	return graph_check(g);
+}
+
+CAMLprim value
+ocaml_git_commit_graph_load( value path ) {
+	CAMLparam1(path);
+	CAMLlocal1(r);
+	struct commit_graph g;
+	char *p = String_copy(path);
+	int err;
+	caml_enter_blocking_section();
+	err = graph_map( &g, p );
+	caml_leave_blocking_section();
+	free(p);
+	if (err != GIT_SUCCESS && g.map)  munmap( g.map, g.size );
+	pass_git_exceptions(err,"Git.CommitGraph.load",FAILURE_EXN);
+	r = caml_alloc_custom( &commit_graph_custom_ops,
+		sizeof(struct commit_graph), 0, 1 );
+	Commit_graph_val(r) = g;
+	CAMLreturn(r);
+}
+
+// Building walks every commit reachable from the heads, taking times and
+// parents from the base graph where it already has them, so an update
+// only parses the new commits.  All of the base graph's commits carry
+// over into the new file.
+
+struct graph_node { git_oid oid; int64_t time; uint32_t gen, pstart, pcount; };
+
+struct graph_build {
+	git_repository *repo;
+	const struct commit_graph *base;
+	struct oidtab seen;		// oid -> node index
+	struct packbuf nodes;		// struct graph_node
+	struct packbuf parent_oids;	// git_oid, pcount per node from pstart
+	struct packbuf pending;		// git_oid still to visit
+};
+
+#define graph_nodes(b)  ((struct graph_node *)(b)->nodes.data)
+
+static int
+graph_build_visit( struct graph_build *b, const git_oid *oid ) {
+	const struct commit_graph *base = b->base;
+	struct graph_node n;
+	unsigned char *slot;
+	uint32_t i, j, k;
+	struct commit_raw raw;
+	git_oid parent;
+	int err = oidtab_insert( &b->seen, (const unsigned char *)oid, &slot );
+	if (err <= 0)  return err;  // seen before, or GIT_ENOMEM
+	k = b->nodes.len / sizeof(struct graph_node);
+	memcpy( slot + GIT_OID_RAWSZ, &k, sizeof(k) );
+	memset( &n, 0, sizeof(n) );
+	git_oid_cpy( &n.oid, oid );
+	n.pstart = b->parent_oids.len / sizeof(git_oid);
+	err = GIT_SUCCESS;
+	if ( base && (i = graph_find(base, (const unsigned char *)oid)) != GRAPH_NONE ) {
+		n.time = base->times[i];
+		n.pcount = base->parent_start[i+1] - base->parent_start[i];
+		for (j = base->parent_start[i]; j < base->parent_start[i+1] && !err; j++)
+			err = packbuf_put( &b->parent_oids,
+				base->oids + (size_t)base->parents[j] * GIT_OID_RAWSZ,
+				GIT_OID_RAWSZ );
+	} else {
+		if ((err = commit_raw_read( Repo_key(b->repo), oid, &raw )) != GIT_SUCCESS)
+			return err;
+		n.time = raw.committer.when.time;
+		n.pcount = raw.parentcount;
+		for (j=0; j < raw.parentcount && !err; j++) {
+			commit_raw_parent( &raw, j, &parent );
+			err = packbuf_put( &b->parent_oids, &parent, sizeof(parent) );
+		}
+		git_odb_object_close(raw.obj);
+	}
+	if (err != GIT_SUCCESS)  return err;
+	if ( packbuf_put( &b->pending,
+		b->parent_oids.data + n.pstart * sizeof(git_oid),
+		n.pcount * sizeof(git_oid) ) != GIT_SUCCESS )
+		return GIT_ENOMEM;
+	return packbuf_put( &b->nodes, &n, sizeof(n) );
+}
+
+static uint32_t
+graph_build_index( struct graph_build *b, const git_oid *oid ) {
+	uint32_t k;
+	memcpy( &k, oidtab_find(&b->seen, (const unsigned char *)oid) + GIT_OID_RAWSZ,
+		sizeof(k) );
+	return k;
+}  // every parent has been visited by the time we ask
+
+static int
+graph_build_generations( struct graph_build *b ) {
+	struct graph_node *nodes = graph_nodes(b);
+	const git_oid *parents = (const git_oid *)b->parent_oids.data;
+	size_t i, n = b->nodes.len / sizeof(struct graph_node);
+	struct packbuf work = { NULL, 0, 0 };
+	uint32_t t, j, p, gen, *top;
+	int done;
+	for (i=0; i < n; i++) {
+		if (nodes[i].gen)  continue;
+		t = i;
+		if (packbuf_put(&work, &t, sizeof(t)) != GIT_SUCCESS)  goto nomem;
+		while (work.len) {
+			top = (uint32_t *)(work.data + work.len) - 1;
+			t = *top;
+			if (nodes[t].gen) {
+				work.len -= sizeof(t);
+				continue;
+			}
+			gen = 0;  done = 1;
+			for (j=0; j < nodes[t].pcount; j++) {
+				p = graph_build_index( b, &parents[nodes[t].pstart + j] );
+				if (nodes[p].gen == 0) {
+					done = 0;
+					if (packbuf_put(&work, &p, sizeof(p)) != GIT_SUCCESS)
+						goto nomem;
+				} else if (nodes[p].gen > gen)
+					gen = nodes[p].gen;
+			}
+			if (done) {
+				nodes[t].gen = gen + 1;
+				work.len -= sizeof(t);
+			}
+		}
+	}
+	packbuf_free(&work);
+	return GIT_SUCCESS;
+nomem:
+	packbuf_free(&work);
+	return GIT_ENOMEM;
+}  // a depth first walk, since a long history would overflow the C stack
+
+static int
+graph_write_file( struct graph_build *b, const char *path ) {
+	struct graph_node *nodes = graph_nodes(b);
+	const git_oid *parents = (const git_oid *)b->parent_oids.data;
+	size_t i, j, n = b->nodes.len / sizeof(struct graph_node);
+	size_t np = b->parent_oids.len / sizeof(git_oid), plen = strlen(path);
+	struct oid_slot *order = malloc( sizeof(struct oid_slot) * (n ? n : 1) );
+	uint32_t *rank = malloc( sizeof(uint32_t) * (n ? n : 1) );
+	uint32_t h[4] = { 0, n, np, 0 }, fanout[256], u;
+	char *tmp = malloc( plen + 6 );
+	int64_t t;
+	FILE *f = NULL;
+	int err = GIT_ENOMEM;
+	if (order == NULL || rank == NULL || tmp == NULL)  goto out;
+	for (i=0; i < n; i++) {
+		git_oid_cpy( &order[i].oid, &nodes[i].oid );
+		order[i].pos = i;
+	}
+	qsort( order, n, sizeof(struct oid_slot), &oid_slot_cmp );
+	for (i=0; i < n; i++)  rank[order[i].pos] = i;
+	memset( fanout, 0, sizeof(fanout) );
+	for (i=0; i < n; i++)  fanout[ order[i].oid.id[0] ]++;
+	for (i=1; i < 256; i++)  fanout[i] += fanout[i-1];
+	memcpy( h, GRAPH_MAGIC, 4 );
+	memcpy( tmp, path, plen );
+	memcpy( tmp + plen, ".lock", 6 );
+	err = GIT_EOSERR;
+	if ((f = fopen(tmp, "wb")) == NULL)  goto out;
+	fwrite( h, sizeof(h), 1, f );
+	for (i=0; i < n; i++) {
+		t = nodes[order[i].pos].time;
+		fwrite( &t, sizeof(t), 1, f );
+	}
+	for (i=0; i < n; i++)
+		fwrite( &nodes[order[i].pos].gen, sizeof(uint32_t), 1, f );
+	for (i=0, u=0; i <= n; i++) {
+		fwrite( &u, sizeof(u), 1, f );
+		if (i < n)  u += nodes[order[i].pos].pcount;
+	}
+	fwrite( fanout, sizeof(fanout), 1, f );
+	for (i=0; i < n; i++)
+		fwrite( &order[i].oid, GIT_OID_RAWSZ, 1, f );
+	for (i=0; i < n; i++)
+		for (j=0; j < nodes[order[i].pos].pcount; j++) {
+			u = rank[ graph_build_index( b,
+				&parents[nodes[order[i].pos].pstart + j] ) ];
+			fwrite( &u, sizeof(u), 1, f );
+		}
+	if (ferror(f) | fclose(f)) {
+		f = NULL;
+		unlink(tmp);
+		goto out;
+	}
+	f = NULL;
+	if (rename(tmp, path) != 0) {
+		unlink(tmp);
+		goto out;
+	}
+	err = GIT_SUCCESS;
+out:
+	if (f)  fclose(f);
+	free(order);  free(rank);  free(tmp);
+	return err;
+}
+
+CAMLprim value
+ocaml_git_commit_graph_write( value repo, value path, value heads, value base ) {
+	CAMLparam4(repo,path,heads,base);
+	struct repo_lock *lk;
+	struct graph_build b;
+	struct commit_graph g;
+	size_t i, n = Wosize_val(heads);
+	git_oid head;
+	char *p;
+	int err = GIT_SUCCESS;
+	memset( &b, 0, sizeof(b) );
+	b.repo = *(git_repository **)Data_custom_val(repo);
+	if (Is_block(base)) {
+		g = Commit_graph_val(Field(base,0));
+		b.base = &g;
+	}
+	if (oidtab_init( &b.seen, OIDTAB_TABLE_SLOT,
+			n + (b.base ? b.base->count : 0) ) != GIT_SUCCESS)
+		caml_raise_out_of_memory();
+	for (i=0; i < n && err == GIT_SUCCESS; i++)
+		err = packbuf_put( &b.pending, String_val(Field(heads,i)), GIT_OID_RAWSZ );
+	for (i=0; b.base && i < b.base->count && err == GIT_SUCCESS; i++)
+		err = packbuf_put( &b.pending, b.base->oids + i * GIT_OID_RAWSZ, GIT_OID_RAWSZ );
+	p = String_copy(path);
+	enter_repo_section(lk, Repo_key(b.repo));
+	while (b.pending.len && err == GIT_SUCCESS) {
+		b.pending.len -= sizeof(git_oid);
+		memcpy( &head, b.pending.data + b.pending.len, sizeof(git_oid) );
+		err = graph_build_visit( &b, &head );
+	}
+	if (err == GIT_SUCCESS)  err = graph_build_generations(&b);
+	if (err == GIT_SUCCESS)  err = graph_write_file( &b, p );
+	leave_repo_section(lk);
+	free(p);
+	oidtab_free(&b.seen);
+	packbuf_free(&b.nodes);
+	packbuf_free(&b.parent_oids);
+	packbuf_free(&b.pending);
+	pass_git_exceptions(err,"Git.CommitGraph.write",FAILURE_EXN);
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_git_commit_graph_count( value graph )
+	{ return Val_long( Commit_graph_val(graph).count ); }
+
+CAMLprim value
+ocaml_git_commit_graph_find( value graph, value oid ) {
+	uint32_t i = graph_find( &Commit_graph_val(graph),
+			(const unsigned char *)String_val(oid) );
+	return Val_long( i == GRAPH_NONE ? -1 : (intnat)i );
+}
+
+static uint32_t
+graph_index_val( value graph, value i, char *name ) {
+	if (Long_val(i) < 0 || Long_val(i) >= Commit_graph_val(graph).count)
+		caml_invalid_argument(name);
+	return Long_val(i);
+}
+
+CAMLprim value
+ocaml_git_commit_graph_generation( value graph, value i ) {
+	uint32_t k = graph_index_val(graph, i, "Git.CommitGraph.generation");
+	return Val_long( Commit_graph_val(graph).generations[k] );
+}
+
+CAMLprim value
+ocaml_git_commit_graph_time( value graph, value i ) {
+	uint32_t k = graph_index_val(graph, i, "Git.CommitGraph.time");
+	return Val_long( Commit_graph_val(graph).times[k] );
+}
+
+CAMLprim value
+ocaml_git_commit_graph_parents( value graph, value i ) {
+	CAMLparam2(graph,i);
+	CAMLlocal2(r,oid);
+	uint32_t k = graph_index_val(graph, i, "Git.CommitGraph.parents"), j, s;
+	s = Commit_graph_val(graph).parent_start[k];
+	r = caml_alloc( Commit_graph_val(graph).parent_start[k+1] - s, 0 );
+	for (j=0; j < Wosize_val(r); j++) {
+		oid = caml_alloc_string( GIT_OID_RAWSZ );
+		memcpy( String_val(oid), Commit_graph_val(graph).oids
+			+ (size_t)Commit_graph_val(graph).parents[s+j] * GIT_OID_RAWSZ,
+			GIT_OID_RAWSZ );
+		Store_field(r, j, oid);
+	}
+	CAMLreturn(r);
+}
+
+// Queries visit commits from the newest generation down, and cut off any
+// commit whose generation is too low to matter.  A commit's descendants
+// all have higher generations, so its flags are final once it is popped.
+
+static int
+graph_is_ancestor( const struct commit_graph *g, uint32_t a, uint32_t b ) {
+	uint32_t ga = g->generations[a], i, j, p;
+	unsigned char *seen;
+	struct packbuf stack = { NULL, 0, 0 };
+	int found = 0;
+	if (a == b)  return 1;
+	if (g->generations[b] <= ga)  return 0;
+	if ((seen = calloc( g->count / 8 + 1, 1 )) == NULL)  return GIT_ENOMEM;
+	if (packbuf_put(&stack, &b, sizeof(b)) != GIT_SUCCESS)  found = GIT_ENOMEM;
+	while (stack.len && found == 0) {
+		stack.len -= sizeof(i);
+		memcpy( &i, stack.data + stack.len, sizeof(i) );
+		for (j = g->parent_start[i]; j < g->parent_start[i+1]; j++) {
+			p = g->parents[j];
+			if (p == a) {
+				found = 1;
+				break;
+			}
+			if ( g->generations[p] > ga && !(seen[p >> 3] & (1 << (p & 7))) ) {
+				seen[p >> 3] |= 1 << (p & 7);
+				if (packbuf_put(&stack, &p, sizeof(p)) != GIT_SUCCESS) {
+					found = GIT_ENOMEM;
+					break;
+				}
+			}
+		}
+	}
+	packbuf_free(&stack);
+	free(seen);
+	return found;
+}  // returns 1 if a is reachable from b, 0 if not, or GIT_ENOMEM
+
+#define PAINT_ONE	1
+#define PAINT_TWO	2
+#define PAINT_STALE	4
+#define PAINT_QUEUED	8
+
+struct graph_paint {
+	const struct commit_graph *g;
+	unsigned char *flags;
+	uint32_t *heap;  size_t len;
+	size_t live;	// queued commits that are not stale
+};
+
+static int
+paint_before( const struct commit_graph *g, uint32_t x, uint32_t y ) {
+	if (g->generations[x] != g->generations[y])
+		return g->generations[x] > g->generations[y];
+	if (g->times[x] != g->times[y])
+		return g->times[x] > g->times[y];
+	return x < y;
+}
+
+static void
+paint_mark( struct graph_paint *p, uint32_t i, unsigned char f ) {
+	unsigned char old = p->flags[i];
+	size_t k, up;
+	if (old & PAINT_QUEUED) {
+		p->flags[i] |= f;
+		if ( !(old & PAINT_STALE) && (f & PAINT_STALE) )  p->live--;
+		return;
+	}
+	p->flags[i] = f | PAINT_QUEUED;
+	if (!(f & PAINT_STALE))  p->live++;
+	for (k = p->len++; k > 0; k = up) {
+		up = (k - 1) / 2;
+		if (!paint_before( p->g, i, p->heap[up] ))  break;
+		p->heap[k] = p->heap[up];
+	}
+	p->heap[k] = i;
+}  // each commit enters the heap at most once
+
+static uint32_t
+paint_pop( struct graph_paint *p ) {
+	uint32_t top = p->heap[0], last = p->heap[--p->len];
+	size_t k = 0, c;
+	while ((c = 2 * k + 1) < p->len) {
+		if (c + 1 < p->len && paint_before( p->g, p->heap[c+1], p->heap[c] ))
+			c++;
+		if (!paint_before( p->g, p->heap[c], last ))  break;
+		p->heap[k] = p->heap[c];
+		k = c;
+	}
+	if (p->len)  p->heap[k] = last;
+	if (!(p->flags[top] & PAINT_STALE))  p->live--;
+	return top;
+}
+
+// With merge set, collects into out the merge bases of one and two, the
+// common ancestors not reachable from another common ancestor.  Otherwise
+// counts the commits reachable from one but not from two.
+
+static int
+graph_paint( const struct commit_graph *g, uint32_t one, uint32_t two,
+		int merge, struct packbuf *out, intnat *count ) {
+	struct graph_paint p;
+	uint32_t i, j;
+	unsigned char f;
+	int err = GIT_SUCCESS;
+	p.g = g;  p.len = 0;  p.live = 0;
+	p.flags = calloc( g->count ? g->count : 1, 1 );
+	p.heap = malloc( sizeof(uint32_t) * (g->count ? g->count : 1) );
+	*count = 0;
+	if (p.flags == NULL || p.heap == NULL) {
+		free(p.flags);  free(p.heap);
+		return GIT_ENOMEM;
+	}
+	paint_mark( &p, one, PAINT_ONE );
+	paint_mark( &p, two, merge ? PAINT_TWO : PAINT_STALE );
+	while (p.live > 0 && err == GIT_SUCCESS) {
+		i = paint_pop(&p);
+		f = p.flags[i] & (PAINT_ONE | PAINT_TWO | PAINT_STALE);
+		if (!merge) {
+			if (!(f & PAINT_STALE))  (*count)++;
+		} else if ( (f & (PAINT_ONE|PAINT_TWO)) == (PAINT_ONE|PAINT_TWO)
+				&& !(f & PAINT_STALE) ) {
+			err = packbuf_put( out, g->oids + (size_t)i * GIT_OID_RAWSZ,
+					GIT_OID_RAWSZ );
+			f |= PAINT_STALE;
+		}
+		for (j = g->parent_start[i]; j < g->parent_start[i+1]; j++)
+			paint_mark( &p, g->parents[j], f );
+	}
+	free(p.flags);  free(p.heap);
+	return err;
+}
+
+CAMLprim value
+ocaml_git_commit_graph_is_ancestor( value graph, value a, value b ) {
+	CAMLparam3(graph,a,b);
+	struct commit_graph g = Commit_graph_val(graph);
+	uint32_t i = graph_index_val(graph, a, "Git.CommitGraph.is_ancestor");
+	uint32_t j = graph_index_val(graph, b, "Git.CommitGraph.is_ancestor");
+	int r;
+	caml_enter_blocking_section();
+	r = graph_is_ancestor( &g, i, j );
+	caml_leave_blocking_section();
+	if (r < 0)  caml_raise_out_of_memory();
+	CAMLreturn(Val_bool(r));
+}
+
+CAMLprim value
+ocaml_git_commit_graph_merge_base( value graph, value a, value b ) {
+	CAMLparam3(graph,a,b);
+	CAMLlocal1(r);
+	struct commit_graph g = Commit_graph_val(graph);
+	uint32_t i = graph_index_val(graph, a, "Git.CommitGraph.merge_base");
+	uint32_t j = graph_index_val(graph, b, "Git.CommitGraph.merge_base");
+	struct packbuf out = { NULL, 0, 0 };
+	intnat n;
+	int err;
+	caml_enter_blocking_section();
+	err = graph_paint( &g, i, j, 1, &out, &n );
+	caml_leave_blocking_section();
+	if (err != GIT_SUCCESS) {
+		packbuf_free(&out);
+		caml_raise_out_of_memory();
+	}
+	r = caml_copy_packbuf(&out);
+	packbuf_free(&out);
+	CAMLreturn(r);
+}  // packed oids, newest generation first
 
+CAMLprim value
+ocaml_git_commit_graph_count_between( value graph, value a, value b ) {
+	CAMLparam3(graph,a,b);
+	struct commit_graph g = Commit_graph_val(graph);
+	uint32_t i = graph_index_val(graph, a, "Git.CommitGraph.count_between");
+	uint32_t j = graph_index_val(graph, b, "Git.CommitGraph.count_between");
+	intnat n;
+	int err;
+	caml_enter_blocking_section();
+	err = graph_paint( &g, j, i, 0, NULL, &n );
+	caml_leave_blocking_section();
+	if (err != GIT_SUCCESS)  caml_raise_out_of_memory();
+	CAMLreturn(Val_long(n));
+}  // commits reachable from b but not from a, like git rev-list --count a..b
+
+
+/* *** Asynchronous requests *** */
+
+// An async pool runs jobs on C threads, each owning a repository opened
+// from the pool's path, so event loop threads never block in libgit2.
+// Submitting queues a copy of the job and returns its ticket at once.
+// Workers append results to a done list and bump an eventfd, which the
+// loop polls, then takes all finished results in one harvest.  Results
+// carry copies of the data, never libgit2 objects, which belong to the
+// worker's repository; harvest hands each copy to the GC as is.  Workers
+// never touch the OCaml runtime.
+
+#define ASYNC_READ	0	// constructors of Async.job
+#define ASYNC_WRITE	1
+#define ASYNC_RESOLVE	2
+
+#define ASYNC_OBJECT	0	// constructors of Async.result
+#define ASYNC_WRITTEN	1
+#define ASYNC_RESOLVED	2
+#define ASYNC_FAILED	3
+
+struct async_job {
+	struct async_job *next;
+	intnat ticket;
+	int kind, err;
+	git_otype type;
+	git_oid oid;
+	char *data;  size_t len;	// the name or content going in, the content coming out
+};
+
+struct async_list { struct async_job *head, *tail; };
+
+struct async_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct async_list queue, done;
+	int efd, workers, stopping;
+	git_repository **repos;
+	pthread_t *tids;		// NULL once closed
+	intnat tickets, pending;
+	int refs;			// the OCaml handle and each running worker
+};
+
+#define Async_pool_val(v)  (*(struct async_pool **)Data_custom_val(v))
+
+static void
+async_push( struct async_list *l, struct async_job *j ) {
+	j->next = NULL;
+	if (l->tail)  l->tail->next = j;  else  l->head = j;
+	l->tail = j;
+}
+
+static void
+async_free_list( struct async_job *j ) {
+	struct async_job *next;
+	for (; j; j = next) {
+		next = j->next;
+		free(j->data);
+		free(j);
+	}
+}
+
+static void
+async_run( git_repository *repo, struct async_job *j ) {
+	git_odb *odb = git_repository_database(repo);
+	git_odb_object *obj;
+	git_reference *ref, *res;
+	switch (j->kind) {
+	case ASYNC_READ:
+		if ((j->err = git_odb_read( &obj, odb, &j->oid )) != GIT_SUCCESS)
+			break;
+		j->type = git_odb_object_type(obj);
+		j->len = git_odb_object_size(obj);
+		if ((j->data = malloc( j->len ? j->len : 1 )) == NULL)
+			j->err = GIT_ENOMEM;
+		else
+			memcpy( j->data, git_odb_object_data(obj), j->len );
+		git_odb_object_close(obj);
+		break;
+	case ASYNC_WRITE:
+		j->err = git_odb_write( &j->oid, odb, j->data, j->len, j->type );
+		free(j->data);
+		j->data = NULL;
+		break;
+	case ASYNC_RESOLVE:
+		if ( (j->err = git_reference_lookup( &ref, repo, j->data )) == GIT_SUCCESS
+		  && (j->err = git_reference_resolve( &res, ref )) == GIT_SUCCESS )
+			git_oid_cpy( &j->oid, git_reference_oid(res) );
+		free(j->data);
+		j->data = NULL;
+		break;
+	}
+}
+
+struct async_worker { struct async_pool *pool; git_repository *repo; };
+
+static void async_destroy( struct async_pool *p );
+
+static void
+async_release( struct async_pool *p ) {
+	int last;
+	pthread_mutex_lock(&p->lock);
+	last = --p->refs == 0;
+	pthread_mutex_unlock(&p->lock);
+	if (last)  async_destroy(p);
+}  // the last of the handle and the workers frees the pool
+
+static void *
+async_worker( void *arg ) {
+	struct async_pool *p = ((struct async_worker *)arg)->pool;
+	git_repository *repo = ((struct async_worker *)arg)->repo;
+	struct async_job *j;
+	uint64_t one = 1;
+	free(arg);
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->queue.head == NULL && !p->stopping)
+			pthread_cond_wait( &p->ready, &p->lock );
+		if ((j = p->queue.head) == NULL) {
+			pthread_mutex_unlock(&p->lock);
+			async_release(p);
+			return NULL;
+		}
+		if ((p->queue.head = j->next) == NULL)  p->queue.tail = NULL;
+		pthread_mutex_unlock(&p->lock);
+		async_run( repo, j );
+		pthread_mutex_lock(&p->lock);
+		async_push( &p->done, j );
+		pthread_mutex_unlock(&p->lock);
+		while (write( p->efd, &one, sizeof(one) ) < 0 && errno == EINTR)
+			;
+	}
+}  // exits once stopping with an empty queue
+
+static void
+async_stop( struct async_pool *p ) {
+	pthread_mutex_lock(&p->lock);
+	p->stopping = 1;
+	async_free_list(p->queue.head);
+	p->queue.head = p->queue.tail = NULL;
+	pthread_cond_broadcast(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void
+async_free_repos( struct async_pool *p ) {
+	int i;
+	for (i=0; i < p->workers; i++)
+		git_repository_free( p->repos[i] );
+	async_free_list(p->done.head);
+	p->done.head = p->done.tail = NULL;
+	close(p->efd);
+	free(p->repos);
+	free(p->tids);
+	p->tids = NULL;
+	p->pending = 0;
+}
+
+static void
+async_shutdown( struct async_pool *p ) {
+	int i;
+	if (p->tids == NULL)  return;
+	async_stop(p);
+	for (i=0; i < p->workers; i++)
+		pthread_join( p->tids[i], NULL );
+	async_free_repos(p);
+}  // running jobs finish, queued jobs and unharvested results get dropped
+
+static void
+async_destroy( struct async_pool *p ) {
+	if (p->tids != NULL)  async_free_repos(p);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->ready);
+	free(p);
+}
+
+void custom_async_pool_finalize (value v) {
+	struct async_pool *p = Async_pool_val(v);
+	int i;
+	if (p->tids != NULL) {
+		async_stop(p);
+		for (i=0; i < p->workers; i++)
+			pthread_detach( p->tids[i] );
+	}
+	async_release(p);
+}  // never waits : the last worker to exit frees the pool
+
+static struct custom_operations async_pool_custom_ops = {
+    identifier:  "Git async pool",
+    finalize:    &custom_async_pool_finalize,
+    compare:     &custom_ptr_compare,
+    hash:        custom_hash_default,
+    serialize:   custom_serialize_default,
+    deserialize: custom_deserialize_default
+};
+
+static int
+async_start( struct async_pool *p, const char *path ) {
+	struct async_worker *w;
+	int i, k, err;
+	for (i=0; i < p->workers; i++)
+		if ((err = git_repository_open( &p->repos[i], path )) != GIT_SUCCESS) {
+			while (i-- > 0)  git_repository_free( p->repos[i] );
+			p->workers = 0;
+			return err;
+		}
+	for (i=0; i < p->workers; i++) {
+		if ((w = malloc( sizeof(struct async_worker) )) == NULL)
+			err = GIT_ENOMEM;
+		else {
+			w->pool = p;  w->repo = p->repos[i];
+			err = pthread_create( &p->tids[i], NULL, &async_worker, w ) == 0
+				? GIT_SUCCESS : GIT_EOSERR;
+			if (err != GIT_SUCCESS)  free(w);  else  p->refs++;
+		}
+		if (err != GIT_SUCCESS) {
+			for (k=i; k < p->workers; k++)  git_repository_free( p->repos[k] );
+			p->workers = i;
+			return err;
+		}
+	}
+	return GIT_SUCCESS;
+}  // on failure, workers counts the threads left for async_shutdown to join
+
+CAMLprim value
+ocaml_git_async_create( value path, value workers ) {
+	CAMLparam2(path,workers);
+	CAMLlocal1(r);
+	struct async_pool *p = calloc( 1, sizeof(struct async_pool) );
+	char *dir;
+	int err;
+	if (p == NULL)  caml_raise_out_of_memory();
+	p->workers = Int_val(workers) < 1 ? 1 : Int_val(workers);
+	p->repos = calloc( p->workers, sizeof(git_repository *) );
+	p->tids = calloc( p->workers, sizeof(pthread_t) );
+	if ( p->repos == NULL || p->tids == NULL
+	  || (p->efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC )) < 0 ) {
+		free(p->repos);  free(p->tids);  free(p);
+		caml_raise_out_of_memory();
+	}
+	pthread_mutex_init( &p->lock, NULL );
+	pthread_cond_init( &p->ready, NULL );
+	p->refs = 1;
+	dir = String_copy(path);
+	caml_enter_blocking_section();
+	err = async_start( p, dir );
+	if (err != GIT_SUCCESS)  async_shutdown(p);
+	caml_leave_blocking_section();
+	free(dir);
+	if (err != GIT_SUCCESS) {
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->ready);
+		free(p);
+	}
+	pass_git_exceptions(err,"Git.Async.create",FAILURE_EXN);
+	r = caml_alloc_custom( &async_pool_custom_ops,
+		sizeof(struct async_pool *), 0, 1 );
+	Async_pool_val(r) = p;
+	CAMLreturn(r);
+}
+
+static struct async_pool *
+async_pool_open( value pool, char *fn ) {
+	struct async_pool *p = Async_pool_val(pool);
+	if (p->tids == NULL)  caml_invalid_argument(fn);
+	return p;
+}  // raises on closed pools
+
+CAMLprim value
+ocaml_git_async_fd( value pool )
+	{ return Val_int( async_pool_open(pool,"Git.Async.fd")->efd ); }
+
+CAMLprim value
+ocaml_git_async_pending( value pool )
+	{ return Val_long( Async_pool_val(pool)->pending ); }
+
+CAMLprim value
+ocaml_git_async_submit( value pool, value job ) {
+	CAMLparam2(pool,job);
+	struct async_pool *p = async_pool_open(pool,"Git.Async.submit");
+	struct async_job *j = calloc( 1, sizeof(struct async_job) );
+	intnat ticket;
+	value s;
+	if (j == NULL)  caml_raise_out_of_memory();
+	j->kind = Tag_val(job);
+	switch (j->kind) {
+	case ASYNC_READ:
+		memcpy( &j->oid, String_val(Field(job,0)), GIT_OID_RAWSZ );
+		break;
+	case ASYNC_WRITE:
+		j->type = Int_val(Field(job,0));
+		s = Field(job,1);
+		j->len = caml_string_length(s);
+		if ((j->data = malloc( j->len ? j->len : 1 )) != NULL)
+			memcpy( j->data, String_val(s), j->len );
+		break;
+	case ASYNC_RESOLVE:
+		j->data = String_copy(Field(job,0));
+		break;
+	}
+	if (j->kind == ASYNC_WRITE && j->data == NULL) {
+		free(j);
+		caml_raise_out_of_memory();
+	}
+	pthread_mutex_lock(&p->lock);
+	ticket = j->ticket = p->tickets++;
+	async_push( &p->queue, j );
+	pthread_cond_signal(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	p->pending++;
+	CAMLreturn(Val_long(ticket));
+}  // once queued, the job belongs to the workers
+
+// Harvest builds every result before taking any job off the done list,
+// so an allocation that raises leaves all of them, their tickets and the
+// pending count as they were, and the eventfd still readable.  Content
+// bigstrings start out external and become the GC's only once the jobs
+// are detached.  Only workers appending at the tail touch the list in the
+// meantime, so the loop must harvest from one thread at a time.
 
+CAMLprim value
+ocaml_git_async_harvest( value pool ) {
+	CAMLparam1(pool);
+	CAMLlocal3(r,pair,res);
+	struct async_pool *p = async_pool_open(pool,"Git.Async.harvest");
+	struct async_job *done, *last, *j;
+	uint64_t count, one = 1;
+	size_t n = 0, i;
+	pthread_mutex_lock(&p->lock);
+	done = p->done.head;
+	last = p->done.tail;
+	for (j = done; j; j = j->next)  n++;
+	pthread_mutex_unlock(&p->lock);
+	r = caml_alloc(n, 0);
+	for (j = done, i = 0; i < n; j = j == last ? NULL : j->next, i++) {
+		pair = caml_alloc(2, 0);
+		Store_field(pair, 0, Val_long(j->ticket));
+		Store_field(r, i, pair);
+		if (j->err != GIT_SUCCESS) {
+			res = caml_alloc(1, ASYNC_FAILED);
+			Store_field(res, 0, caml_copy_string(git_strerror(j->err)));
+		} else if (j->kind == ASYNC_READ) {
+			res = caml_alloc(2, ASYNC_OBJECT);
+			Store_field(res, 0, Val_int(j->type));
+			Store_field(res, 1, caml_ba_alloc_dims(
+				CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_EXTERNAL,
+				1, j->data, (intnat)j->len ));
+		} else {
+			res = caml_alloc(1, j->kind == ASYNC_WRITE ? ASYNC_WRITTEN : ASYNC_RESOLVED);
+			Store_field(res, 0, caml_alloc_string(GIT_OID_RAWSZ));
+			memcpy( String_val(Field(res,0)), &j->oid, GIT_OID_RAWSZ );
+		}
+		Store_field(pair, 1, res);
+	}  // never past the tail we counted to, which workers may be extending
+	while (read( p->efd, &count, sizeof(count) ) < 0 && errno == EINTR)
+		;
+	pthread_mutex_lock(&p->lock);
+	if (n) {
+		if ((p->done.head = last->next) == NULL)  p->done.tail = NULL;
+		last->next = NULL;
+	}
+	if (p->done.head)  // finished while we built, their signal just cleared
+		while (write( p->efd, &one, sizeof(one) ) < 0 && errno == EINTR)
+			;
+	pthread_mutex_unlock(&p->lock);
+	for (j = done, i = 0; i < n; j = j->next, i++)
+		if (j->err == GIT_SUCCESS && j->kind == ASYNC_READ) {
+			res = Field(Field(r,i),1);
+			Caml_ba_array_val(Field(res,1))->flags |= CAML_BA_MANAGED;
+			j->data = NULL;	// now freed by the GC
+		}
+	async_free_list(done);
+	p->pending -= n;
+	CAMLreturn(r);
+}
+
+CAMLprim value
+ocaml_git_async_close( value pool ) {
+	CAMLparam1(pool);
+	struct async_pool *p = Async_pool_val(pool);
+	caml_enter_blocking_section();
+	async_shutdown(p);
+	caml_leave_blocking_section();
+	CAMLreturn(Val_unit);
+}
@@ -38,6 +38,14 @@ Unix.system ("git commit -a -m '" ^ msg ^ "'") ;;
 print_string "Testing Git.Repository.open1\n" ;;
 let r = Git.Repository.open1 ".git" ;;
 
+print_string "Testing Git.Index.snapshot\n" ;;
+let index = Git.Repository.index r ;;
+Git.Index.read index ;;
+let snap = Git.Index.snapshot index ;;
+assert ( snap.Git.Index.count = (List.length playthings) ) ;;
+assert ( (Git.Strtab.get snap.Git.Index.paths 0) = "Makefile" ) ;;
+assert ( (Git.Index.get index 0).Git.Index.file_size = snap.Git.Index.sizes.{0} ) ;;
+
 print_string "Testing Git.Reference.*\n" ;;
 let head = Git.Reference.lookup r "HEAD" ;;
 let master = Git.Reference.resolve head ;;
@@ -59,6 +67,21 @@ let (master_oid,c) = match Git.Reference.referent master with
 	  Git.Oid m -> (m, Git.Commit.lookup r m)
 	| _ -> assert false ;;
 assert (master_oid = (Git.Commit.id c)) ;;
+let missing = Git.Oid.from_hex (String.make Git.Oid.hexsz '0') ;;
+let bits = Git.Odb.exists_many (Git.Repository.odb r) [| missing; master_oid |] ;;
+assert ( not (Git.Odb.bitmap_get bits 0) && (Git.Odb.bitmap_get bits 1) ) ;;
+let seen = Git.Oid.Set.create (-1) ;;
+assert ( Git.Oid.Set.add seen master_oid && not (Git.Oid.Set.add seen master_oid) ) ;;
+assert ( (Git.Oid.Set.add_packed seen ((Git.Oid.Set.to_packed seen) ^ (Git.Oid.Set.to_packed seen))) = 0 ) ;;
+assert ( (Git.Oid.Set.cardinal seen) = 1 && not (Git.Oid.Set.mem seen missing) ) ;;
+let tbl = Git.Oid.Table.create 0 ;;
+Git.Oid.Table.replace tbl missing 7 ;;
+assert ( (Git.Oid.Table.find tbl missing) = 7 && (Git.Oid.Table.find_opt tbl master_oid) = None ) ;;
+assert ( Sys.word_size = 32 || (try Git.Oid.Table.replace tbl missing (1 lsl 40); false
+	with Invalid_argument _ -> (Git.Oid.Table.find tbl missing) = 7) ) ;;
+(match Git.Object.lookup_many r [| master_oid; missing |] with
+	  [| Git.Commit _; Git.Invalid_object |] -> ()
+	| _ -> assert false) ;;
 
 let open Git.Commit in 
 	List.iter2 ( fun f x -> assert ((f c) = x) ) 
@@ -71,16 +94,52 @@ print_string (String.concat "\t" (
 		[ Commit.author c; Commit.committer c ]
 ) ) ;;
 print_string " \n" ;;
+let info = Git.Commit.info c ;;
+assert ( info.Git.Commit.author = (Git.Commit.author c) ) ;;
+assert ( (Array.length info.Git.Commit.parent_ids) = (Git.Commit.parentcount c) ) ;;
+assert ( info.Git.Commit.parent_ids = (Git.Commit.parent_ids c) ) ;;
+assert ( info.Git.Commit.message_short = (Git.Commit.message_short c) ) ;;
+assert ( info.Git.Commit.time = (Git.Commit.time c) ) ;;
+let cols = Git.Commit.log_columns r [| master_oid; master_oid |] ;;
+assert ( cols.Git.Commit.count = 2 && cols.Git.Commit.authors.{1} = cols.Git.Commit.authors.{0} ) ;;
+assert ( (Git.Strtab.get cols.Git.Commit.names cols.Git.Commit.authors.{0}) = (Git.Commit.author c).Git.name ) ;;
 
 (*  let open Git.Commit in assert ( (author c) = (committer c) ) ;;  *)
 let t = Git.Commit.tree c ;;
 print_string "Testing Git.Tree.*\n" ;;
 assert ( (Git.Tree.entrycount t) = (List.length playthings) ) ;;
 let todo_oid = Git.TreeEntry.id (Git.Tree.entry_byname t "TODO") ;;
+let flat = Git.Tree.flatten t ;;
+assert ( flat.Git.Tree.count = (List.length playthings) ) ;;
+assert ( (Git.Oid.of_packed flat.Git.Tree.oids 1) = todo_oid ) ;;
+assert ( (Git.Tree.flatten ~prefix:"TODO" t).Git.Tree.count = 1 ) ;;
 
 print_string ("Testing Git.Blob.* :\n") ;;
 let b = Git.Blob.lookup r todo_oid ;;
 print_string (Git.Blob.content b) ;;
+let v = Git.Blob.content_view b ;;
+assert ( (Git.Blob.View.length v) = (Git.Blob.size b) ) ;;
+assert ( (Git.Blob.View.get v 0) = (Git.Blob.content b).[0] ) ;;
+assert ( (Git.Blob.View.sub v 0 (Git.Blob.size b)) = (Git.Blob.content b) ) ;;
+
+let fd = Unix.openfile "TODO" [Unix.O_RDONLY] 0 ;;
+assert ( (Git.Blob.create_fromfd r fd (Git.Blob.size b)) = todo_oid ) ;;
+Unix.close fd ;;
+let w = Git.Blob.Writer.create r (String.length msg) ;;
+Git.Blob.Writer.write w (Bytes.of_string msg) 0 5 ;;
+Git.Blob.Writer.write w (Bytes.of_string msg) 5 (String.length msg - 5) ;;
+assert ( (Git.Blob.Writer.finish w) = (Git.Blob.create_frombuffer r msg) ) ;;
+assert ( try ignore (Git.Blob.Writer.create r (-1)); false
+	with Invalid_argument _ -> true ) ;;
+
+let rd = Git.Odb.Reader.open_read (Git.Repository.odb r) todo_oid ;;
+let chunk = Bytes.create 7 and buf = Buffer.create 64 ;;
+let rec drain () = match Git.Odb.Reader.read_into rd chunk 0 7 with
+	  0 -> ()
+	| n -> Buffer.add_subbytes buf chunk 0 n; drain () ;;
+drain () ;;
+assert ( (Buffer.contents buf) = (Git.Blob.content b) ) ;;
+Git.Odb.Reader.close rd ;;
 
 let rec range i j = if i > j then [] else i :: (range (i+1) j) ;;
 List.iter (
@@ -88,4 +147,173 @@ List.iter (
 		let oid = Git.TreeEntry.id e in
 		let {Unix.st_size=s} = Unix.stat fn in
 			assert ( s = (Git.Blob.size (Git.Blob.lookup r oid)) )
-	) ( List.map (Git.Tree.entry_byindex t) (range 0 ((Git.Tree.entrycount t) - 1)) )
+	) ( List.map (Git.Tree.entry_byindex t) (range 0 ((Git.Tree.entrycount t) - 1)) ) ;;
+
+print_string "Testing Git.Revwalk.*\n" ;;
+let w = Git.Revwalk.create r ;;
+Git.Revwalk.sorting w [Git.Revwalk.Topological; Git.Revwalk.Time] ;;
+Git.Revwalk.push w master_oid ;;
+let batch = Bigarray.Array1.create Bigarray.char Bigarray.c_layout (4 * Git.Oid.rawsz) ;;
+assert ( (Git.Revwalk.next_batch w batch 4) = 1 ) ;;
+assert ( (Git.Oid.of_bigstring batch 0) = master_oid ) ;;
+assert ( (Git.Revwalk.next w) = None ) ;;
+
+print_string "Testing Git.Stats.*\n" ;;
+let live kind = (List.find (fun e -> e.Git.Stats.kind = kind)
+		(Array.to_list (Git.Stats.get ()))).Git.Stats.live ;;
+assert ( (live "commit") >= 1 && (live "blob") >= 1 ) ;;
+assert ( (Git.Stats.live_bytes ()) > 0 ) ;;
+
+print_string "Testing Git.Cache.*\n" ;;
+let cache = Git.Cache.create r ;;
+let c1 = Git.Cache.commit cache master_oid ;;
+assert ( (Git.Cache.commit cache master_oid) == c1 ) ;;
+assert ( (Git.Tree.id (Git.Cache.commit_tree cache c1)) = (Git.Tree.id t) ) ;;
+let st = Git.Cache.stats cache ;;
+assert ( st.Git.Cache.hits = 1 && st.Git.Cache.misses = 2 ) ;;
+Git.Cache.set_budget cache 0 ;;
+assert ( (Git.Cache.stats cache).Git.Cache.entries = 0 ) ;;
+
+print_string "Testing Git.Tree.diff\n" ;;
+assert ( (Git.Tree.diff r t t) = [||] ) ;;
+Unix.system "echo diff >> TODO && git commit -q -a -m diff" ;;
+let head_oid = let ic = Unix.open_process_in "git rev-parse HEAD" in
+	let h = input_line ic in ignore (Unix.close_process_in ic);
+	Git.Oid.from_hex h ;;
+let t2 = Git.Commit.tree (Git.Commit.lookup r head_oid) ;;
+(match Git.Tree.diff r t t2 with
+	  [| { Git.Tree.status = Git.Tree.Modified; Git.Tree.path = "TODO"; Git.Tree.old_id = o } |] ->
+		assert ( o = todo_oid )
+	| _ -> assert false) ;;
+assert ( (Git.Tree.diff ~prefix:"git.ml" r t t2) = [||] ) ;;
+
+print_string "Testing Git.Parallel\n" ;;
+let pool = Git.Parallel.create ~workers:3 ".git" ;;
+let flat_oids = Array.init flat.Git.Tree.count (Git.Oid.of_packed flat.Git.Tree.oids) ;;
+assert ( (Git.Parallel.fold_objects pool ~chunk:1 ~init:(fun () -> 0)
+	~f:(fun _ _ o n -> match o with Git.Blob _ -> n + 1 | _ -> n) ~merge:(+)
+	flat_oids) = flat.Git.Tree.count ) ;;
+let kept = Git.Parallel.fold_objects pool ~init:(fun () -> [])
+	~f:(fun _ _ o l -> o :: l) ~merge:(@) flat_oids ;;
+assert ( match kept with Git.Blob b :: _ ->
+		(try ignore (Git.Blob.size b); false with Invalid_argument _ -> true)
+	| _ -> false ) ;;
+assert ( (Git.Parallel.fold pool ~init:(fun () -> [])
+	~f:(fun _ o l -> o :: l) ~merge:(@) flat_oids
+	|> List.sort compare) = (List.sort compare (Array.to_list flat_oids)) ) ;;
+Git.Parallel.close pool ;;
+assert ( try ignore (Git.Parallel.fold pool ~init:(fun () -> 0)
+	~f:(fun _ _ n -> n) ~merge:(+) flat_oids); false
+	with Invalid_argument _ -> true ) ;;
+
+print_string "Testing Git.Index.status\n" ;;
+Git.Index.read index ;;
+Unix.system "echo status >> Makefile && rm wrappers.pl" ;;
+let st = Git.Index.status index ~workdir:"." ;;
+assert ( (Git.Strtab.to_array st.Git.Index.modified) = [| "Makefile" |] ) ;;
+assert ( (Git.Strtab.to_array st.Git.Index.deleted) = [| "wrappers.pl" |] ) ;;
+Unix.system "git checkout -q -- Makefile wrappers.pl" ;;
+
+print_string "Testing Git.Index.add_many\n" ;;
+let bulk = Git.Index.open_bare "bulk_index" ;;
+Git.Index.add_many bulk snap ;;
+assert ( (Git.Index.entrycount bulk) = snap.Git.Index.count ) ;;
+Git.Index.insert_many bulk [| Git.Index.get index 1; Git.Index.get index 1 |] ;;
+assert ( (Git.Index.entrycount bulk) = snap.Git.Index.count ) ;;
+assert ( (Git.Index.get bulk 0).Git.Index.path = (Git.Strtab.get snap.Git.Index.paths 0) ) ;;
+assert ( (Git.Index.get bulk 0).Git.Index.uid = snap.Git.Index.uids.{0} ) ;;
+assert ( Sys.file_exists "bulk_index" ) ;;
+
+print_string "Testing Git.Reference.snapshot\n" ;;
+Unix.system "git tag -a -m tagged v1 HEAD~1" ;;
+let refs = Git.Reference.snapshot ~prefix:"refs/" r ;;
+assert ( (Git.Strtab.to_array refs.Git.Reference.names) = [| "refs/heads/master"; "refs/tags/v1" |] ) ;;
+assert ( (Git.Oid.of_packed refs.Git.Reference.peeled 1) = master_oid ) ;;
+assert ( (Git.Oid.of_packed refs.Git.Reference.targets 1) <> master_oid ) ;;
+assert ( (Git.Reference.snapshot ~prefix:"refs/tags/" r).Git.Reference.count = 1 ) ;;
+
+print_string "Testing Git.CommitGraph\n" ;;
+Git.CommitGraph.write r "graph" [| master_oid |] ;;
+let graph = Git.CommitGraph.load r "graph" ;;
+assert ( (Git.CommitGraph.count graph) = 1 && not (Git.CommitGraph.mem graph head_oid) ) ;;
+assert ( Git.CommitGraph.is_ancestor graph master_oid head_oid ) ;;
+assert ( (Git.CommitGraph.merge_base graph head_oid master_oid) = [ master_oid ] ) ;;
+let graph = Git.CommitGraph.update graph [| head_oid |] ;;
+assert ( (Git.CommitGraph.generation graph head_oid) = 2 ) ;;
+assert ( Git.CommitGraph.is_ancestor graph master_oid head_oid ) ;;
+assert ( not (Git.CommitGraph.is_ancestor graph head_oid master_oid) ) ;;
+assert ( (Git.CommitGraph.count_between graph master_oid head_oid) = 1 ) ;;
+assert ( (Git.CommitGraph.merge_base graph head_oid master_oid) = [ master_oid ] ) ;;
+Git.CommitGraph.write r "graph_bad" [| master_oid |] ;;
+let () = let oc = open_out_gen [Open_wronly; Open_binary] 0 "graph_bad" in
+	seek_out oc 36;  output_string oc "\255\255\255\255";  close_out oc ;;
+assert ( try ignore (Git.CommitGraph.load r "graph_bad"); false
+	with Failure _ -> true ) ;;
+
+print_string "Testing Git.Odb.reachable\n" ;;
+let objs = Git.Odb.reachable ~types:true ~sizes:true (Git.Repository.odb r)
+	~tips:[| master_oid |] ~exclude:[||] ;;
+assert ( objs.Git.Odb.count = 2 + (List.length playthings) ) ;;
+assert ( (Git.Oid.of_packed objs.Git.Odb.oids 0) = master_oid && objs.Git.Odb.types.{0} = 1 ) ;;
+let delta = Git.Odb.reachable (Git.Repository.odb r) ~tips:[| head_oid |] ~exclude:[| master_oid |] ;;
+assert ( delta.Git.Odb.count = 3 && (Bigarray.Array1.dim delta.Git.Odb.sizes) = 0 ) ;;
+
+print_string "Testing Git.Odb.Batch\n" ;;
+let batch = Git.Odb.Batch.create (Git.Repository.odb r) ".git/objects/pack" ;;
+let batched = Git.Odb.Batch.write batch Git.Blob_e "batched\n" ;;
+assert ( (Git.Odb.Batch.write batch Git.Blob_e "batched\n") = batched ) ;;
+assert ( (Git.Odb.Batch.count batch) = 1 && (Git.Odb.Batch.read batch batched) = (Git.Blob_e, "batched\n") ) ;;
+assert ( Git.Odb.exists (Git.Repository.odb r) batched ) ;;
+assert ( (Git.Blob.content (Git.Blob.lookup r batched)) = "batched\n" ) ;;
+let pack = match Git.Odb.Batch.commit batch with Some p -> p | None -> assert false ;;
+assert ( (Unix.system ("git verify-pack " ^ (Filename.chop_suffix pack ".pack") ^ ".idx")) = Unix.WEXITED 0 ) ;;
+assert ( (Git.Odb.Batch.count batch) = 0 && (Git.Odb.Batch.commit batch) = None ) ;;
+assert ( (Unix.system ("git cat-file -e " ^ (Git.Oid.to_hex batched))) = Unix.WEXITED 0 ) ;;
+
+print_string "Testing Git.TreeBuilder.of_paths\n" ;;
+let todo2_oid = Git.TreeEntry.id (Git.Tree.entry_byname t2 "TODO") ;;
+assert ( (Git.TreeBuilder.of_paths r ~base:(Some t) [| ("TODO", 0o100644, todo2_oid) |]) = (Git.Tree.id t2) ) ;;
+let nested = Git.TreeBuilder.of_paths r ~base:(Some t) [| ("sub/dir/x", 0o100644, todo_oid) |] ;;
+assert ( try ignore (Git.TreeBuilder.of_paths r ~base:(Some t) [| ("TODO", 0o100600, todo_oid) |]); false
+	with Invalid_argument _ -> true ) ;;
+let ls = Git.Tree.flatten (Git.Tree.lookup r nested) ;;
+assert ( ls.Git.Tree.count = 1 + (List.length playthings) ) ;;
+assert ( List.mem "sub/dir/x" (Array.to_list (Git.Strtab.to_array ls.Git.Tree.paths)) ) ;;
+assert ( (Git.TreeBuilder.of_paths r ~base:(Some (Git.Tree.lookup r nested)) [| ("sub/dir/x", 0, todo_oid) |]) = (Git.Tree.id t) ) ;;
+
+print_string "Testing Git.Profile\n" ;;
+Git.Profile.reset () ;;
+ignore (Git.Odb.exists (Git.Repository.odb r) master_oid) ;;
+assert ( not Git.Profile.enabled || List.exists (fun e -> e.Git.Profile.name = "git_odb_exists"
+	&& e.Git.Profile.calls = 1) (Array.to_list (Git.Profile.dump ())) ) ;;
+
+print_string "Testing Git.Tree.grep\n" ;;
+let hits = Git.Tree.grep r t (Git.Tree.Fixed "caml_") ;;
+assert ( hits.Git.Tree.count > 0 ) ;;
+let hit_blob = Git.Blob.content (Git.Blob.lookup r (Git.TreeEntry.id
+	(Git.Tree.entry_byname t (Git.Strtab.get hits.Git.Tree.files hits.Git.Tree.file.{0})))) ;;
+assert ( (String.sub hit_blob hits.Git.Tree.offsets.{0} 5) = "caml_" ) ;;
+assert ( (Git.Tree.grep ~workers:3 ~path:".git" r t (Git.Tree.Fixed "caml_")) = hits ) ;;
+assert ( (Git.Tree.grep ~prefix:"TODO" r t (Git.Tree.Fixed "caml_")).Git.Tree.count = 0 ) ;;
+assert ( try ignore (Git.Tree.grep ~workers:2 r t (Git.Tree.Fixed "caml_")); false
+	with Invalid_argument _ -> true ) ;;
+
+print_string "Testing Git.Async\n" ;;
+let async = Git.Async.create ~workers:2 ".git" ;;
+let ticket_read = Git.Async.submit async (Git.Async.Read todo_oid) ;;
+let ticket_ref = Git.Async.submit async (Git.Async.Resolve "refs/heads/master") ;;
+let ticket_missing = Git.Async.submit async (Git.Async.Read missing) ;;
+let results = Hashtbl.create 3 ;;
+while Git.Async.pending async > 0 do
+	ignore (Unix.select [Git.Async.fd async] [] [] 1.0);
+	Array.iter (fun (k, v) -> Hashtbl.replace results k v) (Git.Async.harvest async)
+done ;;
+assert ( match Hashtbl.find results ticket_read with
+	| Git.Async.Object (Git.Blob_e, data) ->
+		let s = Git.Blob.content b in
+		Bigarray.Array1.dim data = String.length s
+		&& String.init (String.length s) (Bigarray.Array1.get data) = s
+	| _ -> false ) ;;
+assert ( (Hashtbl.find results ticket_ref) = Git.Async.Resolved head_oid ) ;;
+assert ( match Hashtbl.find results ticket_missing with Git.Async.Failed _ -> true | _ -> false ) ;;
+Git.Async.close async ;;
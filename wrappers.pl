@@ -9,7 +9,7 @@
 
 # Escape all lines in a #define after removing // comments
 sub slashn {
-	my ($_) = @_;  chomp;
+	local $_ = shift;  chomp;
 	s/\/\/[^\n]*\n/\n/g;
 	s/\n/ \\\n/g;
 	return $_ .= "\n\n";
@@ -26,7 +26,7 @@ sub alt_set_wrap_args {
 	$defargs = join(",", argdsc_map( p => sub {"TYPE$_"}, v => sub {"CONVERSION$_"} ));
 	$funargs = join(",", argdsc_map( p => sub {"value p$_"}, v => sub {"value v$_"} ));
 	$lines = join(",\n", argdsc_map(
-		p => { "\t\t*(TYPE$_ **)Data_custom_val(p$_)" },
+		p => { "\t\tGit_ptr_val(TYPE$_,p$_)" },
 		v => { "\t\tCONVERSION$_(v$_)" }
 	));
 }  # eww, global variables!  ;)
@@ -45,19 +45,24 @@ sub set_wrap_args {
 	$paramc = $ptr_cnt + $val_cnt;
 	die "CAMLparam$paramc does not exist!" if ($paramc > 5);
 	$lines = join( ",\n",
-		(map { "\t\t*(TYPE$_ **)Data_custom_val(p$_)" } (1..$ptr_cnt)),
+		(map { "\t\tGit_ptr_val(TYPE$_,p$_)" } (1..$ptr_cnt)),
 		(map { "\t\tCONVERSION$_(v$_)" } (1..$val_cnt))  );
 }  # eww, global variables!  ;)
 
+# Every wrapper brackets its libgit2 call with PROFILE_BEGIN and PROFILE_END,
+# which stubs.c defines to nothing unless built with make PROFILE=1.
+
 sub wrap_retunit {
 	set_wrap_args(@_);
 	print slashn( <<__EoC__ );
 #define wrap_retunit$argdsc(FUNCTION,$defargs)
 CAMLprim value ocaml_##FUNCTION($funargs) {
 	CAMLparam$paramc($params);
+	PROFILE_BEGIN(FUNCTION);
 	FUNCTION(  
 $lines
 	);
+	PROFILE_END(FUNCTION);
 	CAMLreturn(Val_unit);
 }
 __EoC__
@@ -72,10 +77,13 @@ sub wrap_retunit_exn {
 #define wrap_retunit_exn$argdsc(FUNCTION,ERROR,EXN,$defargs)
 CAMLprim value ocaml_##FUNCTION($funargs) {
 	CAMLparam$paramc($params);
-	pass_git_exceptions(
-	FUNCTION( 
+	int err;
+	PROFILE_BEGIN(FUNCTION);
+	err = FUNCTION( 
 $lines
-	), ERROR, EXN ); 
+	);
+	PROFILE_END(FUNCTION);
+	pass_git_exceptions( err, ERROR, EXN ); 
 	CAMLreturn(Val_unit);
 }
 __EoC__
@@ -90,12 +98,16 @@ sub wrap_retval {
 #define wrap_retval$argdsc(FUNCTION,RETURN_CONVERSION,$defargs)
 CAMLprim value ocaml_##FUNCTION($funargs) {
 	CAMLparam$paramc($params);
-	CAMLreturn( RETURN_CONVERSION( FUNCTION(  
+	value ret;
+	PROFILE_BEGIN(FUNCTION);
+	ret = RETURN_CONVERSION( FUNCTION(  
 $lines
-	) ) ); 
+	) );
+	PROFILE_END(FUNCTION);
+	CAMLreturn(ret);
 }
 __EoC__
-}
+}  # profiles the conversion too, as we do not know the C return type
 
 map { wrap_retval(@$_); } (@valargs, @ptrargs);
 
@@ -106,15 +118,15 @@ sub wrap_retptr {
 #define wrap_retptr$argdsc(FUNCTION,NEWTYPE,ERROR,$defargs)
 CAMLprim value ocaml_##FUNCTION($funargs) {
 	CAMLparam$paramc($params);
-	CAMLlocal1(r);
-	r = caml_alloc_git_ptr(NEWTYPE);
-	*(NEWTYPE **)Data_custom_val(r) =
-	FUNCTION( 
+	NEWTYPE *ptr;
+	PROFILE_BEGIN(FUNCTION);
+	ptr = FUNCTION( 
 $lines
 	);
-	if( *(NEWTYPE **)Data_custom_val(r) == NULL )
+	PROFILE_END(FUNCTION);
+	if( ptr == NULL )
 		caml_invalid_argument( #ERROR " : " #FUNCTION " returned null." );
-	CAMLreturn(r);
+	CAMLreturn( caml_wrap_git_ptr(NEWTYPE,ptr) );
 }
 __EoC__
 }
@@ -129,16 +141,121 @@ sub wrap_setptr {
 #define wrap_setptr$argdsc(FUNCTION,NEWTYPE,ERROR,EXN,$defargs)
 CAMLprim value ocaml_##FUNCTION($funargs) {
 	CAMLparam$paramc($params);
-	CAMLlocal1(r);
-	r = caml_alloc_git_ptr(NEWTYPE);
-	pass_git_exceptions(
-	FUNCTION( (NEWTYPE **)Data_custom_val(r),
+	NEWTYPE *ptr = NULL;
+	int err;
+	PROFILE_BEGIN(FUNCTION);
+	err = FUNCTION( &ptr,
 $lines
-	), ERROR, EXN );
-	CAMLreturn(r);
+	);
+	PROFILE_END(FUNCTION);
+	pass_git_exceptions( err, ERROR, EXN );
+	CAMLreturn( caml_wrap_git_ptr(NEWTYPE,ptr) );
 }
 __EoC__
 } # We support both invalid_argument and failwith
 
 map { wrap_setptr(@$_); } (@valargs, [0,3], [0,4], @ptrargs, [1,3]);
 
+
+# The blocking variants release the OCaml runtime lock around the libgit2
+# call, so other threads keep running while we touch the disk.  Nothing may
+# point into the OCaml heap while the lock is released, so each value
+# argument gets a C type, a COPY conversion run before the call, and a
+# RELEASE run afterwards, ala char *,String_copy,free or int,Int_val,Release_none.
+# Pointer arguments already live outside the heap, and the custom blocks
+# holding them stay rooted by CAMLparam.  The call holds the lock of the
+# repository behind the first pointer, found by TYPE1_repo_key in stubs.c,
+# while wrappers without pointer arguments open new handles and lock none.
+
+sub set_blocking_args {
+	return unless @_;
+	($ptr_cnt,$val_cnt) = @_;
+	set_wrap_args(@_);
+	$defargs = join( ",",
+		(map { "TYPE$_"; } (1..$ptr_cnt)),
+		(map { "CTYPE$_,COPY$_,RELEASE$_"; } (1..$val_cnt))  );
+	$copies = join( "\n",
+		(map { "\tTYPE$_ *pa$_ = Git_ptr_val(TYPE$_,p$_);" } (1..$ptr_cnt)),
+		(map { "\tCTYPE$_ va$_ = COPY$_(v$_);" } (1..$val_cnt))  );
+	$releases = join( "\n",
+		(map { "\tRELEASE$_(va$_);" } (1..$val_cnt))  );
+	$lines = join( ",\n",
+		(map { "\t\tpa$_" } (1..$ptr_cnt)),
+		(map { "\t\tva$_" } (1..$val_cnt))  );
+	$repokey = $ptr_cnt ? "TYPE1##_repo_key(pa1)" : "NULL";
+}  # eww, even more global variables!
+
+sub wrap_retunit_exn_blocking {
+	set_blocking_args(@_);
+	print slashn( <<__EoC__ );
+#define wrap_retunit_exn_blocking$argdsc(FUNCTION,ERROR,EXN,$defargs)
+CAMLprim value ocaml_##FUNCTION($funargs) {
+	CAMLparam$paramc($params);
+	int err;
+	struct repo_lock *lk;
+$copies
+	enter_repo_section(lk,$repokey);
+	PROFILE_BEGIN(FUNCTION);
+	err = FUNCTION( 
+$lines
+	);
+	PROFILE_END(FUNCTION);
+	leave_repo_section(lk);
+$releases
+	pass_git_exceptions( err, ERROR, EXN );
+	CAMLreturn(Val_unit);
+}
+__EoC__
+}
+
+map { wrap_retunit_exn_blocking(@$_); } ([1,0], [1,1], [1,2]);
+
+sub wrap_retval_blocking {
+	set_blocking_args(@_);
+	print slashn( <<__EoC__ );
+#define wrap_retval_blocking$argdsc(FUNCTION,RTYPE,RETURN_CONVERSION,$defargs)
+CAMLprim value ocaml_##FUNCTION($funargs) {
+	CAMLparam$paramc($params);
+	RTYPE ret;
+	struct repo_lock *lk;
+$copies
+	enter_repo_section(lk,$repokey);
+	PROFILE_BEGIN(FUNCTION);
+	ret = FUNCTION( 
+$lines
+	);
+	PROFILE_END(FUNCTION);
+	leave_repo_section(lk);
+$releases
+	CAMLreturn( RETURN_CONVERSION(ret) );
+}
+__EoC__
+}
+
+map { wrap_retval_blocking(@$_); } ([1,0], [1,1]);
+
+sub wrap_setptr_blocking {
+	set_blocking_args(@_);
+	print slashn( <<__EoC__ );
+#define wrap_setptr_blocking$argdsc(FUNCTION,NEWTYPE,ERROR,EXN,$defargs)
+CAMLprim value ocaml_##FUNCTION($funargs) {
+	CAMLparam$paramc($params);
+	NEWTYPE *ptr = NULL;
+	int err;
+	struct repo_lock *lk;
+$copies
+	enter_repo_section(lk,$repokey);
+	PROFILE_BEGIN(FUNCTION);
+	err = FUNCTION( &ptr,
+$lines
+	);
+	PROFILE_END(FUNCTION);
+	leave_repo_section(lk);
+$releases
+	pass_git_exceptions( err, ERROR, EXN );
+	CAMLreturn( caml_wrap_git_ptr(NEWTYPE,ptr) );
+}
+__EoC__
+}
+
+map { wrap_setptr_blocking(@$_); } ([0,1], [0,2], [0,4], [1,0], [1,1]);